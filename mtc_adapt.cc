@@ -0,0 +1,109 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <cstdio>
+
+#include "mtc_log.hh"
+#include "mtc_time.hh"
+#include "mtc_adapt.hh"
+
+MTC_LevelControl::MTC_LevelControl(int min, int max, int start,
+                                   const MTC_Log &log) :
+    mtclog_(log),
+    min_(min),
+    max_(max),
+    level_(start),
+    calm_(0),
+    backlog_max_(0),
+    primed_(false),
+    drops_(0),
+    busy_ns_(0),
+    at_ns_(0),
+    segments_(0),
+    level_sum_(0),
+    ups_(0),
+    downs_(0)
+{
+    if (level_ < min_)
+        level_ = min_;
+    if (level_ > max_)
+        level_ = max_;
+}
+
+int
+MTC_LevelControl::next(uint64_t drops, uint64_t busy_ns, size_t threads) {
+    uint64_t now = monotonic_ns();
+    if (!primed_) {
+        //the first segment, nothing to judge yet
+        primed_ = true;
+    } else {
+        uint64_t dropped = drops - drops_;
+        uint64_t wall    = now - at_ns_;
+        unsigned busy    = (wall && threads) ?
+            (unsigned)(100*(busy_ns - busy_ns_)/(wall*threads)) : 0;
+        int prev = level_;
+        const char *why = 0;
+        if (dropped) {
+            level_ -= ADAPT_DROP_STEP;
+            why = "drops";
+        } else if (backlog_max_ >= ADAPT_BACKLOG_HIGH_PCT) {
+            --level_;
+            why = "backlog";
+        } else if (busy >= ADAPT_BUSY_HIGH_PCT) {
+            --level_;
+            why = "cpu";
+        } else if (backlog_max_ >= ADAPT_BACKLOG_LOW_PCT || busy >= ADAPT_BUSY_LOW_PCT) {
+            calm_ = 0; //busy enough as it is
+        } else if (++calm_ >= ADAPT_CALM_SEGMENTS) {
+            ++level_;
+            why = "calm";
+        }
+        if (why)
+            calm_ = 0;
+        if (level_ < min_)
+            level_ = min_;
+        if (level_ > max_)
+            level_ = max_;
+        if (level_ != prev) {
+            if (level_ < prev)
+                ++downs_;
+            else
+                ++ups_;
+            mtclog_.warn("compression level %d -> %d (%s: drops=%lu, backlog=%u%%, cpu=%u%%)\n",
+                         prev, level_, why, dropped, backlog_max_, busy);
+        }
+    }
+    drops_       = drops;
+    busy_ns_     = busy_ns;
+    at_ns_       = now;
+    backlog_max_ = 0;
+    ++segments_;
+    level_sum_  += level_;
+    return level_;
+}
+
+void
+MTC_LevelControl::dump_stats() const {
+    mtclog_.warn("    adaptive level: %d..%d, now %d, average %.1f, raised %lu, lowered %lu times\n",
+                 min_, max_, level_,
+                 segments_ ? (double)level_sum_/segments_ : (double)level_, ups_, downs_);
+}
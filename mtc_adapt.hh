@@ -0,0 +1,75 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_ADAPT_HH
+#define MTC_ADAPT_HH
+
+#include <stdint.h>
+#include <cstddef>
+
+#define ADAPT_DROP_STEP        3  //levels given up at once when the inputs drop
+#define ADAPT_BACKLOG_HIGH_PCT 75 //pipe fill that costs a level
+#define ADAPT_BACKLOG_LOW_PCT  25
+#define ADAPT_BUSY_HIGH_PCT    90 //compressing CPU that costs a level
+#define ADAPT_BUSY_LOW_PCT     50
+#define ADAPT_CALM_SEGMENTS    2  //quiet segments in a row before a level is added
+
+/*
+ * Compression level of an output's segments with --adapt-level. The
+ * output samples its pipe's fill while writing and asks for the next
+ * level whenever it opens a segment. The controller then looks at
+ * what happened since the last segment: any input drop gives up
+ * ADAPT_DROP_STEP levels, a pipe at ADAPT_BACKLOG_HIGH_PCT or the
+ * compressing CPU at ADAPT_BUSY_HIGH_PCT one level. Only after
+ * ADAPT_CALM_SEGMENTS segments with neither does it try one level
+ * higher. Levels stay within [min, max]. Used by one thread only.
+ */
+class MTC_LevelControl {
+public:
+    MTC_LevelControl(int min, int max, int start, const MTC_Log &log);
+
+    /* fill of the segment's pipe, in percent */
+    void backlog(unsigned pct) { if (pct > backlog_max_) backlog_max_ = pct; }
+    /* level of the next segment; drops and busy_ns are running totals,
+     * busy_ns is CPU time spent compressing on up to threads CPUs */
+    int  next(uint64_t drops, uint64_t busy_ns, size_t threads);
+
+    int  level() const { return level_; }
+    void dump_stats() const;
+
+protected:
+    const MTC_Log
+    &mtclog_;
+    int      min_;
+    int      max_;
+    int      level_;
+    unsigned calm_;        //quiet segments in a row
+    unsigned backlog_max_; //since the last next()
+    bool     primed_;      //baselines below are set
+    uint64_t drops_;
+    uint64_t busy_ns_;
+    uint64_t at_ns_;       //CLOCK_MONOTONIC of the last next()
+    uint64_t segments_;
+    uint64_t level_sum_;
+    uint64_t ups_;
+    uint64_t downs_;
+};
+
+#endif /* MTC_ADAPT_HH */
@@ -0,0 +1,263 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "mtc_log.hh"
+#include "mtc_affinity.hh"
+
+#define CPULIST_LEN 256
+
+MTC_CpuSet              MTC_Affinity::all_;
+MTC_CpuSet              MTC_Affinity::roles_[MTC_Affinity::ROLE_CNT];
+std::vector<int>        MTC_Affinity::input_nodes_;
+std::vector<MTC_CpuSet> MTC_Affinity::node_cpus_;
+bool                    MTC_Affinity::numa_local_ = false;
+
+bool
+MTC_CpuSet::parse(const char *list) {
+    CPU_ZERO(&set_);
+    cnt_ = 0;
+    const char *s = list;
+    while (*s && *s != '\n') {
+        char *end = 0;
+        long lo = strtol(s, &end, 10);
+        long hi = lo;
+        if (end == s || lo < 0)
+            return false;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo)
+                return false;
+        }
+        if (hi >= CPU_SETSIZE || (*end != ',' && *end != '\0' && *end != '\n'))
+            return false;
+        for (long c = lo; c <= hi; ++c) {
+            if (!CPU_ISSET(c, &set_)) {
+                CPU_SET(c, &set_);
+                ++cnt_;
+            }
+        }
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return cnt_ > 0;
+}
+
+void
+MTC_CpuSet::assign(const cpu_set_t &set) {
+    set_ = set;
+    cnt_ = CPU_COUNT(&set_);
+}
+
+int
+MTC_CpuSet::nth(size_t i) const {
+    if (cnt_ == 0)
+        return -1;
+    i %= cnt_;
+    for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (CPU_ISSET(c, &set_) && i-- == 0)
+            return c;
+    }
+    return -1;
+}
+
+void
+MTC_CpuSet::format(char *buf, size_t len) const {
+    size_t n = 0;
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE && n < len; ) {
+        if (!CPU_ISSET(c, &set_)) {
+            ++c;
+            continue;
+        }
+        int hi = c;
+        while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, &set_))
+            ++hi;
+        if (hi == c)
+            n += snprintf(buf + n, len - n, "%s%d", n ? "," : "", c);
+        else
+            n += snprintf(buf + n, len - n, "%s%d-%d", n ? "," : "", c, hi);
+        c = hi + 1;
+    }
+}
+
+void
+MTC_Affinity::init() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        all_.assign(set);
+}
+
+bool
+MTC_Affinity::set_cpus(role_t role, const char *list) {
+    return roles_[role].parse(list);
+}
+
+void
+MTC_Affinity::set_input_node(size_t idx, int node) {
+    if (input_nodes_.size() <= idx)
+        input_nodes_.resize(idx + 1, -1);
+    input_nodes_[idx] = node;
+    if (node >= 0 && node_cpus_.size() <= (size_t)node)
+        node_cpus_.resize(node + 1);
+    if (node >= 0 && node_cpus_[node].empty())
+        node_cpus(node, node_cpus_[node]);
+}
+
+int
+MTC_Affinity::input_node(size_t idx) {
+    return idx < input_nodes_.size() ? input_nodes_[idx] : -1;
+}
+
+int
+MTC_Affinity::common_node() {
+    int node = -1;
+    for (size_t i = 0; i < input_nodes_.size(); ++i) {
+        if (input_nodes_[i] < 0 || (node >= 0 && input_nodes_[i] != node))
+            return -1;
+        node = input_nodes_[i];
+    }
+    return node;
+}
+
+const MTC_CpuSet &
+MTC_Affinity::cpus_for(role_t role, size_t idx, int &cpu) {
+    cpu = -1;
+    if (role == ROLE_CAPTURE) {
+        if (!roles_[role].empty()) {
+            cpu = roles_[role].nth(idx);
+            return roles_[role];
+        }
+        int node = input_node(idx);
+        if (node >= 0 && !node_cpus_[node].empty())
+            return node_cpus_[node];
+        return all_;
+    }
+    if (!roles_[role].empty())
+        return roles_[role];
+    int node = numa_local_ ? common_node() : -1;
+    if (node >= 0 && !node_cpus_[node].empty())
+        return node_cpus_[node];
+    return all_;
+}
+
+void
+MTC_Affinity::place(role_t role, size_t idx, const MTC_Log &log) {
+    if (all_.empty())
+        return; //init() was not called or could not read the mask
+    int cpu;
+    const MTC_CpuSet &cpus = cpus_for(role, idx, cpu);
+    cpu_set_t set;
+    if (cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    } else {
+        set = cpus.set();
+    }
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        log.warn("cannot pin %s thread: %s\n", role_name(role), strerror(err));
+    }
+}
+
+bool
+MTC_Affinity::place_node(int node, const MTC_Log &log) {
+    if (node < 0 || (size_t)node >= node_cpus_.size() || node_cpus_[node].empty())
+        return false;
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                     &node_cpus_[node].set());
+    if (err != 0) {
+        log.warn("cannot move to node %d: %s\n", node, strerror(err));
+        return false;
+    }
+    return true;
+}
+
+int
+MTC_Affinity::nic_node(const char *uri) {
+    //formats that capture from a local interface
+    static const char *live[] = { "int:", "ring:", "pcapint:", "xdp:", 0 };
+    const char *dev = 0;
+    for (const char **f = live; *f; ++f) {
+        if (strncmp(uri, *f, strlen(*f)) == 0) {
+            dev = uri + strlen(*f);
+            break;
+        }
+    }
+    if (!dev || !*dev || strchr(dev, '/'))
+        return -1;
+    std::string path = std::string("/sys/class/net/") + dev + "/device/numa_node";
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        return -1;
+    int node = -1;
+    if (fscanf(f, "%d", &node) != 1)
+        node = -1;
+    fclose(f);
+    return node; //-1 on machines without NUMA
+}
+
+bool
+MTC_Affinity::node_cpus(int node, MTC_CpuSet &cpus) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    char list[CPULIST_LEN];
+    bool ok = fgets(list, sizeof(list), f) && cpus.parse(list);
+    fclose(f);
+    return ok;
+}
+
+const char *
+MTC_Affinity::role_name(role_t role) {
+    static const char *names[ROLE_CNT] = { "capture", "merge", "compress", "writer" };
+    return names[role];
+}
+
+void
+MTC_Affinity::dump(size_t inputs, const MTC_Log &log) {
+    char list[CPULIST_LEN];
+    int cpu;
+    all_.format(list, sizeof(list));
+    log.warn("placement: process cpus %s\n", list);
+    for (size_t i = 0; i < inputs; ++i) {
+        const MTC_CpuSet &cpus = cpus_for(ROLE_CAPTURE, i, cpu);
+        if (cpu >= 0)
+            snprintf(list, sizeof(list), "%d", cpu);
+        else
+            cpus.format(list, sizeof(list));
+        log.warn("placement: capture %lu on cpus %s, nic node %d\n",
+                  i, list, input_node(i));
+    }
+    for (int r = ROLE_MERGE; r < ROLE_CNT; ++r) {
+        cpus_for((role_t)r, 0, cpu).format(list, sizeof(list));
+        log.warn("placement: %s on cpus %s\n", role_name((role_t)r), list);
+    }
+}
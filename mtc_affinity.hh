@@ -0,0 +1,98 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_AFFINITY_HH
+#define MTC_AFFINITY_HH
+
+#include <sched.h>
+#include <cstddef>
+#include <vector>
+
+/* a set of CPUs, written as a list like "0-3,8,10-11" */
+class MTC_CpuSet {
+public:
+    MTC_CpuSet() : cnt_(0) { CPU_ZERO(&set_); }
+
+    bool parse(const char *list);
+    void assign(const cpu_set_t &set);
+    bool empty() const { return cnt_ == 0; }
+    size_t count() const { return cnt_; }
+    int  nth(size_t i) const; //i-th cpu, wrapping around
+    const cpu_set_t &set() const { return set_; }
+    void format(char *buf, size_t len) const;
+
+protected:
+    cpu_set_t set_;
+    size_t    cnt_;
+};
+
+/*
+ * Where threads run and packet memory lives. Configured by main() before
+ * any thread is started; every thread then calls place() with its role
+ * as the first thing it does. A role without CPUs of its own gets all
+ * CPUs the process started with, so threads do not inherit the CPU of
+ * whichever thread created them.
+ *
+ * Capture work of an input goes to one CPU of --cpu-capture, picked by
+ * input index, or with --numa-local to the CPUs of the node its NIC is
+ * attached to. Buffers that libtrace allocates when reading land on the
+ * node of the thread that first touches them, so pinning capture is
+ * also what keeps per-input packet memory local. With --numa-local the
+ * other roles default to the node all inputs share, if they share one.
+ */
+class MTC_Affinity {
+public:
+    enum role_t {
+        ROLE_CAPTURE,  //capture threads and input queues
+        ROLE_MERGE,    //the merging main thread
+        ROLE_COMPRESS, //compressor workers and --pipeout commands
+        ROLE_WRITER,   //threads that write, open and close segments
+        ROLE_CNT
+    };
+
+    static void init();
+    static bool set_cpus(role_t role, const char *list);
+    static void set_input_node(size_t idx, int node);
+    static int  input_node(size_t idx);
+    static int  common_node(); //node of all inputs, -1 if they differ
+    static void set_numa_local() { numa_local_ = true; }
+
+    /* pins the calling thread, idx picks the CPU of a capture */
+    static void place(role_t role, size_t idx, const MTC_Log &log);
+    /* pins the calling thread to a node, to first-touch memory there */
+    static bool place_node(int node, const MTC_Log &log);
+
+    static int  nic_node(const char *uri);
+    static bool node_cpus(int node, MTC_CpuSet &cpus);
+    static const char *role_name(role_t role);
+    static void dump(size_t inputs, const MTC_Log &log);
+
+protected:
+    static const MTC_CpuSet &cpus_for(role_t role, size_t idx, int &cpu);
+
+protected:
+    static MTC_CpuSet              all_;
+    static MTC_CpuSet              roles_[ROLE_CNT];
+    static std::vector<int>        input_nodes_;
+    static std::vector<MTC_CpuSet> node_cpus_;
+    static bool                    numa_local_;
+};
+
+#endif /* MTC_AFFINITY_HH */
@@ -0,0 +1,261 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <poll.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libtrace.h>
+#include <libtrace_parallel.h>
+#include <cstring>
+#include <cassert>
+
+#include "mtc_log.hh"
+#include "mtc_time.hh"
+#include "mtc_output.hh"
+#include "mtc_capture.hh"
+#include "mtc_pool.hh"
+#include "mtc_affinity.hh"
+#include "mtc_slice.hh"
+
+MTC_Capture::MTC_Capture(MTC_Input *input, int idx, size_t ringsize,
+                         MTC_PacketPool &pool, const MTC_Log &log) :
+    input_(input),
+    idx_(idx),
+    pool_(&pool),
+    mtclog_(log),
+    full_(ringsize),
+    free_(ringsize),
+    scratch_(0),
+    packets_cnt_(0),
+    held_(0),
+    drops_ns_(0),
+    drops_packets_(0),
+    started_(false),
+    stop_(false),
+    pause_(false),
+    done_(false)
+{
+    //every packet we own fits into either ring, so pushes never fail
+    packets_cnt_ = full_.capacity();
+    for (size_t i = 0; i < packets_cnt_; ++i) {
+        if (!free_.push(pool_->get())) {
+            mtclog_.panic("capture ring for input %d is too small\n", idx_);
+        }
+    }
+    scratch_ = pool_->get();
+}
+
+MTC_Capture::MTC_Capture(MTC_Input *input, int idx, size_t ringsize,
+                         const MTC_Log &log) :
+    input_(input),
+    idx_(idx),
+    pool_(0),
+    mtclog_(log),
+    full_(ringsize),
+    free_(1),
+    scratch_(0),
+    packets_cnt_(0),
+    held_(0),
+    drops_ns_(0),
+    drops_packets_(0),
+    started_(false),
+    stop_(false),
+    pause_(false),
+    done_(false)
+{
+    //packets come from libtrace and go back there
+}
+
+MTC_Capture::~MTC_Capture() {
+    join();
+    libtrace_packet_t *p;
+    slot_t s;
+    if (!pool_) {
+        while (full_.pop(s))
+            trace_free_packet(input_->in_, s.packet_);
+        return;
+    }
+    while (free_.pop(p))
+        pool_->put(p);
+    while (full_.pop(s))
+        pool_->put(s.packet_);
+    if (held_)
+        pool_->put(held_);
+    pool_->put(scratch_);
+}
+
+void
+MTC_Capture::start() {
+    if (pthread_create(&thread_, NULL, run, this) != 0) {
+        mtclog_.panic("pthread_create for input %d: %s\n",
+                      idx_, strerror(errno));
+    }
+    started_ = true;
+}
+
+void
+MTC_Capture::join() {
+    if (!started_)
+        return;
+    stop();
+    pthread_join(thread_, NULL);
+    started_ = false;
+}
+
+void
+MTC_Capture::recycle(libtrace_packet_t *p) {
+    if (!pool_) {
+        trace_free_packet(input_->in_, p);
+        return;
+    }
+    bool ok = free_.push(p);
+    assert(ok);
+    (void)ok;
+}
+
+void *
+MTC_Capture::run(void *cap) {
+    static_cast<MTC_Capture*>(cap)->loop();
+    return NULL;
+}
+
+void
+MTC_Capture::wait_fd(int fd) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, CAPTURE_STOP_CHECK_MS) < 0 && errno != EINTR) {
+        mtclog_.warn("poll returned error for waiting on fd %d (%s)\n",
+                     fd, input_->uri_);
+    }
+}
+
+void
+MTC_Capture::wait_sleep(double seconds) {
+    if (seconds > CAPTURE_STOP_CHECK_MS/1000.0)
+        seconds = CAPTURE_STOP_CHECK_MS/1000.0;
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec= (long)((seconds - ts.tv_sec)*1e9);
+    ::nanosleep(&ts, NULL);
+}
+
+void
+MTC_Capture::sample_drops(bool now) {
+    uint64_t ns = monotonic_ns();
+    if (!now && ns - drops_ns_ < CAPTURE_DROPS_MS*1000000ULL)
+        return;
+    input_->update_drops();
+    drops_ns_ = ns;
+}
+
+bool
+MTC_Capture::wait_paused() {
+    if (!full_.empty()) {
+        //the merger drops these first, nothing may point into the input then
+        wait_sleep(RING_DRAIN_WAIT_MS/1000.0);
+        return true;
+    }
+    sample_drops(true); //a paused input may not tell
+    if (trace_pause(input_->in_) == -1)
+        trace_perror(input_->in_, "trace_pause");
+    mtclog_.debug("capture paused on %d (%s)\n", idx_, input_->uri_);
+    while (pause_.load(std::memory_order_relaxed) &&
+           !stop_.load(std::memory_order_relaxed))
+        wait_sleep(CAPTURE_STOP_CHECK_MS/1000.0);
+    if (trace_start(input_->in_) == -1) {
+        trace_perror(input_->in_, "trace_start");
+        return false;
+    }
+    mtclog_.debug("capture resumed on %d (%s)\n", idx_, input_->uri_);
+    return true;
+}
+
+void
+MTC_Capture::loop() {
+    MTC_Affinity::place(MTC_Affinity::ROLE_CAPTURE, idx_, mtclog_);
+    libtrace_packet_t *p = 0;
+    bool terminated = false;
+
+    while (!terminated && !stop_.load(std::memory_order_relaxed)) {
+        if (p == 0 || p == scratch_) {
+            libtrace_packet_t *fp;
+            p = free_.pop(fp) ? fp : scratch_;
+        }
+        if (pause_.load(std::memory_order_relaxed)) {
+            terminated = !wait_paused();
+            continue;
+        }
+        libtrace_eventobj_t evt = trace_event(input_->in_, p);
+        switch (evt.type) {
+        case TRACE_EVENT_SLEEP:
+            sample_drops(false);
+            wait_sleep(evt.seconds);
+            continue;
+        case TRACE_EVENT_IOWAIT:
+            sample_drops(false);
+            wait_fd(evt.fd);
+            continue;
+        case TRACE_EVENT_PACKET:
+            if (++drops_packets_ >= CAPTURE_DROPS_PACKETS) {
+                drops_packets_ = 0;
+                sample_drops(false);
+            }
+            break;
+        case TRACE_EVENT_TERMINATE:
+            mtclog_.debug("TERMINATE on %d (%s)\n", idx_, input_->uri_);
+            terminated = true;
+            continue;
+        default:
+            trace_perror(input_->in_, "Unknown event type on %s", input_->uri_);
+            terminated = true;
+            continue;
+        }
+
+        uint16_t ethertype;
+        uint32_t remaining;
+        void *vp = trace_get_layer3(p, &ethertype, &remaining);
+        if (!vp || ethertype == 0xffff) {
+            mtclog_.warn("skipping non L3 (ethernet) packet on %s\n", input_->uri_);
+            continue;
+        }
+        if (p == scratch_) {
+            //merger is not giving packets back fast enough
+            input_->ring_drops_.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        if (input_->slicer_)
+            input_->sliced_bytes_ += input_->slicer_->slice(p, vp, ethertype, remaining);
+        slot_t s;
+        s.packet_ = p;
+        s.ts_     = trace_get_erf_timestamp(p);
+        bool ok = full_.push(s);
+        assert(ok);
+        (void)ok;
+        p = 0;
+    }
+    held_ = (p == scratch_) ? 0 : p;
+    sample_drops(true);
+    done_.store(true, std::memory_order_release);
+}
@@ -0,0 +1,120 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_CAPTURE_HH
+#define MTC_CAPTURE_HH
+
+#include <pthread.h>
+#include <atomic>
+
+#include "mtc_ring.hh"
+
+#define CAPTURE_RING_DEFAULT 4096
+#define CAPTURE_STOP_CHECK_MS 100
+#define RING_DRAIN_WAIT_MS 1 //paused capture waiting for its ring to empty
+#define CAPTURE_DROPS_MS 100     //how often the thread samples the input's drops
+#define CAPTURE_DROPS_PACKETS 1024 //packets between looking at the clock for it
+
+class MTC_Input;
+class MTC_PacketPool;
+
+/*
+ * Capture thread for a single input. The thread drains its input with
+ * trace_event() and hands timestamped packets to the merger through a
+ * bounded SPSC ring; the merger gives packets back through a second
+ * ring once they have been written. When the merger falls behind and
+ * no free packet is left, the thread keeps draining the input into a
+ * scratch packet and counts the loss in MTC_Input::ring_drops_.
+ * Packets are taken from the pool up front and returned on destruction,
+ * both from the merging thread. While paused, the input is stopped with
+ * trace_pause() so the kernel or NIC stops delivering to it. The thread
+ * owns the input, so it also samples its drops for everybody else
+ * (MTC_Input::update_drops()).
+ *
+ * A fed capture has no thread of its own: one receive queue of a
+ * parallel input (MTC_ParallelInput) delivers libtrace's packets into
+ * it, and recycling hands them straight back to libtrace.
+ */
+class MTC_Capture {
+public:
+    struct slot_t {
+        libtrace_packet_t *packet_;
+        uint64_t           ts_; //erf timestamp
+    };
+
+    MTC_Capture(MTC_Input *input, int idx, size_t ringsize,
+                MTC_PacketPool &pool, const MTC_Log &log);
+    /* fed capture, see above */
+    MTC_Capture(MTC_Input *input, int idx, size_t ringsize, const MTC_Log &log);
+    ~MTC_Capture();
+
+    void start();
+    void stop() { stop_.store(true, std::memory_order_relaxed); }
+    /* -W: the thread pauses its input once the merger has taken
+     * everything in the ring, and restarts it when told to */
+    void pause(bool on) { pause_.store(on, std::memory_order_relaxed); }
+    void join();
+
+    /* merger side */
+    bool pop(slot_t &s) { return full_.pop(s); }
+    void recycle(libtrace_packet_t *p);
+    bool finished() const {
+        return done_.load(std::memory_order_acquire) && full_.empty();
+    }
+
+    /* queue side of a fed capture */
+    bool deliver(libtrace_packet_t *p, uint64_t ts) {
+        slot_t s = { p, ts };
+        return full_.push(s);
+    }
+    void finish() { done_.store(true, std::memory_order_release); }
+    int  idx() const { return idx_; }
+
+protected:
+    static void *run(void *cap);
+    void loop();
+    void wait_fd(int fd);
+    void wait_sleep(double seconds);
+    bool wait_paused(); //false if the input cannot be restarted
+    void sample_drops(bool now);
+
+protected:
+    MTC_Input *input_;
+    int        idx_;
+    MTC_PacketPool *pool_; //0 for a fed capture
+    const MTC_Log
+    &mtclog_;
+
+    MTC_Ring<slot_t>             full_;
+    MTC_Ring<libtrace_packet_t*> free_;
+    libtrace_packet_t           *scratch_;
+    size_t                       packets_cnt_;
+    libtrace_packet_t           *held_; //left over by the thread on exit
+    uint64_t                     drops_ns_; //when the drops were sampled last
+    size_t                       drops_packets_; //since the clock was looked at
+
+    pthread_t         thread_;
+    bool              started_;
+    std::atomic<bool> stop_;
+    std::atomic<bool> pause_;
+    std::atomic<bool> done_;
+};
+
+#endif /* MTC_CAPTURE_HH */
@@ -0,0 +1,439 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <cstdio>
+#include <cstring>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "mtc_log.hh"
+#include "mtc_time.hh"
+#include "mtc_compress.hh"
+#include "mtc_affinity.hh"
+
+#define COMPRESS_PIPEBUFSZ (8*1024*1024)
+#define LZ4_LEVEL_MAX      12 //LZ4HC_CLEVEL_MAX, lz4hc.h is not needed otherwise
+
+MTC_CompressStream::MTC_CompressStream(MTC_Compressor &comp, int fdw,
+                                       const char *name, int level) :
+    comp_(comp),
+    pipe_r_(-1),
+    pipe_w_(-1),
+    fdw_(fdw),
+    level_(level),
+    window_(0),
+    window_cnt_(2*comp.threads()),
+    bytes_in_(0),
+    bytes_out_(0),
+    bytes_framed_(0),
+    write_failed_(false),
+    started_(false)
+{
+    strncpy(name_, name, sizeof(name_)-1);
+    name_[sizeof(name_)-1] = '\0';
+
+    int pipefd[2];
+    if (0 != ::pipe2(pipefd, O_CLOEXEC)) {
+        comp_.log().panic("Error creating compressor pipe: '%s'\n", strerror(errno));
+    }
+    for (int bufsz = COMPRESS_PIPEBUFSZ; bufsz >= 64*1024; bufsz /= 2) {
+        if (::fcntl(pipefd[1], F_SETPIPE_SZ, bufsz) >= 0)
+            break;
+    }
+    pipe_r_ = pipefd[0];
+    pipe_w_ = pipefd[1];
+
+    window_ = new block_t[window_cnt_];
+    for (size_t i = 0; i < window_cnt_; ++i) {
+        block_t &b = window_[i];
+        b.stream_  = this;
+        b.in_      = new char[comp_.block()];
+        b.in_len_  = 0;
+        b.out_     = new char[comp_.bound()];
+        b.out_len_ = 0;
+        b.busy_    = false;
+        b.done_    = false;
+        b.failed_  = false;
+        b.next_    = 0;
+    }
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&done_, NULL);
+
+    if (pthread_create(&thread_, NULL, run, this) != 0) {
+        comp_.log().panic("pthread_create for compressor stream: %s\n",
+                          strerror(errno));
+    }
+    started_ = true;
+}
+
+MTC_CompressStream::~MTC_CompressStream() {
+    wait();
+    for (size_t i = 0; i < window_cnt_; ++i) {
+        delete [] window_[i].in_;
+        delete [] window_[i].out_;
+    }
+    delete [] window_;
+    pthread_cond_destroy(&done_);
+    pthread_mutex_destroy(&lock_);
+}
+
+void
+MTC_CompressStream::wait() {
+    if (!started_)
+        return;
+    pthread_join(thread_, NULL);
+    started_ = false;
+}
+
+void
+MTC_CompressStream::completed(block_t *b) {
+    pthread_mutex_lock(&lock_);
+    b->done_ = true;
+    pthread_cond_broadcast(&done_);
+    pthread_mutex_unlock(&lock_);
+}
+
+void *
+MTC_CompressStream::run(void *stream) {
+    static_cast<MTC_CompressStream*>(stream)->loop();
+    return NULL;
+}
+
+void
+MTC_CompressStream::write_block(block_t *b) {
+    pthread_mutex_lock(&lock_);
+    while (!b->done_)
+        pthread_cond_wait(&done_, &lock_);
+    pthread_mutex_unlock(&lock_);
+
+    b->busy_ = false;
+    if (b->failed_) {
+        comp_.log().warn("compression failed, %lu bytes of %s lost\n",
+                         b->in_len_, name_);
+        bytes_framed_ += b->in_len_; //later frames keep their offsets
+        return;
+    }
+    mtc_index_frame_t frame = { bytes_framed_, bytes_out_,
+                                (uint32_t)b->in_len_, (uint32_t)b->out_len_ };
+    size_t off = 0;
+    while (!write_failed_ && off < b->out_len_) {
+        ssize_t n = ::write(fdw_, b->out_ + off, b->out_len_ - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            comp_.log().warn("error writing %s: %s\n", name_, strerror(errno));
+            write_failed_ = true; //keep draining the pipe
+            break;
+        }
+        off += n;
+    }
+    bytes_out_    += off;
+    bytes_framed_ += b->in_len_;
+    if (off == b->out_len_)
+        frames_.push_back(frame);
+}
+
+void
+MTC_CompressStream::loop() {
+    MTC_Affinity::place(MTC_Affinity::ROLE_WRITER, 0, comp_.log());
+    size_t next = 0;
+    bool   eof  = false;
+    while (!eof) {
+        block_t *b = &window_[next];
+        if (b->busy_)
+            write_block(b); //oldest in flight, frees its slot
+
+        b->in_len_ = 0;
+        while (b->in_len_ < comp_.block()) {
+            ssize_t n = ::read(pipe_r_, b->in_ + b->in_len_,
+                               comp_.block() - b->in_len_);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                comp_.log().warn("error reading compressor pipe for %s: %s\n",
+                                 name_, strerror(errno));
+                eof = true;
+                break;
+            }
+            if (n == 0) {
+                eof = true; //libtrace closed the segment
+                break;
+            }
+            b->in_len_ += n;
+        }
+        if (b->in_len_ == 0)
+            break;
+        bytes_in_ += b->in_len_;
+        b->busy_   = true;
+        b->done_   = false;
+        b->failed_ = false;
+        comp_.submit(b);
+        next = (next + 1) % window_cnt_;
+    }
+    //frames go out in the order their blocks came in
+    for (size_t k = 0; k < window_cnt_; ++k) {
+        block_t *b = &window_[(next + k) % window_cnt_];
+        if (b->busy_)
+            write_block(b);
+    }
+    ::close(pipe_r_);
+    if (fdw_ != STDOUT_FILENO)
+        ::close(fdw_);
+    comp_.account(bytes_in_, bytes_out_);
+    comp_.log().warn("compressed %s at level %d: %lu -> %lu bytes\n",
+                     name_, level_, bytes_in_, bytes_out_);
+}
+
+MTC_Compressor::MTC_Compressor(codec_t codec, int level, size_t threads,
+                               size_t block, const MTC_Log &log) :
+    mtclog_(log),
+    codec_(codec),
+    level_(level),
+    block_(block),
+    bound_(0),
+    threads_cnt_(threads),
+    threads_(0),
+    queue_head_(0),
+    queue_tail_(0),
+    stopping_(false),
+    busy_ns_(0),
+    streams_(0),
+    total_in_(0),
+    total_out_(0)
+{
+    if (!available(codec_)) {
+        mtclog_.panic("mtracecap was built without %s support\n",
+                      codec_ == CODEC_ZSTD ? "zstd" : "lz4");
+    }
+    if (threads_cnt_ == 0) {
+        long n = ::sysconf(_SC_NPROCESSORS_ONLN);
+        threads_cnt_ = (n > 0) ? n : 1;
+    }
+    switch (codec_) {
+    case CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+        bound_ = ZSTD_compressBound(block_);
+#endif
+        break;
+    case CODEC_LZ4:
+#ifdef HAVE_LZ4
+        {
+            LZ4F_preferences_t prefs;
+            memset(&prefs, 0, sizeof(prefs));
+            prefs.compressionLevel = level_;
+            bound_ = LZ4F_compressFrameBound(block_, &prefs);
+        }
+#endif
+        break;
+    }
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&work_, NULL);
+    threads_ = new pthread_t[threads_cnt_];
+    for (size_t i = 0; i < threads_cnt_; ++i) {
+        if (pthread_create(&threads_[i], NULL, run, this) != 0) {
+            mtclog_.panic("pthread_create for compressor: %s\n", strerror(errno));
+        }
+    }
+}
+
+MTC_Compressor::~MTC_Compressor() {
+    pthread_mutex_lock(&lock_);
+    stopping_ = true;
+    pthread_cond_broadcast(&work_);
+    pthread_mutex_unlock(&lock_);
+    for (size_t i = 0; i < threads_cnt_; ++i)
+        pthread_join(threads_[i], NULL);
+    delete [] threads_;
+    pthread_cond_destroy(&work_);
+    pthread_mutex_destroy(&lock_);
+}
+
+bool
+MTC_Compressor::parse_codec(const char *name, codec_t &codec) {
+    if (strncmp(name, "zst", 3) == 0) {
+        codec = CODEC_ZSTD;
+        return true;
+    } else if (strncmp(name, "lz4", 3) == 0) {
+        codec = CODEC_LZ4;
+        return true;
+    }
+    return false;
+}
+
+bool
+MTC_Compressor::available(codec_t codec) {
+    switch (codec) {
+    case CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    case CODEC_LZ4:
+#ifdef HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+int
+MTC_Compressor::max_level(codec_t codec) {
+    switch (codec) {
+    case CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+        return ZSTD_maxCLevel();
+#else
+        return 0;
+#endif
+    case CODEC_LZ4:
+        return LZ4_LEVEL_MAX;
+    }
+    return 0;
+}
+
+MTC_CompressStream *
+MTC_Compressor::attach(int fdw, const char *name, int level) {
+    pthread_mutex_lock(&lock_);
+    ++streams_;
+    pthread_mutex_unlock(&lock_);
+    return new MTC_CompressStream(*this, fdw, name, (level >= 0) ? level : level_);
+}
+
+void
+MTC_Compressor::submit(MTC_CompressStream::block_t *b) {
+    pthread_mutex_lock(&lock_);
+    b->next_ = 0;
+    if (queue_tail_)
+        queue_tail_->next_ = b;
+    else
+        queue_head_ = b;
+    queue_tail_ = b;
+    pthread_cond_signal(&work_);
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+MTC_Compressor::account(uint64_t in, uint64_t out) {
+    pthread_mutex_lock(&lock_);
+    total_in_  += in;
+    total_out_ += out;
+    pthread_mutex_unlock(&lock_);
+}
+
+void *
+MTC_Compressor::run(void *comp) {
+    static_cast<MTC_Compressor*>(comp)->loop();
+    return NULL;
+}
+
+void
+MTC_Compressor::loop() {
+    MTC_Affinity::place(MTC_Affinity::ROLE_COMPRESS, 0, mtclog_);
+    void *cctx = 0;
+#ifdef HAVE_ZSTD
+    if (codec_ == CODEC_ZSTD)
+        cctx = ZSTD_createCCtx();
+#endif
+    pthread_mutex_lock(&lock_);
+    for (;;) {
+        while (!queue_head_ && !stopping_)
+            pthread_cond_wait(&work_, &lock_);
+        if (!queue_head_)
+            break;
+        MTC_CompressStream::block_t *b = queue_head_;
+        queue_head_ = b->next_;
+        if (!queue_head_)
+            queue_tail_ = 0;
+        pthread_mutex_unlock(&lock_);
+
+        uint64_t t0 = monotonic_ns();
+        b->failed_ = !compress(cctx, b);
+        busy_ns_.fetch_add(monotonic_ns() - t0, std::memory_order_relaxed);
+        b->stream_->completed(b);
+
+        pthread_mutex_lock(&lock_);
+    }
+    pthread_mutex_unlock(&lock_);
+#ifdef HAVE_ZSTD
+    if (cctx)
+        ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(cctx));
+#endif
+}
+
+bool
+MTC_Compressor::compress(void *cctx, MTC_CompressStream::block_t *b) {
+    size_t r = 0;
+    switch (codec_) {
+    case CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+        r = ZSTD_compressCCtx(static_cast<ZSTD_CCtx*>(cctx), b->out_, bound_,
+                              b->in_, b->in_len_, b->stream_->level());
+        if (ZSTD_isError(r)) {
+            mtclog_.warn("zstd: %s\n", ZSTD_getErrorName(r));
+            return false;
+        }
+#endif
+        break;
+    case CODEC_LZ4:
+#ifdef HAVE_LZ4
+        {
+            LZ4F_preferences_t prefs;
+            memset(&prefs, 0, sizeof(prefs));
+            prefs.compressionLevel = b->stream_->level();
+            prefs.frameInfo.contentSize = b->in_len_;
+            r = LZ4F_compressFrame(b->out_, bound_, b->in_, b->in_len_, &prefs);
+            if (LZ4F_isError(r)) {
+                mtclog_.warn("lz4: %s\n", LZ4F_getErrorName(r));
+                return false;
+            }
+        }
+#endif
+        break;
+    }
+    b->out_len_ = r;
+    return true;
+}
+
+void
+MTC_Compressor::dump_stats() const {
+    pthread_mutex_t *lock = const_cast<pthread_mutex_t*>(&lock_);
+    pthread_mutex_lock(lock);
+    mtclog_.warn("    compressor: %s level %d, threads=%lu, block=%lu, "
+                 "segments=%lu, bytes=%lu -> %lu (%.1f%%)\n",
+                 codec_ == CODEC_ZSTD ? "zstd" : "lz4", level_,
+                 threads_cnt_, block_, streams_, total_in_, total_out_,
+                 total_in_ ? 100.0*total_out_/total_in_ : 0.0);
+    pthread_mutex_unlock(lock);
+}
@@ -0,0 +1,163 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_COMPRESS_HH
+#define MTC_COMPRESS_HH
+
+#include <pthread.h>
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+#include <atomic>
+
+#include "mtc_index.hh"
+
+#define COMPRESS_BLOCK_DEFAULT (1024*1024)
+
+class MTC_Compressor;
+
+/*
+ * One segment's compressed output. libtrace writes the uncompressed
+ * segment into fd(); a stream thread cuts it into fixed-size blocks,
+ * hands them to the compressor's workers and writes the finished frames
+ * to the segment file in order. Closing fd() ends the stream; wait()
+ * returns once the last frame is on disk. All of its blocks are
+ * compressed at the level it was attached with.
+ */
+class MTC_CompressStream {
+public:
+    MTC_CompressStream(MTC_Compressor &comp, int fdw, const char *name, int level);
+    ~MTC_CompressStream();
+
+    int  fd() const { return pipe_w_; }
+    int  level() const { return level_; }
+    void wait();
+
+    uint64_t bytes_in() const { return bytes_in_; }
+    uint64_t bytes_out() const { return bytes_out_; }
+    /* where each frame went, valid after wait() */
+    const std::vector<mtc_index_frame_t> &frames() const { return frames_; }
+
+    /* called by the workers */
+    struct block_t {
+        MTC_CompressStream *stream_;
+        char   *in_;
+        size_t  in_len_;
+        char   *out_;
+        size_t  out_len_;
+        bool    busy_;    //submitted, not written yet
+        bool    done_;    //compressed
+        bool    failed_;
+        block_t *next_;   //compressor queue
+    };
+    void completed(block_t *b);
+
+protected:
+    static void *run(void *stream);
+    void loop();
+    void write_block(block_t *b);
+
+protected:
+    MTC_Compressor &comp_;
+    int             pipe_r_;
+    int             pipe_w_;
+    int             fdw_;
+    int             level_;
+    char            name_[1024];
+    block_t        *window_;
+    size_t          window_cnt_;
+    uint64_t        bytes_in_;
+    uint64_t        bytes_out_;
+    uint64_t        bytes_framed_; //uncompressed bytes written out as frames
+    bool            write_failed_;
+    std::vector<mtc_index_frame_t> frames_;
+
+    pthread_t       thread_;
+    bool            started_;
+    pthread_mutex_t lock_;
+    pthread_cond_t  done_;
+};
+
+/*
+ * Worker pool that compresses independent blocks into standalone zstd
+ * or lz4 frames. Concatenated frames form a regular multi-frame file
+ * that the zstd and lz4 command line tools decompress as one stream.
+ */
+class MTC_Compressor {
+public:
+    enum codec_t {
+        CODEC_ZSTD,
+        CODEC_LZ4
+    };
+
+    MTC_Compressor(codec_t codec, int level, size_t threads, size_t block,
+                   const MTC_Log &log);
+    ~MTC_Compressor();
+
+    static bool parse_codec(const char *name, codec_t &codec);
+    static bool available(codec_t codec);
+
+    /* fdw is the segment file, owned by the stream from now on;
+     * level < 0 takes the compressor's */
+    MTC_CompressStream *attach(int fdw, const char *name, int level = -1);
+    static int max_level(codec_t codec);
+
+    codec_t  codec() const { return codec_; }
+    int      level() const { return level_; }
+    size_t   block() const { return block_; }
+    size_t   threads() const { return threads_cnt_; }
+    size_t   bound() const { return bound_; }
+    /* time the workers spent compressing, all of them together */
+    uint64_t busy_ns() const { return busy_ns_.load(std::memory_order_relaxed); }
+    const MTC_Log &log() const { return mtclog_; }
+
+    void submit(MTC_CompressStream::block_t *b);
+    void account(uint64_t in, uint64_t out);
+    void dump_stats() const;
+
+protected:
+    static void *run(void *comp);
+    void loop();
+    bool compress(void *cctx, MTC_CompressStream::block_t *b);
+
+protected:
+    const MTC_Log
+    &mtclog_;
+    codec_t    codec_;
+    int        level_;
+    size_t     block_;
+    size_t     bound_;
+    size_t     threads_cnt_;
+    pthread_t *threads_;
+
+    pthread_mutex_t lock_;
+    pthread_cond_t  work_;
+    MTC_CompressStream::block_t *queue_head_;
+    MTC_CompressStream::block_t *queue_tail_;
+    bool       stopping_;
+    std::atomic<uint64_t> busy_ns_;
+
+    /* protected by lock_ */
+    uint64_t   streams_;
+    uint64_t   total_in_;
+    uint64_t   total_out_;
+};
+
+#endif /* MTC_COMPRESS_HH */
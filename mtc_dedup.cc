@@ -0,0 +1,134 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <libtrace.h>
+#include <cstring>
+
+#include "mtc_dedup.hh"
+
+/* microseconds to 32.32 fixed point erf time */
+static inline uint64_t
+us_to_erf(uint64_t us) {
+    return ((us / 1000000) << 32) + (((us % 1000000) << 32) / 1000000);
+}
+
+MTC_Dedup::MTC_Dedup(uint64_t window_us, size_t mem_mb, size_t snaplen) :
+    window_erf_(us_to_erf(window_us)),
+    bytes_(DEDUP_BYTES),
+    slots_(0),
+    mask_(0),
+    evictions_(0)
+{
+    size_t n = 1;
+    while (2*n*sizeof(slot_t) <= mem_mb*1024*1024)
+        n *= 2;
+    slots_ = new slot_t[n]();
+    if (snaplen < DEDUP_L2_MAX + DEDUP_BYTES)
+        bytes_ = (snaplen > DEDUP_L2_MAX) ? snaplen - DEDUP_L2_MAX : 0;
+    mask_  = n - 1;
+}
+
+MTC_Dedup::~MTC_Dedup() {
+    delete [] slots_;
+}
+
+uint64_t
+MTC_Dedup::digest(const void *l3, uint16_t ethertype, size_t len,
+                  size_t l3_len) {
+    unsigned char buf[DEDUP_BYTES];
+    if (len > DEDUP_BYTES)
+        len = DEDUP_BYTES;
+    memcpy(buf, l3, len);
+    //rewritten by every router between the mirror points
+    if (ethertype == 0x0800 && len >= 20) {
+        buf[8] = 0;                 //TTL
+        buf[10] = buf[11] = 0;      //header checksum
+    } else if (ethertype == 0x86dd && len >= 40) {
+        buf[7] = 0;                 //hop limit
+    }
+    uint64_t h = (l3_len ^ ((uint64_t)ethertype << 32)) * 0x9e3779b97f4a7c15ULL;
+    for (size_t o = 0; o < len; o += 8) {
+        uint64_t w = 0;
+        memcpy(&w, buf + o, (len - o < 8) ? len - o : 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    h ^= h >> 32;
+    return h ? h : 1; //0 marks an unused slot
+}
+
+size_t
+MTC_Dedup::l3_length(libtrace_packet_t *p, const void *l3, uint16_t ethertype,
+                     uint32_t remaining) {
+    const unsigned char *b = static_cast<const unsigned char*>(l3);
+    if (ethertype == 0x0800 && remaining >= 20)
+        return ((size_t)b[2] << 8) | b[3];          //total length
+    if (ethertype == 0x86dd && remaining >= 40)
+        return 40 + (((size_t)b[4] << 8) | b[5]);   //header and payload length
+    //anything else: the wire length less the link headers, FCS and all
+    libtrace_linktype_t linktype;
+    uint32_t l2_remaining;
+    const void *l2 = trace_get_layer2(p, &linktype, &l2_remaining);
+    size_t hdr  = l2 ? static_cast<const char*>(l3) - static_cast<const char*>(l2) : 0;
+    size_t wire = trace_get_wire_length(p);
+    return (wire > hdr) ? wire - hdr : 0;
+}
+
+bool
+MTC_Dedup::duplicate(libtrace_packet_t *p, int idx, uint64_t ts) {
+    uint16_t ethertype;
+    uint32_t remaining;
+    void *l3 = trace_get_layer3(p, &ethertype, &remaining);
+    if (!l3)
+        return false;
+    //the same bytes on every input, whatever their link layer
+    size_t l3_len = l3_length(p, l3, ethertype, remaining);
+    size_t len = bytes_;
+    if (len > l3_len)
+        len = l3_len;
+    if (len > remaining)
+        len = remaining;
+    uint64_t d = digest(l3, ethertype, len, l3_len);
+
+    slot_t *victim = 0;
+    for (size_t k = 0; k < DEDUP_PROBES; ++k) {
+        slot_t &s = slots_[(d + k) & mask_];
+        if (!live(s, ts)) {
+            if (!victim || live(*victim, ts))
+                victim = &s;
+            continue;
+        }
+        if (s.digest_ == d) {
+            if (s.idx_ != idx)
+                return true;
+            s.ts_ = ts; //seen again on the same input, a packet of its own
+            return false;
+        }
+        if (!victim || (live(*victim, ts) && s.ts_ < victim->ts_))
+            victim = &s;
+    }
+    if (live(*victim, ts))
+        ++evictions_;
+    victim->digest_ = d;
+    victim->ts_     = ts;
+    victim->idx_    = idx;
+    return false;
+}
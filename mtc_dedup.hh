@@ -0,0 +1,83 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_DEDUP_HH
+#define MTC_DEDUP_HH
+
+#include <stdint.h>
+#include <cstddef>
+
+#define DEDUP_MEM_DEFAULT 16  //MB for the table
+#define DEDUP_BYTES       128 //digested from the network header on
+#define DEDUP_L2_MAX      22  //link headers up to two VLAN tags, cut by the snap length
+#define DEDUP_PROBES      8
+
+/*
+ * Drops copies of a packet that another input already delivered, as
+ * happens when the same traffic is mirrored to several SPAN ports. A
+ * packet is identified by a 64-bit digest of its length from the
+ * network header on and its first DEDUP_BYTES, with the IPv4 TTL and
+ * header checksum and the IPv6 hop limit left out: link layer headers
+ * and hop counts differ between mirror points. Digests are kept in a
+ * fixed-size open-addressed table for the window given in microseconds
+ * of packet time; when the DEDUP_PROBES slots a digest may go into are
+ * all in use, the oldest one is evicted. Copies on the same input are
+ * not dropped. Fewer bytes are digested when the snap length would cut
+ * them off behind a link layer header of DEDUP_L2_MAX, so that a copy
+ * with more VLAN tags still digests the same bytes.
+ */
+class MTC_Dedup {
+public:
+    MTC_Dedup(uint64_t window_us, size_t mem_mb, size_t snaplen);
+    ~MTC_Dedup();
+
+    /* true if p was seen on another input within the window */
+    bool duplicate(libtrace_packet_t *p, int idx, uint64_t ts);
+
+    static uint64_t digest(const void *l3, uint16_t ethertype, size_t len,
+                           size_t l3_len);
+    /* without VLAN tags, FCS or other link layer bytes */
+    static size_t l3_length(libtrace_packet_t *p, const void *l3, uint16_t ethertype,
+                            uint32_t remaining);
+
+    size_t   slots() const { return mask_ + 1; }
+    uint64_t evictions() const { return evictions_; }
+
+protected:
+    struct slot_t {
+        uint64_t digest_; //0 when unused
+        uint64_t ts_;     //erf time the packet was first seen
+        int      idx_;    //input it was first seen on
+    };
+
+    bool live(const slot_t &s, uint64_t ts) const {
+        return s.digest_ != 0 &&
+            (ts >= s.ts_ ? ts - s.ts_ : s.ts_ - ts) <= window_erf_;
+    }
+
+protected:
+    uint64_t window_erf_;
+    size_t   bytes_;     //digested at most
+    slot_t  *slots_;
+    size_t   mask_;
+    uint64_t evictions_;
+};
+
+#endif /* MTC_DEDUP_HH */
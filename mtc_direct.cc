@@ -0,0 +1,269 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <cstdio>
+#include <cstring>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "mtc_log.hh"
+#include "mtc_direct.hh"
+#include "mtc_affinity.hh"
+
+#define DIRECT_PIPEBUFSZ (8*1024*1024)
+
+MTC_DirectWriter::MTC_DirectWriter(const char *path, off_t prealloc,
+                                   const MTC_Log &log) :
+    mtclog_(log),
+    filefd_(-1),
+    pipe_r_(-1),
+    pipe_w_(-1),
+    direct_(true),
+    in_flight_(0),
+    ring_(0),
+    bytes_(0),
+    failed_(false),
+    started_(false)
+{
+    strncpy(name_, path, sizeof(name_)-1);
+    name_[sizeof(name_)-1] = '\0';
+
+    filefd_ = ::open(path, O_WRONLY | O_CREAT | O_CLOEXEC | O_DIRECT,
+                     S_IRUSR | S_IWUSR);
+    if (filefd_ < 0 && errno == EINVAL) {
+        //tmpfs and some network filesystems refuse O_DIRECT
+        direct_ = false;
+        filefd_ = ::open(path, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    }
+    if (filefd_ < 0) {
+        mtclog_.panic("Error opening file '%s': %s\n", path, strerror(errno));
+    }
+    if (!direct_)
+        mtclog_.warn("%s: O_DIRECT not supported, writing through the page cache\n", path);
+    if (prealloc > 0 &&
+        ::fallocate(filefd_, FALLOC_FL_KEEP_SIZE, 0, prealloc) != 0 &&
+        errno != EOPNOTSUPP) {
+        mtclog_.warn("%s: cannot preallocate %ld bytes: %s\n",
+                     path, (long)prealloc, strerror(errno));
+    }
+
+    for (size_t i = 0; i < DIRECT_QUEUE_DEPTH; ++i) {
+        void *mem = 0;
+        if (::posix_memalign(&mem, DIRECT_ALIGN, DIRECT_BUF_SIZE) != 0) {
+            mtclog_.panic("Cannot allocate direct I/O buffers\n");
+        }
+        bufs_[i].data_ = static_cast<char*>(mem);
+        bufs_[i].len_  = 0;
+        bufs_[i].busy_ = false;
+        offs_[i] = 0;
+    }
+
+#ifdef HAVE_LIBURING
+    ring_ = new struct io_uring;
+    int ret = io_uring_queue_init(DIRECT_QUEUE_DEPTH, ring_, 0);
+    if (ret < 0) {
+        mtclog_.warn("io_uring unavailable (%s), using pwrite\n", strerror(-ret));
+        delete ring_;
+        ring_ = 0;
+    }
+#endif
+
+    int pipefd[2];
+    if (0 != ::pipe2(pipefd, O_CLOEXEC)) {
+        mtclog_.panic("Error creating direct writer pipe: '%s'\n", strerror(errno));
+    }
+    for (int bufsz = DIRECT_PIPEBUFSZ; bufsz >= 64*1024; bufsz /= 2) {
+        if (::fcntl(pipefd[1], F_SETPIPE_SZ, bufsz) >= 0)
+            break;
+    }
+    pipe_r_ = pipefd[0];
+    pipe_w_ = pipefd[1];
+
+    if (pthread_create(&thread_, NULL, run, this) != 0) {
+        mtclog_.panic("pthread_create for direct writer: %s\n", strerror(errno));
+    }
+    started_ = true;
+}
+
+MTC_DirectWriter::~MTC_DirectWriter() {
+    wait();
+#ifdef HAVE_LIBURING
+    if (ring_) {
+        io_uring_queue_exit(ring_);
+        delete ring_;
+    }
+#endif
+    for (size_t i = 0; i < DIRECT_QUEUE_DEPTH; ++i)
+        free(bufs_[i].data_);
+}
+
+void
+MTC_DirectWriter::wait() {
+    if (!started_)
+        return;
+    pthread_join(thread_, NULL);
+    started_ = false;
+}
+
+void *
+MTC_DirectWriter::run(void *dw) {
+    static_cast<MTC_DirectWriter*>(dw)->loop();
+    return NULL;
+}
+
+void
+MTC_DirectWriter::pwrite_all(const char *data, size_t len, off_t off) {
+    size_t done = 0;
+    while (!failed_ && done < len) {
+        ssize_t n = ::pwrite(filefd_, data + done, len - done, off + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            mtclog_.warn("error writing %s: %s\n", name_, strerror(errno));
+            failed_ = true; //keep draining the pipe
+            break;
+        }
+        done += n;
+        if (direct_ && done < len)
+            done &= ~(size_t)(DIRECT_ALIGN - 1); //O_DIRECT resumes on a block, rewriting its start
+    }
+}
+
+void
+MTC_DirectWriter::submit(size_t idx, off_t off) {
+    buf_t &b = bufs_[idx];
+    offs_[idx] = off;
+#ifdef HAVE_LIBURING
+    if (ring_ && !failed_) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(ring_);
+        if (sqe) {
+            io_uring_prep_write(sqe, filefd_, b.data_, b.len_, off);
+            io_uring_sqe_set_data(sqe, &b);
+            if (io_uring_submit(ring_) >= 0) {
+                b.busy_ = true;
+                ++in_flight_;
+                return;
+            }
+        }
+    }
+#endif
+    pwrite_all(b.data_, b.len_, off);
+}
+
+void
+MTC_DirectWriter::reap(size_t idx) {
+#ifdef HAVE_LIBURING
+    while (bufs_[idx].busy_) {
+        struct io_uring_cqe *cqe = 0;
+        int ret = io_uring_wait_cqe(ring_, &cqe);
+        if (ret == -EINTR)
+            continue;
+        if (ret < 0) {
+            mtclog_.panic("io_uring_wait_cqe on %s: %s\n", name_, strerror(-ret));
+        }
+        buf_t *b = static_cast<buf_t*>(io_uring_cqe_get_data(cqe));
+        int res = cqe->res;
+        io_uring_cqe_seen(ring_, cqe);
+        b->busy_ = false;
+        --in_flight_;
+        if (res < 0) {
+            mtclog_.warn("error writing %s: %s\n", name_, strerror(-res));
+            failed_ = true;
+        } else if ((size_t)res < b->len_) {
+            //short write, finish it synchronously from the last whole
+            //block, O_DIRECT refuses anything unaligned
+            size_t i    = b - bufs_;
+            size_t done = (size_t)res & ~(size_t)(DIRECT_ALIGN - 1);
+            pwrite_all(b->data_ + done, b->len_ - done, offs_[i] + done);
+        }
+    }
+#else
+    (void)idx;
+#endif
+}
+
+void
+MTC_DirectWriter::reap_all() {
+    for (size_t i = 0; i < DIRECT_QUEUE_DEPTH && in_flight_ > 0; ++i)
+        reap(i);
+}
+
+void
+MTC_DirectWriter::loop() {
+    MTC_Affinity::place(MTC_Affinity::ROLE_WRITER, 0, mtclog_);
+    size_t cur = 0;
+    off_t  off = 0;
+    size_t tail = 0;
+    for (;;) {
+        buf_t &b = bufs_[cur];
+        if (b.busy_)
+            reap(cur);
+        b.len_ = 0;
+        bool eof = false;
+        while (b.len_ < DIRECT_BUF_SIZE) {
+            ssize_t n = ::read(pipe_r_, b.data_ + b.len_, DIRECT_BUF_SIZE - b.len_);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                mtclog_.warn("error reading direct writer pipe for %s: %s\n",
+                             name_, strerror(errno));
+                eof = true;
+                break;
+            }
+            if (n == 0) {
+                eof = true;
+                break;
+            }
+            b.len_ += n;
+        }
+        if (eof) {
+            tail = b.len_;
+            break;
+        }
+        submit(cur, off);
+        off   += DIRECT_BUF_SIZE;
+        bytes_ += DIRECT_BUF_SIZE;
+        cur = (cur + 1) % DIRECT_QUEUE_DEPTH;
+    }
+    reap_all();
+
+    if (tail > 0) {
+        //O_DIRECT wants whole blocks, the padding is truncated away below
+        buf_t &b = bufs_[cur];
+        size_t padded = (tail + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+        memset(b.data_ + tail, 0, padded - tail);
+        pwrite_all(b.data_, padded, off);
+        bytes_ += tail;
+    }
+    if (::ftruncate(filefd_, off + tail) != 0) {
+        mtclog_.warn("cannot truncate %s: %s\n", name_, strerror(errno));
+    }
+    ::close(pipe_r_);
+    ::close(filefd_);
+}
@@ -0,0 +1,84 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_DIRECT_HH
+#define MTC_DIRECT_HH
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#define DIRECT_ALIGN       4096
+#define DIRECT_BUF_SIZE    (1024*1024)
+#define DIRECT_QUEUE_DEPTH 8
+
+struct io_uring;
+
+/*
+ * Writes one segment file with O_DIRECT, bypassing the page cache.
+ * Whatever is written into fd() is collected into aligned buffers that
+ * go out through io_uring with several writes in flight (or pwrite()
+ * when built without liburing). Closing fd() ends the segment: the last
+ * partial buffer is padded for the write and the file is truncated back
+ * to its real size, which also drops any unused preallocation.
+ */
+class MTC_DirectWriter {
+public:
+    MTC_DirectWriter(const char *path, off_t prealloc, const MTC_Log &log);
+    ~MTC_DirectWriter();
+
+    int  fd() const { return pipe_w_; }
+    void wait();
+
+    uint64_t bytes() const { return bytes_; }
+
+protected:
+    struct buf_t {
+        char   *data_;
+        size_t  len_;
+        bool    busy_;
+    };
+
+    static void *run(void *dw);
+    void loop();
+    void submit(size_t idx, off_t off);
+    void reap(size_t idx);   //until bufs_[idx] is free again
+    void reap_all();
+    void pwrite_all(const char *data, size_t len, off_t off);
+
+protected:
+    const MTC_Log
+    &mtclog_;
+    char        name_[1024];
+    int         filefd_;
+    int         pipe_r_;
+    int         pipe_w_;
+    bool        direct_;     //O_DIRECT accepted by the filesystem
+    buf_t       bufs_[DIRECT_QUEUE_DEPTH];
+    off_t       offs_[DIRECT_QUEUE_DEPTH];
+    size_t      in_flight_;
+    struct io_uring *ring_;  //0 when writing synchronously
+    uint64_t    bytes_;
+    bool        failed_;
+    pthread_t   thread_;
+    bool        started_;
+};
+
+#endif /* MTC_DIRECT_HH */
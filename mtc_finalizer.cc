@@ -0,0 +1,201 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libtrace.h>
+#include <cstring>
+
+#include "mtc_log.hh"
+#include "mtc_time.hh"
+#include "mtc_output.hh"
+#include "mtc_finalizer.hh"
+#include "mtc_compress.hh"
+#include "mtc_direct.hh"
+#include "mtc_index.hh"
+#include "mtc_journal.hh"
+#include "mtc_affinity.hh"
+
+//empty pcap file that we dump if there is no traffic
+//can't do it in libtrace apparently
+static const unsigned char null_pcap[] = {
+                                          0324, 0303, 0262, 0241, 0002, 0000, 0004, 0000,
+                                          0000, 0000, 0000, 0000, 0000, 0000, 0000, 0000,
+                                          0000, 0000, 0004, 0000, 0001, 0000, 0000, 0000
+};
+
+MTC_Finalizer::MTC_Finalizer(size_t queue, const MTC_Log &log) :
+    mtclog_(log),
+    queue_(new MTC_Segment*[queue]),
+    queue_size_(queue),
+    head_(0),
+    count_(0),
+    stopping_(false),
+    started_(false),
+    closed_(0),
+    close_ns_total_(0),
+    close_ns_max_(0),
+    stalls_(0),
+    stall_ns_total_(0)
+{
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&not_empty_, NULL);
+    pthread_cond_init(&not_full_, NULL);
+}
+
+MTC_Finalizer::~MTC_Finalizer() {
+    shutdown();
+    pthread_cond_destroy(&not_full_);
+    pthread_cond_destroy(&not_empty_);
+    pthread_mutex_destroy(&lock_);
+    delete [] queue_;
+}
+
+void
+MTC_Finalizer::start() {
+    if (pthread_create(&thread_, NULL, run, this) != 0) {
+        mtclog_.panic("pthread_create for finalizer: %s\n", strerror(errno));
+    }
+    started_ = true;
+}
+
+void
+MTC_Finalizer::submit(MTC_Segment *seg) {
+    pthread_mutex_lock(&lock_);
+    if (count_ == queue_size_) {
+        //all closes are still pending: rotation has to wait
+        uint64_t t0 = monotonic_ns();
+        while (count_ == queue_size_)
+            pthread_cond_wait(&not_full_, &lock_);
+        ++stalls_;
+        stall_ns_total_ += monotonic_ns() - t0;
+    }
+    queue_[(head_ + count_) % queue_size_] = seg;
+    ++count_;
+    pthread_cond_signal(&not_empty_);
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+MTC_Finalizer::shutdown() {
+    if (!started_)
+        return;
+    pthread_mutex_lock(&lock_);
+    stopping_ = true;
+    pthread_cond_signal(&not_empty_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(thread_, NULL);
+    started_ = false;
+}
+
+void *
+MTC_Finalizer::run(void *fin) {
+    static_cast<MTC_Finalizer*>(fin)->loop();
+    return NULL;
+}
+
+void
+MTC_Finalizer::loop() {
+    MTC_Affinity::place(MTC_Affinity::ROLE_WRITER, 0, mtclog_);
+    pthread_mutex_lock(&lock_);
+    for (;;) {
+        while (count_ == 0 && !stopping_)
+            pthread_cond_wait(&not_empty_, &lock_);
+        if (count_ == 0)
+            break; //stopping and drained
+        MTC_Segment *seg = queue_[head_];
+        pthread_mutex_unlock(&lock_);
+
+        uint64_t ns = finalize(seg, mtclog_);
+
+        pthread_mutex_lock(&lock_);
+        head_ = (head_ + 1) % queue_size_;
+        --count_;
+        ++closed_;
+        close_ns_total_ += ns;
+        if (ns > close_ns_max_)
+            close_ns_max_ = ns;
+        pthread_cond_signal(&not_full_);
+    }
+    pthread_mutex_unlock(&lock_);
+}
+
+uint64_t
+MTC_Finalizer::finalize(MTC_Segment *seg, const MTC_Log &log) {
+    uint64_t t0 = monotonic_ns();
+    if (seg->output_)
+        trace_destroy_output(seg->output_);
+    if (seg->write_null_) {
+        //empty files are not allowed
+        int fd = (seg->fd_ >= 0) ? seg->fd_ : STDOUT_FILENO;
+        ::lseek(fd, 0, SEEK_END); //fails harmlessly on pipes
+        if (sizeof(null_pcap) != write(fd, null_pcap, sizeof(null_pcap))) {
+            log.warn("Cannot write null file %s\n", seg->name_);
+        }
+    }
+    if (seg->fd_ >= 0)
+        ::close(seg->fd_);
+    if (seg->stream_) {
+        //closing the pipe ends the stream, wait for the last frames
+        seg->stream_->wait();
+        if (seg->index_)
+            seg->index_->set_frames(seg->stream_->frames());
+        delete seg->stream_;
+    }
+    if (seg->direct_) {
+        //last block and truncation happen once everything upstream closed
+        seg->direct_->wait();
+        delete seg->direct_;
+    }
+    if (seg->index_) {
+        seg->index_->write(seg->name_, log);
+        delete seg->index_;
+    }
+    if (seg->journal_) {
+        //what is on disk now, after compression
+        struct stat st;
+        uint64_t bytes = (::stat(seg->name_, &st) == 0) ? st.st_size : 0;
+        seg->journal_->closed(seg->seqnum_, bytes, seg->packets_,
+                              seg->first_erf_, seg->last_erf_,
+                              seg->codec_, seg->level_);
+    }
+    uint64_t ns = monotonic_ns() - t0;
+    log.warn("closed %s in %.3fs\n", seg->name_, ns/1e9);
+    delete seg;
+    return ns;
+}
+
+void
+MTC_Finalizer::dump_stats() const {
+    pthread_mutex_t *lock = const_cast<pthread_mutex_t*>(&lock_);
+    pthread_mutex_lock(lock);
+    mtclog_.warn("    finalizer: closed=%lu, close avg=%.3fs, max=%.3fs, "
+                 "stalls=%lu (%.3fs), pending=%lu\n",
+                 closed_,
+                 closed_ ? close_ns_total_/1e9/closed_ : 0.0,
+                 close_ns_max_/1e9,
+                 stalls_, stall_ns_total_/1e9, count_);
+    pthread_mutex_unlock(lock);
+}
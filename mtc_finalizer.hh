@@ -0,0 +1,77 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_FINALIZER_HH
+#define MTC_FINALIZER_HH
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define CLOSE_QUEUE_DEFAULT 4
+
+struct MTC_Segment;
+
+/*
+ * Closes finished segments on a background thread: trace_destroy_output()
+ * flushes compression buffers and closing files on NFS can take seconds,
+ * which must not happen on the packet path. The queue is bounded; when
+ * it is full, submit() waits and the wait is counted as a stall.
+ */
+class MTC_Finalizer {
+public:
+    MTC_Finalizer(size_t queue, const MTC_Log &log);
+    ~MTC_Finalizer();
+
+    void start();
+    void submit(MTC_Segment *seg); //takes ownership
+    void shutdown();               //closes everything queued, then joins
+
+    /* closes seg on the calling thread, returns the time it took in ns */
+    static uint64_t finalize(MTC_Segment *seg, const MTC_Log &log);
+
+    void dump_stats() const;
+
+protected:
+    static void *run(void *fin);
+    void loop();
+
+protected:
+    const MTC_Log
+    &mtclog_;
+    MTC_Segment   **queue_;
+    size_t          queue_size_;
+    size_t          head_;
+    size_t          count_;
+    bool            stopping_;
+    bool            started_;
+    pthread_t       thread_;
+    pthread_mutex_t lock_;
+    pthread_cond_t  not_empty_;
+    pthread_cond_t  not_full_;
+
+    /* protected by lock_ */
+    uint64_t        closed_;
+    uint64_t        close_ns_total_;
+    uint64_t        close_ns_max_;
+    uint64_t        stalls_;
+    uint64_t        stall_ns_total_;
+};
+
+#endif /* MTC_FINALIZER_HH */
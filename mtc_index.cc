@@ -0,0 +1,140 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <libtrace.h>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+
+#include "mtc_log.hh"
+#include "mtc_index.hh"
+
+#define PCAP_FILE_HDR   24
+#define PCAP_RECORD_HDR 16
+#define ERF_RECORD_HDR  16
+
+MTC_Index::MTC_Index(uint64_t interval_us, bool pcap, uint32_t codec, int level) :
+    interval_(((interval_us / 1000000) << 32) + (((interval_us % 1000000) << 32) / 1000000)),
+    pcap_(pcap),
+    codec_(codec),
+    level_(level),
+    next_(0),
+    packets_(0),
+    offset_(pcap ? PCAP_FILE_HDR : 0)
+{
+    if (interval_ == 0)
+        interval_ = 1;
+}
+
+void
+MTC_Index::add(libtrace_packet_t *p, uint64_t ts) {
+    if (packets_ == 0 || ts >= next_) {
+        mtc_index_point_t pt = { ts, packets_, offset_ };
+        points_.push_back(pt);
+        next_ = (ts / interval_ + 1) * interval_;
+    }
+    /* the record libtrace's output writes for this packet */
+    size_t caplen = trace_get_capture_length(p);
+    if (pcap_) {
+        offset_ += PCAP_RECORD_HDR + caplen;
+    } else {
+        enum base_format_t fmt = trace_get_format(p);
+        if (fmt == TRACE_FORMAT_ERF || fmt == TRACE_FORMAT_DAG25) {
+            //erf records are copied with their extension headers and padding
+            offset_ += trace_get_framing_length(p) + caplen;
+        } else {
+            offset_ += ERF_RECORD_HDR +
+                ((trace_get_link_type(p) == TRACE_TYPE_ETH) ? 2 : 0) + caplen;
+        }
+    }
+    ++packets_;
+}
+
+bool
+MTC_Index::write(const char *segment, const MTC_Log &log) const {
+    char path[1024+8];
+    snprintf(path, sizeof(path), "%s" INDEX_EXT, segment);
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        log.warn("cannot create index %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    mtc_index_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic_, INDEX_MAGIC, sizeof(hdr.magic_));
+    hdr.version_    = INDEX_VERSION;
+    hdr.codec_      = codec_;
+    hdr.interval_   = interval_;
+    hdr.points_     = points_.size();
+    hdr.frames_     = frames_.size();
+    hdr.data_start_ = pcap_ ? PCAP_FILE_HDR : 0;
+    hdr.packets_    = packets_;
+    hdr.bytes_      = offset_;
+    hdr.level_      = level_;
+
+    bool ok = (::write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr));
+    size_t len = points_.size()*sizeof(mtc_index_point_t);
+    if (ok && len)
+        ok = (::write(fd, &points_[0], len) == (ssize_t)len);
+    len = frames_.size()*sizeof(mtc_index_frame_t);
+    if (ok && len)
+        ok = (::write(fd, &frames_[0], len) == (ssize_t)len);
+    if (!ok)
+        log.warn("error writing index %s: %s\n", path, strerror(errno));
+    ::close(fd);
+    return ok;
+}
+
+bool
+MTC_Index::read(const char *path, mtc_index_hdr_t &hdr,
+                std::vector<mtc_index_point_t> &points,
+                std::vector<mtc_index_frame_t> &frames) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return false;
+    //version 1 headers end before level_
+    size_t v1 = offsetof(mtc_index_hdr_t, level_);
+    bool ok = (fread(&hdr, v1, 1, f) == 1 &&
+               memcmp(hdr.magic_, INDEX_MAGIC, sizeof(hdr.magic_)) == 0 &&
+               (hdr.version_ == 1 || hdr.version_ == INDEX_VERSION));
+    if (ok && hdr.version_ == 1) {
+        hdr.level_    = -1;
+        hdr.reserved_ = 0;
+    } else if (ok) {
+        ok = (fread((char*)&hdr + v1, sizeof(hdr) - v1, 1, f) == 1);
+    }
+    if (ok) {
+        points.resize(hdr.points_);
+        frames.resize(hdr.frames_);
+        if (hdr.points_)
+            ok = (fread(&points[0], sizeof(mtc_index_point_t), hdr.points_, f) == hdr.points_);
+        if (ok && hdr.frames_)
+            ok = (fread(&frames[0], sizeof(mtc_index_frame_t), hdr.frames_, f) == hdr.frames_);
+    }
+    fclose(f);
+    return ok;
+}
@@ -0,0 +1,100 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_INDEX_HH
+#define MTC_INDEX_HH
+
+#include <stdint.h>
+#include <vector>
+
+#define INDEX_MAGIC   "MTCIDX1"
+#define INDEX_VERSION 2 //1 had no level_, it is still read
+#define INDEX_EXT     ".idx"
+
+class MTC_Log;
+
+/*
+ * Sidecar index written next to every segment as <segment>.idx:
+ * a header, then one point per index interval mapping the first
+ * packet's timestamp to its packet number and byte offset in the
+ * uncompressed trace, then, for in-process compression, the frame
+ * table mapping uncompressed offsets to compressed ones. All fields
+ * are in host byte order.
+ */
+enum {
+    INDEX_CODEC_NONE  = 0,
+    INDEX_CODEC_ZSTD  = 1,
+    INDEX_CODEC_LZ4   = 2,
+    INDEX_CODEC_OTHER = 3  //libtrace or --pipeout compression, no frame table
+};
+
+struct mtc_index_hdr_t {
+    char     magic_[8];
+    uint32_t version_;
+    uint32_t codec_;
+    uint64_t interval_;   //erf time between points
+    uint64_t points_;
+    uint64_t frames_;
+    uint64_t data_start_; //bytes of file header before the first packet
+    uint64_t packets_;
+    uint64_t bytes_;      //uncompressed trace size
+    int32_t  level_;      //compression level, -1 if none or not ours to choose
+    uint32_t reserved_;
+};
+
+struct mtc_index_point_t {
+    uint64_t ts_;         //erf timestamp of the first packet in the interval
+    uint64_t packet_;
+    uint64_t offset_;     //uncompressed
+};
+
+struct mtc_index_frame_t {
+    uint64_t in_off_;     //uncompressed
+    uint64_t out_off_;    //in the segment file
+    uint32_t in_len_;
+    uint32_t out_len_;
+};
+
+class MTC_Index {
+public:
+    MTC_Index(uint64_t interval_us, bool pcap, uint32_t codec, int level = -1);
+
+    void add(struct libtrace_packet_t *p, uint64_t ts); //every packet, in write order
+    void set_frames(const std::vector<mtc_index_frame_t> &frames) { frames_ = frames; }
+    bool write(const char *segment, const MTC_Log &log) const;
+
+    /* reader side, false if path is not an index */
+    static bool read(const char *path, mtc_index_hdr_t &hdr,
+                     std::vector<mtc_index_point_t> &points,
+                     std::vector<mtc_index_frame_t> &frames);
+
+protected:
+    uint64_t interval_;
+    bool     pcap_;
+    uint32_t codec_;
+    int      level_;
+    uint64_t next_;
+    uint64_t packets_;
+    uint64_t offset_;
+    std::vector<mtc_index_point_t> points_;
+    std::vector<mtc_index_frame_t> frames_;
+};
+
+#endif /* MTC_INDEX_HH */
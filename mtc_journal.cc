@@ -0,0 +1,469 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <libtrace.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mtc_log.hh"
+#include "mtc_time.hh"
+#include "mtc_output.hh"
+#include "mtc_journal.hh"
+#include "mtc_affinity.hh"
+
+#define PCAP_MAX_CAPLEN 262144 //anything longer is not a record
+#define ERF_TYPE_MAX    48     //highest record type Endace defines
+
+static inline uint32_t
+rd32(const unsigned char *p, bool big) {
+    if (big)
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+MTC_Journal::MTC_Journal(const char *path, const MTC_Log &log) :
+    path_(path),
+    mtclog_(log),
+    fd_(-1),
+    stopping_(false),
+    started_(false),
+    dirty_(false),
+    records_(0),
+    syncs_(0),
+    sync_ns_max_(0)
+{
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&wake_, NULL);
+}
+
+MTC_Journal::~MTC_Journal() {
+    if (started_) {
+        pthread_mutex_lock(&lock_);
+        stopping_ = true;
+        pthread_cond_signal(&wake_);
+        pthread_mutex_unlock(&lock_);
+        pthread_join(thread_, NULL);
+        started_ = false;
+    } else if (fd_ >= 0 && dirty_) {
+        ::fdatasync(fd_);
+    }
+    if (fd_ >= 0)
+        ::close(fd_);
+    pthread_cond_destroy(&wake_);
+    pthread_mutex_destroy(&lock_);
+}
+
+void
+MTC_Journal::load(std::string &text) const {
+    text.clear();
+    int fd = ::open(path_, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno != ENOENT) {
+        mtclog_.panic("cannot open journal (%s): %s\n", path_, strerror(errno));
+    }
+    if (fd < 0)
+        return;
+    char buf[65536];
+    ssize_t len;
+    while ((len = ::read(fd, buf, sizeof(buf))) != 0) {
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            mtclog_.panic("problem reading from journal (%s): %s\n",
+                          path_, strerror(errno));
+        text.append(buf, len);
+    }
+    ::close(fd);
+}
+
+uint64_t
+MTC_Journal::recover() {
+    std::string text;
+    load(text);
+
+    struct pending_t {
+        uint64_t    seqnum_;
+        std::string how_;  //format, ":<codec>" or "|" if not written plain
+        std::string name_;
+    };
+    std::vector<pending_t> unfinished; //opened, never closed
+    bool     any  = false;
+    uint64_t last = 0;
+    size_t   pos  = 0;
+    while (pos < text.size()) {
+        size_t nl = text.find('\n', pos);
+        if (nl == std::string::npos) {
+            //the last write did not make it
+            mtclog_.warn("journal (%s) ends in a partial record, ignored\n", path_);
+            break;
+        }
+        std::string line = text.substr(pos, nl - pos);
+        pos = nl + 1;
+        char *end = 0;
+        if (line.compare(0, 5, "open ") == 0) {
+            pending_t p;
+            p.seqnum_ = strtoull(line.c_str() + 5, &end, 10);
+            if (*end != ' ' || end[1] == '\0') {
+                mtclog_.warn("corrupt journal record (%s): %s\n", path_, line.c_str());
+                continue;
+            }
+            /* older journals have no <how>, their segments are left alone */
+            const char *how = end + 1;
+            const char *sp  = strchr(how, ' ');
+            if (sp) {
+                p.how_.assign(how, sp - how);
+                p.name_ = sp + 1;
+            } else {
+                p.name_ = how;
+            }
+            unfinished.push_back(p);
+            last = p.seqnum_;
+            any  = true;
+        } else if (line.compare(0, 6, "close ") == 0) {
+            uint64_t seqnum = strtoull(line.c_str() + 6, &end, 10);
+            for (size_t k = unfinished.size(); k-- > 0; ) {
+                if (unfinished[k].seqnum_ == seqnum) {
+                    unfinished.erase(unfinished.begin() + k);
+                    break;
+                }
+            }
+        } else if (!line.empty() &&
+                   line.find_first_not_of("0123456789") == std::string::npos) {
+            last = strtoull(line.c_str(), &end, 10);
+            any  = true;
+        } else {
+            mtclog_.warn("corrupt journal record (%s): %s\n", path_, line.c_str());
+        }
+    }
+    if (!any)
+        mtclog_.warn("journal (%s) is empty, starting from zero\n", path_);
+
+    /* close what can be repaired in the old journal first; if we crash
+     * half way, the next run finds the rest still open */
+    if (!unfinished.empty()) {
+        fd_ = ::open(path_, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd_ < 0) {
+            mtclog_.panic("cannot open journal (%s): %s\n", path_, strerror(errno));
+        }
+    }
+    for (size_t k = 0; k < unfinished.size(); ++k) {
+        const char *name = unfinished[k].name_.c_str();
+        const std::string &how = unfinished[k].how_;
+        if (how != "erf" && how != "pcapfile") {
+            mtclog_.warn("cannot repair unfinished segment %s (%s), left as it is\n",
+                         name, how.empty() ? "unknown format" : how.c_str());
+            continue;
+        }
+        uint64_t bytes, packets, first_erf, last_erf;
+        if (!repair(name, how.c_str(), bytes, packets, first_erf, last_erf, mtclog_))
+            continue;
+        mtclog_.warn("repaired unfinished segment %s: %lu packets in %lu bytes\n",
+                     name, packets, bytes);
+        closed(unfinished[k].seqnum_, bytes, packets, first_erf, last_erf);
+    }
+    compact(any ? last : (uint64_t)-1);
+
+    if (!any)
+        return 0;
+    return (last >= SEQNUM_MAX) ? 0 : last + 1; /* wrap */
+}
+
+void
+MTC_Journal::compact(uint64_t last) {
+    /* what the last run wrote is dealt with: keep the close lines, the
+     * history of the segments, and end with the sequence number instead
+     * of the open lines. The rename keeps either the old or the new one */
+    std::string text, kept;
+    load(text); //again, with the close lines of the repairs
+    size_t pos = 0, nl;
+    while ((nl = text.find('\n', pos)) != std::string::npos) {
+        if (text.compare(pos, 6, "close ") == 0)
+            kept.append(text, pos, nl + 1 - pos);
+        pos = nl + 1;
+    }
+    if (last != (uint64_t)-1) {
+        char str[32];
+        snprintf(str, sizeof(str), "%lu\n", last);
+        kept += str;
+    }
+    std::string tmp(path_);
+    tmp += ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        mtclog_.panic("cannot create journal (%s): %s\n", tmp.c_str(), strerror(errno));
+    }
+    if ((ssize_t)kept.size() != ::write(fd, kept.data(), kept.size()))
+        mtclog_.panic("error writing journal (%s): %s\n", tmp.c_str(), strerror(errno));
+    if (::fsync(fd) != 0 || ::close(fd) != 0 || ::rename(tmp.c_str(), path_) != 0) {
+        mtclog_.panic("cannot replace journal (%s): %s\n", path_, strerror(errno));
+    }
+    //the rename itself is only durable once the directory is
+    std::string dir(path_);
+    size_t slash = dir.rfind('/');
+    dir = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : dir.substr(0, slash);
+    int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0 || ::fsync(dfd) != 0)
+        mtclog_.warn("cannot sync journal directory (%s): %s\n", dir.c_str(), strerror(errno));
+    if (dfd >= 0)
+        ::close(dfd);
+    if (fd_ >= 0)
+        ::close(fd_); //the old one, with the repairs' close lines
+    dirty_ = false;
+    fd_ = ::open(path_, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd_ < 0) {
+        mtclog_.panic("cannot open journal (%s): %s\n", path_, strerror(errno));
+    }
+}
+
+void
+MTC_Journal::start() {
+    if (pthread_create(&thread_, NULL, run, this) != 0) {
+        mtclog_.panic("pthread_create for journal: %s\n", strerror(errno));
+    }
+    started_ = true;
+}
+
+void
+MTC_Journal::append(const char *line, size_t len) {
+    pthread_mutex_lock(&lock_);
+    //one write per record, O_APPEND keeps records of other threads whole
+    if ((ssize_t)len != ::write(fd_, line, len))
+        mtclog_.warn("error writing journal (%s): %s\n", path_, strerror(errno));
+    ++records_;
+    if (!dirty_) {
+        dirty_ = true;
+        pthread_cond_signal(&wake_);
+    }
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+MTC_Journal::opened(uint64_t seqnum, const char *name, const char *format,
+                    const char *codec, bool piped) {
+    std::string line("open ");
+    char num[32];
+    snprintf(num, sizeof(num), "%lu ", seqnum);
+    line += num;
+    line += format;
+    if (codec) {
+        line += ':';
+        line += codec;
+    }
+    if (piped)
+        line += '|';
+    line += ' ';
+    line += name;
+    line += '\n';
+    append(line.data(), line.size());
+}
+
+void
+MTC_Journal::closed(uint64_t seqnum, uint64_t bytes, uint64_t packets,
+                    uint64_t first_erf, uint64_t last_erf,
+                    const char *codec, int level) {
+    char line[192];
+    int len = snprintf(line, sizeof(line), "close %lu %lu %lu %lu.%06lu %lu.%06lu",
+                       seqnum, bytes, packets,
+                       (ulong)(first_erf >> 32),
+                       (ulong)(((first_erf & 0xffffffffULL)*1000000) >> 32),
+                       (ulong)(last_erf >> 32),
+                       (ulong)(((last_erf & 0xffffffffULL)*1000000) >> 32));
+    if (codec && level >= 0)
+        len += snprintf(line + len, sizeof(line) - len, " %s:%d", codec, level);
+    else if (codec)
+        len += snprintf(line + len, sizeof(line) - len, " %s", codec);
+    line[len++] = '\n';
+    append(line, len);
+}
+
+bool
+MTC_Journal::repair(const char *name, const char *format, uint64_t &bytes,
+                    uint64_t &packets, uint64_t &first_erf, uint64_t &last_erf,
+                    const MTC_Log &log) {
+    bool pcap = (strcmp(format, "pcapfile") == 0);
+    bytes = packets = first_erf = last_erf = 0;
+    int fd = ::open(name, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        log.warn("cannot repair %s: %s\n", name, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < 4) {
+        log.warn("cannot repair %s: too short\n", name);
+        ::close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void *m = ::mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        log.warn("cannot repair %s: mmap: %s\n", name, strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    const unsigned char *b = static_cast<const unsigned char*>(m);
+    bool compressed =
+        (b[0] == 0x1f && b[1] == 0x8b) ||                               //gzip
+        (b[0] == 'B' && b[1] == 'Z' && b[2] == 'h') ||                  //bzip2
+        (b[0] == 0xfd && b[1] == '7' && b[2] == 'z' && b[3] == 'X') ||  //xz
+        (b[0] == 0x28 && b[1] == 0xb5 && b[2] == 0x2f && b[3] == 0xfd) || //zstd
+        (b[0] == 0x04 && b[1] == 0x22 && b[2] == 0x4d && b[3] == 0x18) || //lz4
+        (b[0] == 0x89 && b[1] == 'L' && b[2] == 'Z' && b[3] == 'O');    //lzo
+    if (compressed) {
+        log.warn("cannot repair %s: compressed, left as it is\n", name);
+        ::munmap(m, size);
+        ::close(fd);
+        return false;
+    }
+
+    /* the journal says what was written; what is there has to agree
+     * before anything is cut off */
+    size_t   good  = 0;
+    uint32_t magic = rd32(b, false);
+    bool     valid;
+    if (pcap) {
+        valid = (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 ||
+                 magic == 0xa1b23c4d || magic == 0x4d3cb2a1);
+    } else {
+        size_t rlen = (size >= 16) ? (((size_t)b[10] << 8) | b[11]) : 0;
+        uint8_t type = b[8] & 0x7f;
+        valid = (size >= 16 && type != 0 && type <= ERF_TYPE_MAX &&
+                 rlen >= 16 && rlen <= size);
+    }
+    if (!valid) {
+        log.warn("cannot repair %s: does not start like %s, left as it is\n", name, format);
+        ::munmap(m, size);
+        ::close(fd);
+        return false;
+    }
+    if (pcap) {
+        bool big  = (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1);
+        bool nano = (magic == 0xa1b23c4d || magic == 0x4d3cb2a1);
+        good = (size >= 24) ? 24 : 0;
+        while (good && good + 16 <= size) {
+            const unsigned char *r = b + good;
+            uint64_t sec  = rd32(r, big);
+            uint64_t frac = rd32(r + 4, big);
+            uint32_t incl = rd32(r + 8, big);
+            if ((sec == 0 && incl == 0) || incl > PCAP_MAX_CAPLEN ||
+                good + 16 + incl > size)
+                break;
+            uint64_t ts = (sec << 32) + ((frac << 32) / (nano ? 1000000000 : 1000000));
+            if (packets++ == 0)
+                first_erf = ts;
+            last_erf = ts;
+            good += 16 + incl;
+        }
+    } else {
+        //erf: little endian timestamp, record length in network order
+        while (good + 16 <= size) {
+            const unsigned char *r = b + good;
+            uint64_t ts   = ((uint64_t)rd32(r + 4, false) << 32) | rd32(r, false);
+            uint8_t  type = r[8] & 0x7f;
+            size_t   rlen = ((size_t)r[10] << 8) | r[11];
+            if (type == 0 || type > ERF_TYPE_MAX || rlen < 16 || good + rlen > size)
+                break;
+            if (packets++ == 0)
+                first_erf = ts;
+            last_erf = ts;
+            good += rlen;
+        }
+    }
+    ::munmap(m, size);
+    if (good == 0) {
+        log.warn("cannot repair %s: no whole record\n", name);
+        ::close(fd);
+        return false;
+    }
+    if (good < size && ::ftruncate(fd, good) != 0)
+        log.warn("cannot truncate %s: %s\n", name, strerror(errno));
+    ::close(fd);
+    bytes = good;
+    return true;
+}
+
+void *
+MTC_Journal::run(void *journal) {
+    static_cast<MTC_Journal*>(journal)->loop();
+    return NULL;
+}
+
+void
+MTC_Journal::loop() {
+    MTC_Affinity::place(MTC_Affinity::ROLE_WRITER, 0, mtclog_);
+    pthread_mutex_lock(&lock_);
+    for (;;) {
+        while (!dirty_ && !stopping_)
+            pthread_cond_wait(&wake_, &lock_);
+        if (!stopping_) {
+            //whatever else is appended meanwhile goes with the same sync
+            struct timespec deadline;
+            ::clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec  += JOURNAL_SYNC_MS/1000;
+            deadline.tv_nsec += (JOURNAL_SYNC_MS%1000)*1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec  += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (!stopping_ &&
+                   pthread_cond_timedwait(&wake_, &lock_, &deadline) != ETIMEDOUT)
+                ;
+        }
+        bool dirty = dirty_;
+        dirty_ = false;
+        pthread_mutex_unlock(&lock_);
+
+        uint64_t ns = 0;
+        if (dirty) {
+            uint64_t t0 = monotonic_ns();
+            if (::fdatasync(fd_) != 0)
+                mtclog_.warn("fdatasync on journal (%s): %s\n", path_, strerror(errno));
+            ns = monotonic_ns() - t0;
+        }
+
+        pthread_mutex_lock(&lock_);
+        if (dirty) {
+            ++syncs_;
+            if (ns > sync_ns_max_)
+                sync_ns_max_ = ns;
+        }
+        if (stopping_ && !dirty_)
+            break;
+    }
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+MTC_Journal::dump_stats() const {
+    pthread_mutex_t *lock = const_cast<pthread_mutex_t*>(&lock_);
+    pthread_mutex_lock(lock);
+    mtclog_.warn("    journal: records=%lu, syncs=%lu, sync max=%.3fs\n",
+                 records_, syncs_, sync_ns_max_/1e9);
+    pthread_mutex_unlock(lock);
+}
@@ -0,0 +1,101 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_JOURNAL_HH
+#define MTC_JOURNAL_HH
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+#define JOURNAL_SYNC_MS 1000 //longest a record waits to be synced
+
+/*
+ * Append-only journal of the segments an output writes, kept in the -N
+ * file. A line is appended when a segment is opened and when it has
+ * been closed, with its size, packet count and first and last packet
+ * times:
+ *
+ *   open <seqnum> <format>[:<codec>][|] <name>
+ *   close <seqnum> <bytes> <packets> <first> <last> [<codec>[:<level>]]
+ *
+ * Lines are written straight into the page cache, so they survive the
+ * process; a background thread syncs them at most every
+ * JOURNAL_SYNC_MS, never the rotating thread. A line holding just a
+ * number is the last sequence number used, as in the seqnum files of
+ * older versions. recover() reads what the last run left behind; only
+ * plain erf and pcapfile segments are repaired, a '|' marks one that
+ * went through --pipeout or to stdout.
+ */
+class MTC_Journal {
+public:
+    MTC_Journal(const char *path, const MTC_Log &log);
+    ~MTC_Journal(); //syncs what is left
+
+    /* repairs segments that were opened but never closed and compacts
+     * the journal to its close lines and last sequence number; returns
+     * the next one */
+    uint64_t recover();
+    void start();
+
+    /* codec as for closed(), piped if not written to name by us */
+    void opened(uint64_t seqnum, const char *name, const char *format,
+                const char *codec, bool piped);
+    /* codec and level are what the segment was compressed with,
+     * NULL and -1 if it was not, or not by us */
+    void closed(uint64_t seqnum, uint64_t bytes, uint64_t packets,
+                uint64_t first_erf, uint64_t last_erf,
+                const char *codec = NULL, int level = -1);
+
+    /* cuts an unfinished file of the given format, erf or pcapfile,
+     * after its last whole record and counts what is left; a file that
+     * does not start with a valid record of that format is refused */
+    static bool repair(const char *name, const char *format, uint64_t &bytes,
+                       uint64_t &packets, uint64_t &first_erf, uint64_t &last_erf,
+                       const MTC_Log &log);
+
+    void dump_stats() const;
+
+protected:
+    void append(const char *line, size_t len);
+    void load(std::string &text) const;
+    void compact(uint64_t last);
+    static void *run(void *journal);
+    void loop();
+
+protected:
+    const char *path_;
+    const MTC_Log
+    &mtclog_;
+    int             fd_;
+    bool            stopping_;
+    bool            started_;
+    pthread_t       thread_;
+    pthread_mutex_t lock_;
+    pthread_cond_t  wake_;
+
+    /* protected by lock_ */
+    bool            dirty_;
+    uint64_t        records_;
+    uint64_t        syncs_;
+    uint64_t        sync_ns_max_;
+};
+
+#endif /* MTC_JOURNAL_HH */
@@ -0,0 +1,91 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <time.h>
+#include <stdlib.h>
+#include <cstdio>
+#include <cstring>
+
+#include "mtc_log.hh"
+#include "mtc_latency.hh"
+
+void
+MTC_Histogram::reset() {
+    memset(counts_, 0, sizeof(counts_));
+    count_ = 0;
+    max_   = 0;
+}
+
+uint64_t
+MTC_Histogram::bucket_high(size_t b) {
+    if (b < LATENCY_SUB)
+        return b;
+    int      e   = b/LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    uint64_t sub = b % LATENCY_SUB;
+    uint64_t low = (LATENCY_SUB + sub) << (e - LATENCY_SUB_BITS);
+    return low + ((1ULL << (e - LATENCY_SUB_BITS)) - 1);
+}
+
+uint64_t
+MTC_Histogram::percentile(double q) const {
+    if (count_ == 0)
+        return 0;
+    uint64_t want = (uint64_t)(q*count_);
+    if (want >= count_)
+        want = count_ - 1;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < LATENCY_BUCKETS; ++b) {
+        seen += counts_[b];
+        if (seen > want) {
+            uint64_t high = bucket_high(b);
+            return (high < max_) ? high : max_;
+        }
+    }
+    return max_;
+}
+
+uint64_t
+MTC_Latency::now_ns() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+void
+MTC_Latency::dump(const MTC_Log &log, const char *who, const char *stage,
+                  const MTC_Histogram &h) {
+    if (h.count() == 0)
+        return;
+    log.warn("    %s latency %s: samples=%lu, p50=%.1fus, p90=%.1fus, p99=%.1fus, "
+             "p99.9=%.1fus, max=%.1fus\n", who, stage, h.count(),
+             h.percentile(0.5)/1e3, h.percentile(0.9)/1e3, h.percentile(0.99)/1e3,
+             h.percentile(0.999)/1e3, h.max()/1e3);
+}
+
+void
+MTC_Latency::dump_segment(const MTC_Log &log, const char *who) {
+    dump(log, who, stage_, segment_);
+    segment_.reset();
+}
+
+void
+MTC_Latency::dump_total(const MTC_Log &log, const char *who) const {
+    dump(log, who, stage_, total_);
+}
@@ -0,0 +1,119 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_LATENCY_HH
+#define MTC_LATENCY_HH
+
+#include <stdint.h>
+#include <cstddef>
+
+class MTC_Log;
+
+/* every power of two is split into 2^LATENCY_SUB_BITS linear buckets,
+ * so a recorded value is off by at most 1/16 */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB      (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS  ((64 - LATENCY_SUB_BITS + 1)*LATENCY_SUB)
+
+/*
+ * HDR-style log-linear histogram of nanosecond values. Recording is
+ * an index computation and an increment, there is no allocation and
+ * no lock: a histogram belongs to the thread that records into it.
+ */
+class MTC_Histogram {
+public:
+    MTC_Histogram() { reset(); }
+
+    void record(uint64_t v) {
+        ++counts_[bucket(v)];
+        ++count_;
+        if (v > max_)
+            max_ = v;
+    }
+    void reset();
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+    uint64_t percentile(double q) const; //upper bound of the bucket holding q
+
+    static size_t bucket(uint64_t v) {
+        if (v < LATENCY_SUB)
+            return v;
+        int e = 63 - __builtin_clzll(v);
+        return (size_t)(e - LATENCY_SUB_BITS + 1)*LATENCY_SUB +
+            ((v >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+    }
+    static uint64_t bucket_high(size_t b);
+
+protected:
+    uint64_t counts_[LATENCY_BUCKETS];
+    uint64_t count_;
+    uint64_t max_;
+};
+
+/*
+ * Latency of one pipeline stage, kept for the current segment and in
+ * total. Only one in every_ calls to due() says yes, so the clock is
+ * read for a fraction of the packets only.
+ */
+class MTC_Latency {
+public:
+    MTC_Latency(const char *stage, uint32_t every) :
+        stage_(stage),
+        every_(every ? every : 1),
+        skip_(1) {}
+
+    bool due() {
+        if (--skip_ != 0)
+            return false;
+        skip_ = every_;
+        return true;
+    }
+    void record(uint64_t ns) {
+        segment_.record(ns);
+        total_.record(ns);
+    }
+    /* time since the packet was captured, 0 if its clock is ahead */
+    void record_age(uint64_t erf) {
+        uint64_t now = now_ns(), ts = erf_ns(erf);
+        record(now > ts ? now - ts : 0);
+    }
+
+    void dump_segment(const MTC_Log &log, const char *who); //and starts over
+    void dump_total(const MTC_Log &log, const char *who) const;
+
+    static uint64_t now_ns(); //CLOCK_REALTIME, comparable to capture timestamps
+    static uint64_t erf_ns(uint64_t erf) {
+        return (erf >> 32)*1000000000ULL + (((erf & 0xffffffffULL)*1000000000ULL) >> 32);
+    }
+
+protected:
+    static void dump(const MTC_Log &log, const char *who, const char *stage,
+                     const MTC_Histogram &h);
+
+protected:
+    const char   *stage_;
+    uint32_t      every_;
+    uint32_t      skip_;
+    MTC_Histogram segment_;
+    MTC_Histogram total_;
+};
+
+#endif /* MTC_LATENCY_HH */
@@ -0,0 +1,102 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_MERGE_HH
+#define MTC_MERGE_HH
+
+#include <stdint.h>
+#include <cstddef>
+#include <cassert>
+
+/*
+ * k-way merge of input heads: a binary min-heap of (erf timestamp, input)
+ * pairs. The timestamp of each head packet is decoded once when it is
+ * pushed, so selecting the oldest head is O(1) and replacing it
+ * O(log inputs). Ties go to the lower input index, like the linear scan
+ * this replaces.
+ */
+class MTC_Merge {
+public:
+    explicit MTC_Merge(size_t inputs) :
+        heap_(new entry_t[inputs]),
+        size_(0),
+        capacity_(inputs) {
+    }
+    ~MTC_Merge() { delete [] heap_; }
+
+    bool     empty() const { return size_ == 0; }
+    size_t   size() const { return size_; }
+    int      top() const { return heap_[0].idx_; }
+    uint64_t top_ts() const { return heap_[0].ts_; }
+
+    /* input idx has a new head packet, at most one per input */
+    void push(int idx, uint64_t ts) {
+        assert(size_ < capacity_);
+        size_t n = size_++;
+        entry_t e = { ts, idx };
+        while (n > 0) {
+            size_t parent = (n - 1) / 2;
+            if (!less(e, heap_[parent]))
+                break;
+            heap_[n] = heap_[parent];
+            n = parent;
+        }
+        heap_[n] = e;
+    }
+
+    /* removes the oldest head and returns its input index */
+    int pop() {
+        int idx = heap_[0].idx_;
+        entry_t e = heap_[--size_];
+        size_t n = 0;
+        for (;;) {
+            size_t child = 2*n + 1;
+            if (child >= size_)
+                break;
+            if (child + 1 < size_ && less(heap_[child + 1], heap_[child]))
+                ++child;
+            if (!less(heap_[child], e))
+                break;
+            heap_[n] = heap_[child];
+            n = child;
+        }
+        if (size_ > 0)
+            heap_[n] = e;
+        return idx;
+    }
+
+private:
+    struct entry_t {
+        uint64_t ts_;
+        int      idx_;
+    };
+    static bool less(const entry_t &a, const entry_t &b) {
+        return (a.ts_ < b.ts_) || (a.ts_ == b.ts_ && a.idx_ < b.idx_);
+    }
+
+    MTC_Merge(const MTC_Merge&);
+    MTC_Merge& operator=(const MTC_Merge&);
+
+    entry_t *heap_;
+    size_t   size_;
+    size_t   capacity_;
+};
+
+#endif /* MTC_MERGE_HH */
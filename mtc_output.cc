@@ -26,55 +26,90 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include <libtrace.h>
 #include <cstring>
 #include <string>
 #include <cassert>
 
 #include "mtc_log.hh"
+#include "mtc_time.hh"
 #include "mtc_output.hh"
-
-//empty pcap file that we dump if there is no traffic
-//can't do it in libtrace apparently
-static const unsigned char null_pcap[] = {
-                                          0324, 0303, 0262, 0241, 0002, 0000, 0004, 0000,
-                                          0000, 0000, 0000, 0000, 0000, 0000, 0000, 0000,
-                                          0000, 0000, 0004, 0000, 0001, 0000, 0000, 0000
-};
-
-bool operator>(const timeval& lhs, const timeval& rhs) {
-    return ((lhs.tv_sec > rhs.tv_sec) ||
-            ((lhs.tv_sec == rhs.tv_sec) && (lhs.tv_usec > rhs.tv_usec)));
-};
-
+#include "mtc_pool.hh"
+#include "mtc_finalizer.hh"
+#include "mtc_compress.hh"
+#include "mtc_preopen.hh"
+#include "mtc_direct.hh"
+#include "mtc_index.hh"
+#include "mtc_stats.hh"
+#include "mtc_latency.hh"
+#include "mtc_affinity.hh"
+#include "mtc_watch.hh"
+#include "mtc_journal.hh"
+#include "mtc_adapt.hh"
+
+/* how often the pipe backlog of a segment is sampled, in packets */
+#define STATS_BACKLOG_EVERY 4096
 
 MTC_Output::MTC_Output(char *outputfn, char *basename,
                        const timeval &started, const MTC_Log &log) :
     outputfn_(0),
     basename_(0),
-    watchfile_(0),
     seqnumfile_(0),
     extension_(0),
     format_(0),
     pipeout_(0),
     inputs_(0),
     inputs_cnt_(0),
+    input_drops_(0),
+    pool_(0),
     current_seqnum_(0),
+    seg_seqnum_(0),
+    journal_(0),
     useutc_(true),
     signalled_(false),
     mtclog_(log),
     compress_level_(-1),
     compress_type_(TRACE_OPTION_COMPRESSTYPE_NONE),
+    adapt_(0),
+    adapt_level_(-1),
     segmentsize_(0),
+    direct_io_(false),
+    index_ms_(0),
     current_segsize_(0),
     rotatesec_(0),
     total_disorders_(0),
     total_packets_(0),
     segment_packets_(0),
     segment_disorders_(0),
+    watch_(0),
+    gated_(false),
+    gate_start_ns_(0),
+    gate_packets_(0),
+    segment_gated_ns_(0),
+    segment_gated_packets_(0),
+    total_gated_ns_(0),
+    total_gated_packets_(0),
     output_(0),
+    seg_fd_(-1),
+    seg_stream_(0),
+    seg_direct_(0),
+    seg_index_(0),
+    seg_pipe_high_(0),
+    seg_level_(-1),
+    compressor_(0),
+    finalizer_(0),
+    preopen_(0),
+    stats_(0),
+    stats_next_backlog_(0),
+    lat_write_(0),
+    lat_open_(0),
+    lat_close_(0),
+    close_ns_(0),
     first_ts_(timeval{0,0}),
-    last_ts_(timeval{0,0}),
+    first_erf_(0),
+    last_erf_(0),
     last_rotated_(started)
 {
     //extract format
@@ -99,6 +134,7 @@ MTC_Output::MTC_Output(char *outputfn, char *basename,
     }
     assert( (basename != 0)^(outputfn != 0) );
    
+    shard_tag_[0] = '\0';
     is_pcap_ = (std::string(format_) == std::string("pcapfile"));
     outputfn_ = outputfn;
     basename_ = basename;
@@ -106,125 +142,234 @@ MTC_Output::MTC_Output(char *outputfn, char *basename,
 
 MTC_Output::~MTC_Output() {
     close_trace();
+    wait_closed();
+    delete preopen_;
+    delete finalizer_;
+    delete watch_;
+    delete journal_; //every close record is in by now
+    delete adapt_;
+    set_latency(0);
 }
 
-/* Sequence numbers */
 void
-MTC_Output::init_seqnum() {
-    /* write _seqnum to a disk */
-    char str[128];
-    char *endptr = &str[0];
+MTC_Output::set_watchfile(const char *watchfile) {
+    delete watch_;
+    watch_ = new MTC_Watchfile(watchfile, mtclog_);
+}
 
-    if (seqnumfile_ == NULL) {
+void
+MTC_Output::set_adapt_level(int min, int max, int start) {
+    delete adapt_;
+    adapt_ = new MTC_LevelControl(min, max, start, mtclog_);
+    adapt_level_.store(adapt_->level(), std::memory_order_relaxed);
+}
+
+void
+MTC_Output::set_latency(uint32_t every) {
+    delete lat_write_;
+    delete lat_open_;
+    delete lat_close_;
+    lat_write_ = lat_open_ = lat_close_ = 0;
+    if (every == 0)
         return;
-    }
-    int seqnumfd = open(seqnumfile_,
-                        O_RDONLY|O_CREAT|O_SYNC,
-                        S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-    if (seqnumfd < 0) {
-        mtclog_.panic("cannot open seqnum file (%s): %s\n",
-                      seqnumfile_, strerror(errno));
-    }
-    size_t rlen = read(seqnumfd, str, sizeof(str)-1);
-    if (rlen < 0) {
-        mtclog_.panic("problem reading from seqnum file (%s): %s\n",
-                      seqnumfile_, strerror(errno));
-    } else if (rlen == 0) {
-        mtclog_.warn("seqnum file (%s) is truncated, starting from zero\n",
-                     seqnumfile_);
-        current_seqnum_ = 0;
-    } else {
-        /* basic error checking */
-        str[rlen] = '\0';
-        if (str[rlen-1] != '\n' || strlen(str) != rlen) {
-            mtclog_.panic("corrupt seqnum file (%s): %s\n",
-                          seqnumfile_, str);
-        }
-        current_seqnum_ = strtoul(str, &endptr, 10);
-        if (*endptr != '\n') {
-            mtclog_.panic("corrupt seqnum file (%s): %s [%lu]\n",
-                          seqnumfile_, str, current_seqnum_);
-        }
-        if (++current_seqnum_ > SEQNUM_MAX)
-            current_seqnum_ = 0; /* wrap */
+    lat_write_ = new MTC_Latency("write", every);
+    lat_open_  = new MTC_Latency("open", 1);
+    lat_close_ = new MTC_Latency("close", 1);
+}
 
-    }
-    close(seqnumfd);
+void
+MTC_Output::set_preopen() {
+    if (preopen_ || !basename_)
+        return;
+    preopen_ = new MTC_Preopener(*this, mtclog_);
+    preopen_->start();
+    preopen_->prepare(current_seqnum_);
 }
 
 void
-MTC_Output::save_seqnum() {
-    char str[128];
-    if (seqnumfile_ == NULL) {
+MTC_Output::set_close_queue(size_t segments) {
+    if (finalizer_ || segments == 0)
         return;
-    }
-    int seqnumfd = open(seqnumfile_,
-                        O_WRONLY|O_CREAT|O_SYNC|O_TRUNC,
-                        S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    finalizer_ = new MTC_Finalizer(segments, mtclog_);
+    finalizer_->start();
+}
 
-    if (seqnumfd < 0) {
-        fprintf(stderr, "error reopening seqnum file (%s): %s\n",
-                seqnumfile_, strerror(errno));
-    }
-    sprintf(str, "%lu\n", current_seqnum_);
-    int wlen = strlen(str);
-    if (wlen != write(seqnumfd, str, wlen))
-        fprintf(stderr, "error writing seqnum file (%s): %s\n",
-                seqnumfile_, strerror(errno));
-    close(seqnumfd);
+void
+MTC_Output::set_shard(int shard) {
+    snprintf(shard_tag_, sizeof(shard_tag_), ".s%02d", shard);
 }
 
-void *
-MTC_Output::close_trace(void *to) {
-    if (to) {
-        trace_destroy_output((libtrace_out_t*)to);
+void
+MTC_Output::wait_closed() {
+    if (preopen_)
+        preopen_->shutdown(); //drops the segment prepared last
+    if (finalizer_)
+        finalizer_->shutdown();
+}
+
+/* Sequence numbers, kept in the segment journal */
+void
+MTC_Output::init_seqnum() {
+    if (seqnumfile_ == NULL) {
+        return;
     }
-    return NULL;
+    delete journal_;
+    journal_ = new MTC_Journal(seqnumfile_, mtclog_);
+    current_seqnum_ = journal_->recover();
+    journal_->start();
 }
 
 void
 MTC_Output::close_trace() {
-    if (is_pcap_ && output_ && segment_packets_ == 0) {
-        //empty files are not allowed
-        if (sizeof(null_pcap) != write(STDOUT_FILENO, null_pcap,
-                                       sizeof(null_pcap))) {
-            mtclog_.warn("Cannot write null file %s\n", namebuf_);
+    uint64_t t0 = monotonic_ns();
+    if (output_ || seg_fd_ >= 0) {
+        MTC_Segment *seg = new MTC_Segment;
+        seg->output_     = output_;
+        seg->fd_         = seg_fd_;
+        seg->write_null_ = (is_pcap_ && output_ && segment_packets_ == 0);
+        seg->packets_    = segment_packets_;
+        seg->stream_     = seg_stream_;
+        seg->direct_     = seg_direct_;
+        seg->index_      = seg_index_;
+        seg->seqnum_     = seg_seqnum_;
+        seg->journal_    = journal_;
+        seg->first_erf_  = segment_packets_ ? first_erf_ : 0;
+        seg->last_erf_   = last_erf_;
+        seg->codec_      = codec_name();
+        seg->level_      = seg_level_;
+        strncpy(seg->name_, namebuf_, sizeof(seg->name_)-1);
+        seg->name_[sizeof(seg->name_)-1] = '\0';
+        /* closing NFS files can take a while, so leave it to the
+         * finalizer thread. Segments going to stdout, straight or
+         * through a --pipeout command, share it with the next one and
+         * are closed right here, or two writers could interleave. */
+        if (finalizer_ && seg_fd_ >= 0 && !to_stdout()) {
+            finalizer_->submit(seg);
+        } else {
+            MTC_Finalizer::finalize(seg, mtclog_);
         }
+        close_ns_ = monotonic_ns() - t0;
+        if (lat_close_)
+            lat_close_->record(close_ns_);
     }
-    close_trace(output_);
     output_ = 0;
+    seg_fd_ = -1;
+    seg_stream_ = 0;
+    seg_direct_ = 0;
+    seg_index_  = 0;
+    seg_pipe_high_ = 0;
+    seg_level_  = -1;
     ::gettimeofday(&last_rotated_, 0);
     first_ts_.tv_sec = 0;
     first_ts_.tv_usec = 0;
-    last_ts_.tv_sec = 0;
-    last_ts_.tv_usec = 0;
+    last_erf_ = 0;
+}
+
+void
+MTC_Input::update_drops() {
+    libtrace_stat_t *stat = trace_get_statistics(in_, NULL);
+    if (stat->dropped_valid)
+        drops_.store(stat->dropped, std::memory_order_relaxed);
+}
+
+static inline timeval
+erf_to_timeval(uint64_t erf) {
+    timeval tv;
+    tv.tv_sec  = erf >> 32;
+    tv.tv_usec = ((erf & 0xffffffffULL)*1000000) >> 32;
+    return tv;
 }
 
 int
 MTC_Output::write_packet(libtrace_packet_t *p) {
-    timeval ts = trace_get_timeval(p);
-    
-    if (!output_) {
-        open_trace(ts);
-    } else {
-        //xxx update stats, maybe rotate
-        current_segsize_ += trace_get_capture_length(p);
-        if (segmentsize_ && current_segsize_ > segmentsize_) {
-            //data-driven rotation by size
-            //time-driven rotation is handled by calling open_trace()
-            //from outside
-            open_trace(ts);
+    uint64_t ts = trace_get_erf_timestamp(p);
+    return write_packets(&p, &ts, 1);
+}
+
+int
+MTC_Output::write_packets(libtrace_packet_t * const *pkts, const uint64_t *ts,
+                          size_t cnt) {
+    int    ret = 0;
+    size_t i   = 0;
+    while (i < cnt) {
+        /* rotation only ever happens between runs, counters are
+         * updated once per run rather than per packet */
+        uint64_t boundary = (uint64_t)-1;
+        if (rotatesec_) {
+            boundary = (uint64_t)(last_rotated_.tv_sec + rotatesec_) << 32;
+            if (ts[i] >= boundary) {
+                rotate_trace(erf_to_timeval(ts[i])); //time-driven rotation
+                boundary = (uint64_t)(last_rotated_.tv_sec + rotatesec_) << 32;
+            }
+        }
+        if (!output_ || (segmentsize_ && current_segsize_ > segmentsize_)) {
+            //first packet, or data-driven rotation by size
+            open_trace(erf_to_timeval(ts[i]));
         }
+        if (!output_) {
+            //gated by -W, nowhere to write these to
+            gate_packets_       += cnt - i;
+            total_gated_packets_+= cnt - i;
+            if (stats_)
+                mtc_stat_add(stats_->gated_packets_, cnt - i);
+            break;
+        }
+
+        size_t   run   = i;
+        uint64_t bytes = 0;
+        uint64_t disorders = 0;
+        uint64_t last  = last_erf_;
+        if (segment_packets_ == 0)
+            first_erf_ = ts[i];
+        do {
+            if (last > ts[run])
+                ++disorders;
+            last   = ts[run];
+            bytes += trace_get_capture_length(pkts[run]);
+            if (seg_index_)
+                seg_index_->add(pkts[run], ts[run]);
+            if (trace_write_packet(output_, pkts[run]) < 0)
+                ret = -1;
+            if (lat_write_ && lat_write_->due())
+                lat_write_->record_age(ts[run]);
+            ++run;
+        } while (run < cnt && ts[run] < boundary &&
+                 !(segmentsize_ && current_segsize_ + bytes > segmentsize_));
+
+        last_erf_          = last;
+        current_segsize_  += bytes;
+        segment_packets_  += run - i;
+        total_packets_    += run - i;
+        segment_disorders_+= disorders;
+        total_disorders_  += disorders;
+        if (stats_) {
+            mtc_stat_add(stats_->packets_, run - i);
+            mtc_stat_add(stats_->bytes_, bytes);
+            mtc_stat_add(stats_->disorders_, disorders);
+        }
+        i = run;
     }
-    if (last_ts_ > ts) {
-        ++segment_disorders_;
-        ++total_disorders_;
+    if ((stats_ || adapt_) && total_packets_ >= stats_next_backlog_) {
+        //whatever sits in our pipe has not reached the compressor or disk yet
+        int queued = 0;
+        if (seg_fd_ >= 0 && (seg_stream_ || seg_direct_ || (pipeout_ && pipeout_[0])) &&
+            ::ioctl(seg_fd_, FIONREAD, &queued) == 0) {
+            if (stats_)
+                mtc_stat_set(stats_->backlog_, queued);
+            if (adapt_ && seg_pipe_high_)
+                adapt_->backlog((unsigned)((uint64_t)queued*BACKLOG_HIGH_PCT/seg_pipe_high_));
+        }
+        stats_next_backlog_ = total_packets_ + STATS_BACKLOG_EVERY;
     }
-    last_ts_ = ts;
-    
-    ++total_packets_;
-    ++segment_packets_;
-    return trace_write_packet(output_, p);
+    return (ret < 0) ? ret : (int)cnt;
+}
+
+bool
+MTC_Output::backlogged() const {
+    if (!seg_pipe_high_)
+        return false;
+    int queued = 0;
+    return ::ioctl(seg_fd_, FIONREAD, &queued) == 0 && (size_t)queued >= seg_pipe_high_;
 }
 
 void
@@ -239,34 +384,36 @@ void
 MTC_Output::open_trace(const timeval& ts) {
     if (output_ != NULL) {
         if (mtclog_.verbose())
-            dump_seg_stats(); // has to be done here, before new thread
-        /* close previous file: closing NFS files can take a while, so
-         * start a new thread to do that. */
-#if 0
-        pthread_t th;
-        pthread_attr_t attr;
-
-        if (pthread_attr_init(&attr) != 0) {
-            mtclog_.panic("pthread_attr_init");
-        }
-
-        if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0) {
-            mtclog_.panic("pthread_attr_setdetachstate\n");
-        }
-        if (pthread_create(&th, &attr, close_trace, output_) != 0) {
-            mtclog_.panic("pthread_create\n");
-        }
-        output_ = NULL;
-#else
+            dump_seg_stats();
         close_trace();
-#endif
     }
 
-    /* before opening, sleep on a watchfile if any */
-    size_t slept = sleep_on_watchfile();
-    if (slept > 0)
-        mtclog_.warn("slept on %s for %lu seconds\n",
-                     watchfile_, (ulong)slept);
+    /* no new segment while the watchfile is missing; the caller sees
+     * gated() and stops capturing, write_packets() drops the rest */
+    uint64_t gate_ns = 0;
+    if (watch_ && !watch_->present()) {
+        if (!gated_.load(std::memory_order_relaxed)) {
+            gate_start_ns_ = monotonic_ns();
+            gated_.store(true, std::memory_order_relaxed);
+            mtclog_.warn("%s is missing, holding the next segment\n", watch_->path());
+        }
+        return;
+    }
+    if (gated_.load(std::memory_order_relaxed)) {
+        uint64_t end = watch_->appeared_ns();
+        if (end < gate_start_ns_)
+            end = monotonic_ns();
+        gate_ns = end - gate_start_ns_;
+        total_gated_ns_ += gate_ns;
+        if (stats_)
+            mtc_stat_add(stats_->gated_ns_, gate_ns);
+        mtclog_.warn("%s appeared after %.3fs, %lu packets dropped meanwhile\n",
+                     watch_->path(), gate_ns/1e9, gate_packets_);
+        gated_.store(false, std::memory_order_relaxed);
+    }
+    if (adapt_)
+        adapt_level(); //from how the last segment went
+    uint64_t t0 = monotonic_ns();
 
     if (basename_) {
         /* make up a new file's name */
@@ -276,106 +423,186 @@ MTC_Output::open_trace(const timeval& ts) {
         tm_ptr->tm_year += 1900;
         tm_ptr->tm_mon++;
 
-        sprintf(namebuf_, "%s/%4d%02d%02d-%02d%02d%02d-" SEQNUM_FMT "%s",
+        sprintf(namebuf_, "%s/%4d%02d%02d-%02d%02d%02d-" SEQNUM_FMT "%s%s",
                 basename_,
                 tm_ptr->tm_year, tm_ptr->tm_mon, tm_ptr->tm_mday,
                 tm_ptr->tm_hour, tm_ptr->tm_min, tm_ptr->tm_sec,
-                current_seqnum_, (extension_)?extension_:"");
+                current_seqnum_, shard_tag_, (extension_)?extension_:"");
     } else {
         strncpy(namebuf_, outputfn_, sizeof(namebuf_)-1);
     }
     //namebuf_ now has "pure" (i.e. without format) filename of the output
 
+    if (preopen_ && basename_) {
+        /* the next segment is already open under a temporary name,
+         * all that is left is to give it its real one */
+        MTC_Segment *seg = preopen_->take();
+        assert(seg->seqnum_ == current_seqnum_);
+        if (::rename(seg->name_, namebuf_) != 0) {
+            mtclog_.warn("cannot rename %s to %s: %s\n",
+                         seg->name_, namebuf_, strerror(errno));
+            strcpy(namebuf_, seg->name_);
+        }
+        output_     = seg->output_;
+        seg_fd_     = seg->fd_;
+        seg_stream_ = seg->stream_;
+        seg_direct_ = seg->direct_;
+        seg_level_  = seg->level_; //decided a segment ago
+        delete seg;
+        seg_seqnum_ = current_seqnum_;
+        if (journal_)
+            journal_->opened(seg_seqnum_, namebuf_, format_, codec_name(),
+                             pipeout_ || to_stdout());
+        if (++current_seqnum_ > SEQNUM_MAX)
+            current_seqnum_ = 0; /* wrap */
+        preopen_->prepare(current_seqnum_);
+    } else {
+        MTC_Segment seg;
+        start_segment(&seg, namebuf_);
+        output_     = seg.output_;
+        seg_fd_     = seg.fd_;
+        seg_stream_ = seg.stream_;
+        seg_direct_ = seg.direct_;
+        seg_level_  = seg.level_;
+
+        seg_seqnum_ = current_seqnum_;
+        if (journal_)
+            journal_->opened(seg_seqnum_, namebuf_, format_, codec_name(),
+                             pipeout_ || to_stdout()); //synced in the background
+        if (++current_seqnum_ > SEQNUM_MAX)
+            current_seqnum_ = 0; /* wrap */
+    }
+
+    seg_pipe_high_ = 0;
+    if (seg_fd_ >= 0 && (seg_stream_ || seg_direct_ || (pipeout_ && pipeout_[0]))) {
+        int pipe_sz = ::fcntl(seg_fd_, F_GETPIPE_SZ);
+        if (pipe_sz > 0)
+            seg_pipe_high_ = (size_t)pipe_sz*BACKLOG_HIGH_PCT/100;
+    }
+
+    if (index_ms_ && !to_stdout()) {
+        uint32_t codec = INDEX_CODEC_NONE;
+        if (compressor_)
+            codec = (compressor_->codec() == MTC_Compressor::CODEC_ZSTD) ?
+                INDEX_CODEC_ZSTD : INDEX_CODEC_LZ4;
+        else if (compress_type_ != TRACE_OPTION_COMPRESSTYPE_NONE ||
+                 (pipeout_ && pipeout_[0]))
+            codec = INDEX_CODEC_OTHER;
+        seg_index_ = new MTC_Index(1000*index_ms_, is_pcap_, codec, seg_level_);
+    }
+
+    reset_segmentstats();
+    segment_gated_ns_      = gate_ns;
+    segment_gated_packets_ = gate_packets_;
+    gate_packets_ = 0;
+    first_ts_ = ts;
+
+    uint64_t open_ns = monotonic_ns() - t0;
+    if (lat_open_)
+        lat_open_->record(open_ns);
+    if (stats_) {
+        //closing the last segment and opening this one, without the watchfile wait
+        uint64_t switch_ns = close_ns_ + open_ns;
+        const char *base = strrchr(namebuf_, '/');
+        snprintf(stats_->name_, sizeof(stats_->name_), "%s", base ? base+1 : namebuf_);
+        mtc_stat_add(stats_->segments_, 1);
+        mtc_stat_set(stats_->level_, seg_level_ + 1);
+        mtc_stat_set(stats_->rotate_ns_last_, switch_ns);
+        if (switch_ns > stats_->rotate_ns_max_.load(std::memory_order_relaxed))
+            mtc_stat_set(stats_->rotate_ns_max_, switch_ns);
+    }
+    close_ns_ = 0;
+}
+
+void
+MTC_Output::start_segment(MTC_Segment *seg, const char *path) {
+    seg->codec_ = codec_name();
+    if (!seg->codec_)
+        seg->level_ = -1;
+    else if (adapt_)
+        seg->level_ = adapt_level_.load(std::memory_order_relaxed);
+    else
+        seg->level_ = compressor_ ? compressor_->level() : compress_level_;
+
     int filefd = STDOUT_FILENO;
-    if (namebuf_[0] == '-' && namebuf_[1] == '\0') {
+    if (path[0] == '-' && path[1] == '\0') {
         //dumping to stdout in the first place, nothing to do
+    } else if (direct_io_) {
+        /* the writer thread owns the file, everything upstream writes
+         * into its pipe; preallocate what a full segment would take */
+        seg->direct_ = new MTC_DirectWriter(path, segmentsize_, mtclog_);
+        filefd = seg->direct_->fd();
     } else {
-        filefd = open(namebuf_, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+        filefd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
         if (filefd < 0) {
             mtclog_.panic("Error opening file '%s': %s\n",
-                          namebuf_,
+                          path,
                           strerror(errno));
         }
     }
-    if (!pipeout_[0]) {
-        ::dup2(filefd, STDOUT_FILENO);
-    } else {
-        insert_pipe(filefd);
+    /* every segment keeps its own fd so that it can be closed while the
+     * next one is already being written; libtrace reopens it by path */
+    if (compressor_) {
+        seg->stream_ = compressor_->attach(filefd, path, seg->level_);
+        seg->fd_ = seg->stream_->fd();
+    } else if (pipeout_ && pipeout_[0]) {
+        seg->fd_ = insert_pipe(filefd);
+        if (filefd != STDOUT_FILENO)
+            ::close(filefd); //the compressor has it now
+    } else if (filefd != STDOUT_FILENO) {
+        seg->fd_ = filefd;
     }
     /* open a new one */
-    char stdout_uri[256];
-    snprintf(stdout_uri, sizeof(stdout_uri), "%s:-", format_);
-    output_ = trace_create_output(stdout_uri);
-    if (trace_is_err_output(output_)) {
-        trace_perror_output(output_, "trace_create_output");
+    char out_uri[256];
+    if (seg->fd_ >= 0)
+        snprintf(out_uri, sizeof(out_uri), "%s:/dev/fd/%d", format_, seg->fd_);
+    else
+        snprintf(out_uri, sizeof(out_uri), "%s:-", format_);
+    seg->output_ = trace_create_output(out_uri);
+    if (trace_is_err_output(seg->output_)) {
+        trace_perror_output(seg->output_, "trace_create_output");
         exit(1);
     }
 
-    if (compress_level_ >= 0 && 
-        trace_config_output(output_, 
-                            TRACE_OPTION_OUTPUT_COMPRESS, &compress_level_) == -1) {
-        trace_perror_output(output_, "Unable to set compression level");
+    int level = (compressor_ || !seg->codec_) ? compress_level_ : seg->level_;
+    if (level >= 0 &&
+        trace_config_output(seg->output_, 
+                            TRACE_OPTION_OUTPUT_COMPRESS, &level) == -1) {
+        trace_perror_output(seg->output_, "Unable to set compression level");
         exit(1);
     }
     if (compress_type_ != TRACE_OPTION_COMPRESSTYPE_NONE) {
-        if (trace_config_output(output_, TRACE_OPTION_OUTPUT_COMPRESSTYPE,
+        if (trace_config_output(seg->output_, TRACE_OPTION_OUTPUT_COMPRESSTYPE,
                                 &compress_type_) == -1) {
-            trace_perror_output(output_, "Unable to set compression type");
+            trace_perror_output(seg->output_, "Unable to set compression type");
             exit(1);
         }
     }
 
-    if (trace_start_output(output_) == -1) {
-        trace_perror_output(output_, "trace_start_output");
+    if (trace_start_output(seg->output_) == -1) {
+        trace_perror_output(seg->output_, "trace_start_output");
         exit(1);
     }
-
-    save_seqnum(); /* save last sequence number written */
-    if (++current_seqnum_ > SEQNUM_MAX)
-        current_seqnum_ = 0; /* wrap */
-
-    reset_segmentstats();
-    first_ts_ = ts;
 }
 
-size_t
-MTC_Output::sleep_on_watchfile() {
-    size_t slept = 0;
-    if (!watchfile_)
-        return slept;
+MTC_Segment *
+MTC_Output::prepare_segment(uint64_t seqnum) {
+    MTC_Segment *seg = new MTC_Segment;
+    seg->seqnum_ = seqnum;
+    //hidden until it gets its timestamped name
+    snprintf(seg->name_, sizeof(seg->name_), "%s/." SEQNUM_FMT "%s.open%s",
+             basename_, seqnum, shard_tag_, (extension_)?extension_:"");
+    start_segment(seg, seg->name_);
+    return seg;
+}
 
-    bool suspended = false;
-    for (;;) {
-        if (signalled_) {
-            //xxx cleanup first
-            return slept;
-        }
-        int fd = open(watchfile_, O_RDONLY);
-        if (fd != -1) {
-            /* file exists */
-            close(fd);
-            break;
-        } else {
-            /* file does not exist: must sleep */
-            if (!suspended) {
-                fprintf(stderr, "going into sleep on watchfile...\n");
-                /* suspend capture */
-                //xxx
-                //trace_pause(input[i].fs_)
-                //xxx
-                suspended = 1;
-            }
-            /* file doesn't exist: sleep then repeat */
-            sleep(1);
-            ++slept;
-        }
-    }
-    if (suspended) {
-        /* resume */
-        //xxx
-        //trace_start(input[i].fs_);
-    }
-    return slept;
+void
+MTC_Output::discard_segment(MTC_Segment *seg) {
+    char name[sizeof(seg->name_)];
+    strcpy(name, seg->name_);
+    MTC_Finalizer::finalize(seg, mtclog_);
+    if (::unlink(name) != 0)
+        mtclog_.warn("cannot remove %s: %s\n", name, strerror(errno));
 }
 
 void
@@ -384,20 +611,94 @@ MTC_Output::set_compression(trace_option_compresstype_t type, int level) {
     compress_level_= level;
 }
 
+/* how segments are compressed, as recorded in the journal */
+const char *
+MTC_Output::codec_name() const {
+    if (compressor_)
+        return (compressor_->codec() == MTC_Compressor::CODEC_ZSTD) ? "zstd" : "lz4";
+    switch (compress_type_) {
+    case TRACE_OPTION_COMPRESSTYPE_ZLIB:
+        return "gzip";
+    case TRACE_OPTION_COMPRESSTYPE_BZ2:
+        return "bzip2";
+    case TRACE_OPTION_COMPRESSTYPE_LZO:
+        return "lzo";
+    case TRACE_OPTION_COMPRESSTYPE_LZMA:
+        return "xz";
+    default:
+        return NULL; //none, or whatever --pipeout runs
+    }
+}
+
+/* --adapt-level: drops the inputs counted and the time spent
+ * compressing since the last segment was opened. libtrace compresses
+ * on the thread that writes, which is the one calling this. Shards and
+ * sinks write on threads of their own and must not ask the inputs, they
+ * get the sum the merger publishes instead. */
+void
+MTC_Output::adapt_level() {
+    uint64_t drops = 0;
+    if (input_drops_) {
+        drops = input_drops_->load(std::memory_order_relaxed); //up to a second old
+    } else {
+        for (size_t i = 0; i < inputs_cnt_; ++i)
+            drops += inputs_[i].dropped() + inputs_[i].ring_drops_.load(std::memory_order_relaxed);
+    }
+    uint64_t busy_ns;
+    size_t   threads;
+    if (compressor_) {
+        busy_ns = compressor_->busy_ns();
+        threads = compressor_->threads();
+    } else {
+        struct timespec ts;
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        busy_ns = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+        threads = 1;
+    }
+    adapt_level_.store(adapt_->next(drops, busy_ns, threads), std::memory_order_relaxed);
+}
+
 void
 MTC_Output::dump_seg_stats() const {
     mtclog_.warn("uri=%s, packets=%lu, disorders=%lu\n",
                  namebuf_, segment_packets_, segment_disorders_);
+    if (seg_level_ >= 0)
+        mtclog_.warn("    compress=%s:%d\n", codec_name(), seg_level_);
+    if (watch_) {
+        //the wait for the watchfile before this segment
+        mtclog_.warn("    gated=%.3fs, gated_packets=%lu\n",
+                     segment_gated_ns_/1e9, segment_gated_packets_);
+    }
     for (size_t i = 0; i<inputs_cnt_; ++i) {
-        libtrace_stat_t *stat = trace_get_statistics(inputs_[i].in_, NULL);
-        uint64_t segment_drops = stat->dropped - inputs_[i].segment_drops_;
-        mtclog_.warn("    input=%lu: packets=%llu, drops=%lu\n", i,
-                     inputs_[i].segment_packets_,
-                     segment_drops);
+        uint64_t dropped = inputs_[i].dropped();
+        uint64_t segment_drops = dropped - inputs_[i].segment_drops_;
+        uint64_t ring_drops = inputs_[i].ring_drops_.load(std::memory_order_relaxed);
+        char queue[32] = "";
+        if (inputs_[i].queue_ >= 0)
+            snprintf(queue, sizeof(queue), " queue=%d", inputs_[i].queue_);
+        mtclog_.warn("    input=%lu%s: packets=%llu, drops=%lu, ring_drops=%lu, late=%lu, dups=%lu\n", i,
+                     queue, inputs_[i].segment_packets_,
+                     segment_drops,
+                     ring_drops - inputs_[i].segment_ring_drops_,
+                     inputs_[i].late_drops_ - inputs_[i].segment_late_drops_,
+                     inputs_[i].dup_drops_ - inputs_[i].segment_dup_drops_);
         //reset
-        inputs_[i].segment_drops_   = stat->dropped;
+        inputs_[i].segment_drops_   = dropped;
+        inputs_[i].segment_ring_drops_ = ring_drops;
+        inputs_[i].segment_late_drops_ = inputs_[i].late_drops_;
+        inputs_[i].segment_dup_drops_ = inputs_[i].dup_drops_;
         inputs_[i].segment_packets_ = 0;
-        
+        if (inputs_[i].lat_dequeue_) {
+            char who[32];
+            snprintf(who, sizeof(who), "input=%lu", i);
+            inputs_[i].lat_dequeue_->dump_segment(mtclog_, who);
+            inputs_[i].lat_merge_->dump_segment(mtclog_, who);
+        }
+    }
+    if (lat_write_) {
+        lat_write_->dump_segment(mtclog_, "output");
+        lat_open_->dump_segment(mtclog_, "output");
+        lat_close_->dump_segment(mtclog_, "output");
     }
 }
 
@@ -405,27 +706,49 @@ void
 MTC_Output::dump_tot_stats() const {
     mtclog_.warn("TOTAL: packets=%lu, disorders=%lu\n",
                  total_packets_, total_disorders_);
+    if (watch_) {
+        uint64_t gated_ns = total_gated_ns_;
+        if (gated())
+            gated_ns += monotonic_ns() - gate_start_ns_; //still waiting
+        mtclog_.warn("    gated=%.3fs, gated_packets=%lu\n",
+                     gated_ns/1e9, total_gated_packets_);
+    }
+    if (lat_write_) {
+        lat_write_->dump_total(mtclog_, "output");
+        lat_open_->dump_total(mtclog_, "output");
+        lat_close_->dump_total(mtclog_, "output");
+    }
+    if (finalizer_)
+        finalizer_->dump_stats();
+    if (preopen_)
+        preopen_->dump_stats();
+    if (journal_)
+        journal_->dump_stats();
+    if (compressor_)
+        compressor_->dump_stats();
+    if (adapt_)
+        adapt_->dump_stats();
+    if (pool_) {
+        mtclog_.warn("    packet pool: size=%lu, high-water=%lu, overflows=%lu%s\n",
+                     pool_->size(), pool_->high_water(), pool_->overflows(),
+                     pool_->hugepages() ? ", hugepages" : "");
+    }
 }
 
-void
+int
 MTC_Output::insert_pipe(int fdw) {
     int pipefd[2];
 #define PIPEBUFSZ (8*1024*1024)
 
-    if (0 != ::socketpair(AF_UNIX, SOCK_STREAM, 0, pipefd)) {
-        mtclog_.panic("Error creating pipeout sockets: '%s'\n", strerror(errno));
+    /* a pipe rather than a socketpair: libtrace reopens our end through
+     * /dev/fd, which does not work for sockets */
+    if (0 != ::pipe2(pipefd, O_CLOEXEC)) {
+        mtclog_.panic("Error creating pipeout pipe: '%s'\n", strerror(errno));
     }
-    for (int i = 0; i<2; ++i) {
-        int bufsz = PIPEBUFSZ;
-        if (0 != ::setsockopt(pipefd[i], SOL_SOCKET, SO_RCVBUF,
-                              &bufsz, sizeof(bufsz))) {
-            mtclog_.warn("setsockopt SO_RCVBUF failed\n");
-        }
-        bufsz = PIPEBUFSZ;
-        if (0 != ::setsockopt(pipefd[0], SOL_SOCKET, SO_SNDBUF,
-                              &bufsz, sizeof(bufsz))) {
-            mtclog_.warn("setsockopt SO_SNDBUF failed\n");
-        }
+    //unprivileged users are capped by /proc/sys/fs/pipe-max-size
+    for (int bufsz = PIPEBUFSZ; bufsz >= 64*1024; bufsz /= 2) {
+        if (::fcntl(pipefd[1], F_SETPIPE_SZ, bufsz) >= 0)
+            break;
     }
     pid_t pipe_pid = fork();
     if (pipe_pid == -1) {
@@ -434,6 +757,8 @@ MTC_Output::insert_pipe(int fdw) {
     if (pipe_pid == 0) {
         /* child */
         ::setpgid(0, 0);
+        //the mask survives execvp
+        MTC_Affinity::place(MTC_Affinity::ROLE_COMPRESS, 0, mtclog_);
         if (-1 == ::dup2(pipefd[0], STDIN_FILENO)) {
             mtclog_.panic("Error DUP compressor stdin: '%s'\n", strerror(errno));
         }
@@ -450,10 +775,8 @@ MTC_Output::insert_pipe(int fdw) {
         ::execvp(pipeout_[0], pipeout_);
         mtclog_.panic("Failed to execute --pipeout command %s: %s\n",
                       pipeout_[0], strerror(errno));
-    } else {
-        /* parent */
-        ::close(pipefd[0]);               /* read end of the pipe */
-        ::dup2(pipefd[1], STDOUT_FILENO); /* write end of the pipe */
-        ::close(pipefd[1]);
     }
+    /* parent */
+    ::close(pipefd[0]);               /* read end of the pipe */
+    return pipefd[1];                 /* write end of the pipe */
 }
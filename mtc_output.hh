@@ -21,30 +21,118 @@
 #ifndef MTC_OUTPUT_HH
 #define MTC_OUTPUT_HH
 
+#include <atomic>
+
+class MTC_Capture;
+class MTC_PacketPool;
+class MTC_Finalizer;
+class MTC_Compressor;
+class MTC_CompressStream;
+class MTC_Preopener;
+class MTC_DirectWriter;
+class MTC_Index;
+class MTC_Latency;
+class MTC_Slicer;
+class MTC_Watchfile;
+class MTC_Journal;
+class MTC_LevelControl;
+struct mtc_stats_input_t;
+struct mtc_stats_output_t;
+
 class MTC_Input {
 public:
     MTC_Input():
         in_(0),
         uri_(0),
+        queue_(-1),
         active_(false),
         prev_ts_(0),
         segment_drops_(0),
         segment_packets_(0),
         total_packets_(0),
-        packet_(0) {
+        ring_drops_(0),
+        segment_ring_drops_(0),
+        late_drops_(0),
+        segment_late_drops_(0),
+        dup_drops_(0),
+        segment_dup_drops_(0),
+        drops_(0),
+        sliced_bytes_(0),
+        packet_(0),
+        capture_(0),
+        stats_(0),
+        lat_dequeue_(0),
+        lat_merge_(0),
+        slicer_(0) {
     }
     struct libtrace_t *in_;
     const char        *uri_;
+    int                queue_;   // receive queue of uri_ with --input-queues, or -1
     bool               active_;
     uint64_t           prev_ts_;
     uint64_t           segment_drops_; // drops at the beginning of a segment
     unsigned long long segment_packets_;           
     unsigned long long total_packets_;
+    std::atomic<uint64_t> ring_drops_;     // capture ring overflows
+    uint64_t           segment_ring_drops_; // ring drops at the beginning of a segment
+    uint64_t           late_drops_;         // too late for the reorder window
+    uint64_t           segment_late_drops_;
+    uint64_t           dup_drops_;          // seen on another input first, with --dedup-us
+    uint64_t           segment_dup_drops_;
+    std::atomic<uint64_t> drops_;          // published by the thread reading in_, or the queue
+    uint64_t           sliced_bytes_;       // cut by slicer_, kept by the reading thread
+
+    /* drops so far, of the input or of its queue, as last sampled.
+     * libtrace_t is not thread safe and reading statistics from a ring:
+     * or int: input resets the kernel's counters, so only the thread
+     * reading in_ samples them; any thread may call dropped() */
+    uint64_t dropped() const { return drops_.load(std::memory_order_relaxed); }
+    void update_drops();
 
     libtrace_packet_t *packet_;
+    MTC_Capture       *capture_; // set when running with --capture-threads
+    mtc_stats_input_t *stats_;   // set with --stats-file
+    MTC_Latency       *lat_dequeue_; // capture to head of the input, with --latency-sample
+    MTC_Latency       *lat_merge_;   // capture to picked by the merge
+    const MTC_Slicer  *slicer_;      // set with --slice-payload
+};
+
+/* a finished segment handed over to be closed */
+struct MTC_Segment {
+    MTC_Segment() :
+        output_(0),
+        fd_(-1),
+        write_null_(false),
+        packets_(0),
+        stream_(0),
+        direct_(0),
+        index_(0),
+        seqnum_(0),
+        journal_(0),
+        first_erf_(0),
+        last_erf_(0),
+        codec_(0),
+        level_(-1) {
+        name_[0] = '\0';
+    }
+    libtrace_out_t *output_;
+    int             fd_;         // segment file or pipe, -1 if libtrace writes to stdout
+    bool            write_null_; // empty pcap segment
+    uint64_t        packets_;
+    MTC_CompressStream *stream_; // in-process compressor behind fd_, if any
+    MTC_DirectWriter   *direct_; // O_DIRECT writer of the file, if any
+    MTC_Index          *index_;  // written next to the segment once it is closed
+    uint64_t        seqnum_;     // set for pre-opened segments, and on close
+    MTC_Journal    *journal_;    // gets the close record, with -N
+    uint64_t        first_erf_;  // of the packets written to it
+    uint64_t        last_erf_;
+    const char     *codec_;      // compression it was written with, or NULL
+    int             level_;      // -1 for the codec's default
+    char            name_[1024];
 };
 
 #define SEQNUM_FMT  "%08lu"
+#define BACKLOG_HIGH_PCT 75
 #define SEQNUM_MAX  99999999
 #define LANDER_DEFAULT_EXT ".erf"
 
@@ -55,37 +143,62 @@ public:
 
 
     int  write_packet(libtrace_packet_t *p);
+    /* ts are the packets' erf timestamps, in the order given */
+    int  write_packets(libtrace_packet_t * const *pkts, const uint64_t *ts, size_t cnt);
     void open_trace(const timeval& ts);
     void close_trace();
     void rotate_trace(const timeval& ts); //force time-driven rotation
     void signal() { signalled_ = true; }
     void set_compression(trace_option_compresstype_t type, int level);
+    void set_adapt_level(int min, int max, int start); //per segment, see open_trace()
     void set_useutc(bool utc) { useutc_ = utc; }
-    void set_watchfile(const char* watchfile) { watchfile_ = watchfile; }
+    void set_watchfile(const char* watchfile); //-W, see open_trace()
     void set_seqnumfile(const char* seqnumfile) { seqnumfile_ = seqnumfile; init_seqnum(); }
     void set_segmentsize(ulong ss) { segmentsize_ = ss; }
     void set_rotatesec(ulong s) { rotatesec_ = s; }
     void set_inputs(MTC_Input *inputs, size_t inputs_cnt) { inputs_ = inputs; inputs_cnt_ = inputs_cnt; }
+    //shards and sinks: drops of all inputs, published by the merger
+    void set_input_drops(const std::atomic<uint64_t> *drops) { input_drops_ = drops; }
     void set_pipeout(char * const pipeout[]) { pipeout_ = pipeout; }
     void set_extension(const char* extension) { extension_ = extension; }
+    void set_pool(const MTC_PacketPool *pool) { pool_ = pool; }
+    void set_compressor(MTC_Compressor *comp) { compressor_ = comp; }
+    void set_close_queue(size_t segments);
+    void set_preopen(); //-B only: keep the next segment open in advance
+    void set_direct_io(bool direct) { direct_io_ = direct; }
+    void set_shard(int shard);
+    void set_index(ulong ms) { index_ms_ = ms; }
+    void set_stats(mtc_stats_output_t *stats) { stats_ = stats; }
+    void set_latency(uint32_t every); //sample one in every packets, 0 turns it off
+    void wait_closed(); //waits for all segments handed to the finalizer
     void dump_seg_stats() const;
     void dump_tot_stats() const;
+
+    /* used by the preopener thread */
+    MTC_Segment *prepare_segment(uint64_t seqnum);
+    void discard_segment(MTC_Segment *seg);
     const char* current_filename() { return namebuf_; }
+    bool to_stdout() const { return namebuf_[0] == '-' && namebuf_[1] == '\0'; }
     const timeval &last_rotated() { return last_rotated_; }
+    /* no segment is open because the watchfile is missing; packets
+     * written meanwhile are counted and dropped */
+    bool gated() const { return gated_.load(std::memory_order_relaxed); }
+    /* the segment's pipe is over BACKLOG_HIGH_PCT full, writing may block */
+    bool backlogged() const;
 protected:
     void init_seqnum();
-    void save_seqnum();
-    void insert_pipe(int fdw);
-    void reset_segmentstats() { segment_packets_ = 0; segment_disorders_ = 0; current_segsize_ = 0; }
-
-    size_t sleep_on_watchfile();
-    
-    static void *close_trace(void *to);
+    void start_segment(MTC_Segment *seg, const char *path);
+    int  insert_pipe(int fdw);
+    const char *codec_name() const;
+    void adapt_level();
+    void reset_segmentstats() {
+        segment_packets_ = 0; segment_disorders_ = 0; current_segsize_ = 0;
+        segment_gated_ns_ = 0; segment_gated_packets_ = 0;
+    }
 
 protected:
     const char *outputfn_;
     const char *basename_;
-    const char *watchfile_;
     const char *seqnumfile_;
     const char *extension_;
     const char *format_;
@@ -93,7 +206,11 @@ protected:
     
     MTC_Input *inputs_;
     size_t   inputs_cnt_;
+    const std::atomic<uint64_t> *input_drops_;
+    const MTC_PacketPool *pool_;
     uint64_t current_seqnum_;
+    uint64_t seg_seqnum_;    //of the open segment
+    MTC_Journal *journal_;   //-N
     bool     useutc_;
     bool     signalled_;
     const MTC_Log
@@ -101,7 +218,11 @@ protected:
     
     int      compress_level_;
     trace_option_compresstype_t compress_type_;
+    MTC_LevelControl *adapt_;        //--adapt-level
+    std::atomic<int>  adapt_level_;  //of the segment opened next, read by the preopener
     ulong    segmentsize_;
+    bool     direct_io_;
+    ulong    index_ms_;
 
     ulong    current_segsize_;
     ulong    rotatesec_;
@@ -111,13 +232,39 @@ protected:
     uint64_t segment_packets_;
     uint64_t segment_disorders_;
 
+    MTC_Watchfile    *watch_;        //-W
+    std::atomic<bool> gated_;
+    uint64_t gate_start_ns_;         //CLOCK_MONOTONIC, while gated_
+    uint64_t gate_packets_;          //dropped while gated_
+    uint64_t segment_gated_ns_;      //the gate this segment was opened after
+    uint64_t segment_gated_packets_;
+    uint64_t total_gated_ns_;
+    uint64_t total_gated_packets_;
+
     struct libtrace_out_t      *output_;
+    int                         seg_fd_; //our end of the current segment, or -1
+    MTC_CompressStream         *seg_stream_;
+    MTC_DirectWriter           *seg_direct_;
+    MTC_Index                  *seg_index_;
+    size_t                      seg_pipe_high_; //backlogged() above, 0 if not piped
+    int                         seg_level_;     //compression level, -1 if none or default
+    MTC_Compressor             *compressor_;
+    MTC_Finalizer              *finalizer_;
+    MTC_Preopener              *preopen_;
+    mtc_stats_output_t         *stats_;
+    uint64_t                    stats_next_backlog_; //packet count of the next backlog sample
+    MTC_Latency                *lat_write_;  //capture to written
+    MTC_Latency                *lat_open_;   //segment open, every segment
+    MTC_Latency                *lat_close_;  //segment close, or handing it to the finalizer
+    uint64_t                    close_ns_;   //last close_trace()
 
     timeval  first_ts_;
-    timeval  last_ts_;
+    uint64_t first_erf_;
+    uint64_t last_erf_;
     timeval  last_rotated_;
         
     char namebuf_[1024];
+    char shard_tag_[16]; //".sNN" with --shards, part of every file name
     bool     is_pcap_;
 };
 
@@ -0,0 +1,157 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <libtrace.h>
+#include <libtrace_parallel.h>
+#include <cstdio>
+#include <cstring>
+
+#include "mtc_log.hh"
+#include "mtc_output.hh"
+#include "mtc_capture.hh"
+#include "mtc_parallel.hh"
+#include "mtc_affinity.hh"
+#include "mtc_slice.hh"
+
+MTC_ParallelInput::MTC_ParallelInput(libtrace_t *trace, MTC_Input *queues, size_t cnt,
+                                     const MTC_Log &log) :
+    trace_(trace),
+    queues_(queues),
+    cnt_(cnt),
+    mtclog_(log),
+    callbacks_(0),
+    started_(false)
+{
+    callbacks_ = trace_create_callback_set();
+    trace_set_starting_cb(callbacks_, starting);
+    trace_set_stopping_cb(callbacks_, stopping);
+    trace_set_packet_cb(callbacks_, packet);
+    trace_set_tick_interval_cb(callbacks_, tick);
+}
+
+MTC_ParallelInput::~MTC_ParallelInput() {
+    stop();
+    trace_destroy_callback_set(callbacks_);
+}
+
+void
+MTC_ParallelInput::start() {
+    trace_set_perpkt_threads(trace_, cnt_);
+    trace_set_tick_interval(trace_, PARALLEL_TICK_MS);
+    if (trace_pstart(trace_, this, callbacks_, NULL) == -1) {
+        trace_perror(trace_, "trace_pstart");
+        exit(1);
+    }
+    started_ = true;
+    //the format may support fewer queues than asked for
+    int threads = trace_get_perpkt_threads(trace_);
+    if (threads < (int)cnt_) {
+        mtclog_.warn("%s: reading %d queues instead of %lu\n",
+                     queues_[0].uri_, threads, cnt_);
+        for (size_t q = threads; q < cnt_; ++q)
+            queues_[q].capture_->finish();
+    }
+}
+
+void
+MTC_ParallelInput::stop() {
+    if (!started_)
+        return;
+    if (!trace_has_finished(trace_))
+        trace_pstop(trace_);
+    trace_join(trace_);
+    started_ = false;
+}
+
+void
+MTC_ParallelInput::pause() {
+    if (!started_ || trace_has_finished(trace_))
+        return;
+    if (trace_ppause(trace_) == -1)
+        trace_perror(trace_, "trace_ppause");
+}
+
+void
+MTC_ParallelInput::resume() {
+    if (!started_ || trace_has_finished(trace_))
+        return;
+    //a paused trace is restarted with the callbacks it already has
+    if (trace_pstart(trace_, NULL, NULL, NULL) == -1) {
+        trace_perror(trace_, "trace_pstart");
+        exit(1);
+    }
+}
+
+void *
+MTC_ParallelInput::starting(libtrace_t *trace, libtrace_thread_t *t, void *global) {
+    MTC_ParallelInput *pin = static_cast<MTC_ParallelInput*>(global);
+    tls_t *tls  = new tls_t;
+    tls->queue_ = &pin->queues_[trace_get_perpkt_thread_id(t)];
+    tls->stat_  = trace_create_statistics();
+    MTC_Affinity::place(MTC_Affinity::ROLE_CAPTURE, tls->queue_->capture_->idx(),
+                        pin->mtclog_);
+    return tls;
+}
+
+void
+MTC_ParallelInput::stopping(libtrace_t *trace, libtrace_thread_t *t, void *global,
+                            void *tls) {
+    tls_t *qt = static_cast<tls_t*>(tls);
+    update_drops(trace, t, qt);
+    qt->queue_->capture_->finish();
+    free(qt->stat_);
+    delete qt;
+}
+
+libtrace_packet_t *
+MTC_ParallelInput::packet(libtrace_t *trace, libtrace_thread_t *t, void *global,
+                          void *tls, libtrace_packet_t *p) {
+    MTC_Input *q = static_cast<tls_t*>(tls)->queue_;
+    uint16_t ethertype;
+    uint32_t remaining;
+    void *vp = trace_get_layer3(p, &ethertype, &remaining);
+    if (!vp || ethertype == 0xffff) {
+        static_cast<MTC_ParallelInput*>(global)->mtclog_.warn(
+            "skipping non L3 (ethernet) packet on %s queue %d\n", q->uri_, q->queue_);
+        return p;
+    }
+    if (q->slicer_)
+        q->sliced_bytes_ += q->slicer_->slice(p, vp, ethertype, remaining);
+    if (!q->capture_->deliver(p, trace_get_erf_timestamp(p))) {
+        //merger is not giving packets back fast enough
+        q->ring_drops_.fetch_add(1, std::memory_order_relaxed);
+        return p;
+    }
+    return NULL; //ours until the merger recycles it
+}
+
+void
+MTC_ParallelInput::tick(libtrace_t *trace, libtrace_thread_t *t, void *global,
+                        void *tls, uint64_t order) {
+    update_drops(trace, t, static_cast<tls_t*>(tls));
+}
+
+void
+MTC_ParallelInput::update_drops(libtrace_t *trace, libtrace_thread_t *t, tls_t *tls) {
+    trace_get_thread_statistics(trace, t, tls->stat_);
+    if (tls->stat_->dropped_valid)
+        tls->queue_->drops_.store(tls->stat_->dropped, std::memory_order_relaxed);
+}
@@ -0,0 +1,79 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_PARALLEL_HH
+#define MTC_PARALLEL_HH
+
+#include <stdint.h>
+#include <cstddef>
+
+#define PARALLEL_TICK_MS 100 //how often a queue refreshes its drop counter
+
+class MTC_Input;
+
+/*
+ * One input uri read through libtrace's parallel API. libtrace runs a
+ * thread per receive queue; each of them delivers its packets into the
+ * fed MTC_Capture of its own MTC_Input, so every queue is a separate,
+ * time-ordered stream to the merger. queues[0..cnt) share the trace
+ * and are set up by the caller, capture_ included, before start().
+ * Needs libtrace_parallel.h.
+ */
+class MTC_ParallelInput {
+public:
+    MTC_ParallelInput(libtrace_t *trace, MTC_Input *queues, size_t cnt,
+                      const MTC_Log &log);
+    ~MTC_ParallelInput();
+
+    void start();
+    void stop(); //returns once every queue's thread is done
+    /* -W: every queue stops reading until resume() */
+    void pause();
+    void resume();
+
+    size_t queues() const { return cnt_; }
+
+protected:
+    struct tls_t {
+        MTC_Input             *queue_;
+        libtrace_stat_t *stat_;
+    };
+    static void *starting(libtrace_t *trace, libtrace_thread_t *t,
+                          void *global);
+    static void stopping(libtrace_t *trace, libtrace_thread_t *t,
+                         void *global, void *tls);
+    static libtrace_packet_t *packet(libtrace_t *trace, libtrace_thread_t *t,
+                                     void *global, void *tls, libtrace_packet_t *p);
+    static void tick(libtrace_t *trace, libtrace_thread_t *t,
+                     void *global, void *tls, uint64_t order);
+    static void update_drops(libtrace_t *trace, libtrace_thread_t *t,
+                             tls_t *tls);
+
+protected:
+    libtrace_t *trace_;
+    MTC_Input         *queues_;
+    size_t             cnt_;
+    const MTC_Log
+    &mtclog_;
+    libtrace_callback_set_t *callbacks_;
+    bool               started_;
+};
+
+#endif /* MTC_PARALLEL_HH */
@@ -0,0 +1,169 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+
+#include "mtc_log.hh"
+#include "mtc_time.hh"
+#include "mtc_poller.hh"
+
+MTC_Poller::MTC_Poller(size_t inputs, const MTC_Log &log) :
+    mtclog_(log),
+    epfd_(-1),
+    inputs_cnt_(inputs),
+    state_(new state_t[inputs]),
+    events_(new epoll_event[inputs]),
+    parked_cnt_(0),
+    sleeping_cnt_(0)
+{
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0) {
+        mtclog_.panic("epoll_create1: %s\n", strerror(errno));
+    }
+    for (size_t i = 0; i < inputs_cnt_; ++i) {
+        state_[i].fd_       = -1;
+        state_[i].parked_   = false;
+        state_[i].sleeping_ = false;
+        state_[i].wake_ns_  = 0;
+    }
+}
+
+MTC_Poller::~MTC_Poller() {
+    ::close(epfd_);
+    delete [] events_;
+    delete [] state_;
+}
+
+void
+MTC_Poller::park_fd(int idx, int fd) {
+    state_t &st = state_[idx];
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = 0;
+    ev.data.u32 = idx;
+    int op = EPOLL_CTL_MOD;
+    if (st.fd_ != fd) {
+        if (st.fd_ >= 0)
+            ::epoll_ctl(epfd_, EPOLL_CTL_DEL, st.fd_, NULL);
+        st.fd_ = fd;
+        op = EPOLL_CTL_ADD;
+    }
+    if (::epoll_ctl(epfd_, op, fd, &ev) != 0) {
+        //not pollable, retry it soon instead
+        mtclog_.debug("epoll_ctl on fd %d for input %d: %s\n",
+                      fd, idx, strerror(errno));
+        st.fd_ = -1;
+        park_sleep(idx, 0.001);
+        return;
+    }
+    if (!st.parked_) {
+        st.parked_ = true;
+        ++parked_cnt_;
+    }
+}
+
+void
+MTC_Poller::park_sleep(int idx, double seconds) {
+    state_t &st = state_[idx];
+    st.wake_ns_ = monotonic_ns() + (uint64_t)(seconds*1e9);
+    if (!st.sleeping_) {
+        st.sleeping_ = true;
+        ++sleeping_cnt_;
+    }
+    if (!st.parked_) {
+        st.parked_ = true;
+        ++parked_cnt_;
+    }
+}
+
+void
+MTC_Poller::unpark(int idx) {
+    state_t &st = state_[idx];
+    if (st.sleeping_) {
+        st.sleeping_ = false;
+        --sleeping_cnt_;
+    }
+    if (st.parked_) {
+        st.parked_ = false;
+        --parked_cnt_;
+    }
+}
+
+void
+MTC_Poller::forget(int idx) {
+    state_t &st = state_[idx];
+    if (st.fd_ >= 0) {
+        ::epoll_ctl(epfd_, EPOLL_CTL_DEL, st.fd_, NULL);
+        st.fd_ = -1;
+    }
+    unpark(idx);
+}
+
+int
+MTC_Poller::expire_timers(int &timeout_ms) {
+    if (sleeping_cnt_ == 0)
+        return 0;
+    int woken = 0;
+    uint64_t now = monotonic_ns();
+    for (size_t i = 0; i < inputs_cnt_; ++i) {
+        state_t &st = state_[i];
+        if (!st.sleeping_)
+            continue;
+        if (st.wake_ns_ <= now) {
+            unpark(i);
+            ++woken;
+        } else {
+            uint64_t ms = (st.wake_ns_ - now + 999999)/1000000;
+            if (timeout_ms < 0 || ms < (uint64_t)timeout_ms)
+                timeout_ms = (int)ms;
+        }
+    }
+    return woken;
+}
+
+int
+MTC_Poller::wait(int timeout_ms) {
+    int woken = expire_timers(timeout_ms);
+    if (woken > 0)
+        timeout_ms = 0;
+    int n = ::epoll_wait(epfd_, events_, inputs_cnt_, timeout_ms);
+    if (n < 0) {
+        if (errno != EINTR)
+            mtclog_.warn("epoll_wait: %s\n", strerror(errno));
+        n = 0;
+    }
+    for (int k = 0; k < n; ++k) {
+        //one-shot: the fd stays in the set but is disarmed
+        unpark(events_[k].data.u32);
+        ++woken;
+    }
+    if (n == 0 && timeout_ms != 0) {
+        int unused = -1;
+        woken += expire_timers(unused);
+    }
+    return woken;
+}
@@ -0,0 +1,73 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_POLLER_HH
+#define MTC_POLLER_HH
+
+#include <stdint.h>
+#include <cstddef>
+
+struct epoll_event;
+
+/*
+ * Parks inputs that cannot produce a packet right now. Inputs that
+ * returned TRACE_EVENT_IOWAIT are armed one-shot in a single epoll set,
+ * inputs that returned TRACE_EVENT_SLEEP get a wakeup deadline. wait()
+ * sleeps on all of them at once and unparks only the inputs that became
+ * ready, so one quiet input never holds up the others.
+ */
+class MTC_Poller {
+public:
+    MTC_Poller(size_t inputs, const MTC_Log &log);
+    ~MTC_Poller();
+
+    bool   parked(int idx) const { return state_[idx].parked_; }
+    size_t parked_cnt() const { return parked_cnt_; }
+
+    void park_fd(int idx, int fd);
+    void park_sleep(int idx, double seconds);
+    void forget(int idx); //input terminated
+
+    /* returns the number of inputs unparked; timeout_ms < 0 waits forever */
+    int  wait(int timeout_ms);
+
+protected:
+    struct state_t {
+        int      fd_;       //fd registered in the epoll set, or -1
+        bool     parked_;
+        bool     sleeping_;
+        uint64_t wake_ns_;  //CLOCK_MONOTONIC deadline when sleeping
+    };
+
+    void unpark(int idx);
+    int  expire_timers(int &timeout_ms);
+
+protected:
+    const MTC_Log
+    &mtclog_;
+    int          epfd_;
+    size_t       inputs_cnt_;
+    state_t     *state_;
+    epoll_event *events_;
+    size_t       parked_cnt_;
+    size_t       sleeping_cnt_;
+};
+
+#endif /* MTC_POLLER_HH */
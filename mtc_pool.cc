@@ -0,0 +1,153 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <libtrace.h>
+#include <cstring>
+
+#include "mtc_log.hh"
+#include "mtc_pool.hh"
+
+#define HUGEPAGE_SZ (2*1024*1024)
+#define POOL_HEADER_ROOM 128 //record headers a format reads in front of the capture
+
+/* there is no API to give a packet a buffer, so hugepage and prefaulted
+ * buffers are set in the buffer and buf_control fields libtrace.h
+ * declares. Copying formats in libtrace 4 read into such a buffer, and
+ * trace_destroy_packet() free()s it unless buffer is NULL again. Other
+ * versions get plain packets from trace_create_packet() only. */
+#if defined(LIBTRACE_API_VERSION) && \
+    LIBTRACE_API_VERSION >= ((4<<16)|(0<<8)|0) && LIBTRACE_API_VERSION < (5<<16)
+#define POOL_OWN_BUFFERS
+#endif
+
+MTC_PacketPool::MTC_PacketPool(size_t size, bool hugepages, const MTC_Log &log) :
+    mtclog_(log),
+    size_(size),
+    free_(new libtrace_packet_t*[size]),
+    free_cnt_(0),
+    in_use_(0),
+    high_water_(0),
+    overflows_(0),
+    arena_(0),
+    arena_len_(0)
+{
+    if (hugepages) {
+#ifdef POOL_OWN_BUFFERS
+        alloc_arena();
+#else
+        mtclog_.warn("hugepage packet buffers need libtrace 4, ignored\n");
+#endif
+    }
+    for (size_t i = 0; i < size_; ++i) {
+        libtrace_packet_t *p = trace_create_packet();
+        if (!p) {
+            mtclog_.panic("cannot preallocate packet %lu of %lu\n", i, size_);
+        }
+#ifdef POOL_OWN_BUFFERS
+        if (arena_) {
+            p->buffer = arena_ + i*LIBTRACE_PACKET_BUFSIZE;
+            p->buf_control = TRACE_CTRL_PACKET;
+        }
+#endif
+        free_[free_cnt_++] = p;
+    }
+}
+
+MTC_PacketPool::~MTC_PacketPool() {
+    if (in_use_ != 0) {
+        mtclog_.warn("packet pool destroyed with %lu packets in use\n", in_use_);
+    }
+    while (free_cnt_ > 0)
+        destroy(free_[--free_cnt_]);
+    delete [] free_;
+    if (arena_)
+        ::munmap(arena_, arena_len_);
+}
+
+void
+MTC_PacketPool::alloc_arena() {
+    size_t len = size_*LIBTRACE_PACKET_BUFSIZE;
+    len = (len + HUGEPAGE_SZ - 1) & ~(size_t)(HUGEPAGE_SZ - 1);
+
+    void *a = ::mmap(NULL, len, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE, -1, 0);
+    if (a == MAP_FAILED) {
+        //no reserved hugepages, settle for transparent ones
+        mtclog_.debug("MAP_HUGETLB packet arena failed (%s), using THP\n",
+                      strerror(errno));
+        a = ::mmap(NULL, len, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (a == MAP_FAILED) {
+            mtclog_.panic("cannot map packet arena of %lu bytes: %s\n",
+                          len, strerror(errno));
+        }
+        if (::madvise(a, len, MADV_HUGEPAGE) != 0) {
+            mtclog_.warn("madvise(MADV_HUGEPAGE) on packet arena: %s\n",
+                         strerror(errno));
+        }
+    }
+    arena_ = static_cast<char*>(a);
+    arena_len_ = len;
+}
+
+void
+MTC_PacketPool::prefault(size_t snaplen) {
+#ifndef POOL_OWN_BUFFERS
+    //buffers are left to libtrace, first touched where they are read into
+    mtclog_.debug("packet pool not faulted in, needs libtrace 4\n");
+    (void)snaplen;
+#else
+    size_t bytes = snaplen + POOL_HEADER_ROOM;
+    if (bytes > LIBTRACE_PACKET_BUFSIZE)
+        bytes = LIBTRACE_PACKET_BUFSIZE;
+    size_t page = ::sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < free_cnt_; ++i) {
+        libtrace_packet_t *p = free_[i];
+        if (!p->buffer) {
+            //what libtrace would malloc() on the first read
+            p->buffer = ::malloc(LIBTRACE_PACKET_BUFSIZE);
+            if (!p->buffer) {
+                mtclog_.panic("cannot allocate packet buffer %lu of %lu\n", i, size_);
+            }
+            p->buf_control = TRACE_CTRL_PACKET;
+        }
+        volatile char *b = static_cast<char*>(p->buffer);
+        for (size_t off = 0; off < bytes; off += page)
+            b[off] = 0;
+    }
+#endif
+}
+
+void
+MTC_PacketPool::destroy(libtrace_packet_t *p) {
+#ifdef POOL_OWN_BUFFERS
+    //arena buffers are not libtrace's to free()
+    if (arena_ && (char*)p->buffer >= arena_ &&
+        (char*)p->buffer < arena_ + arena_len_) {
+        p->buffer = NULL;
+    }
+#endif
+    trace_destroy_packet(p);
+}
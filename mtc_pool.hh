@@ -0,0 +1,95 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_POOL_HH
+#define MTC_POOL_HH
+
+#include <cstddef>
+
+#define PACKET_POOL_DEFAULT 1024
+
+/*
+ * Preallocated packets that are handed out to the inputs and taken back
+ * once MTC_Output::write_packet() is done with them. Not thread safe:
+ * only the merging thread may call get()/put(). When the pool runs dry
+ * a packet is created on the fly and counted as an overflow.
+ *
+ * With hugepages, each pooled packet gets a LIBTRACE_PACKET_BUFSIZE
+ * buffer carved from a hugepage-backed arena. Formats that copy packets
+ * (pcapfile:, int:, ...) read into it; zero-copy formats like ring:
+ * or dag: manage packet buffers themselves and must not be given one,
+ * so mtracecap only asks for it when all inputs are known to copy.
+ * Setting a packet's buffer relies on libtrace 4's packet structure,
+ * other versions go without (see mtc_pool.cc).
+ */
+class MTC_PacketPool {
+public:
+    MTC_PacketPool(size_t size, bool hugepages, const MTC_Log &log);
+    ~MTC_PacketPool();
+
+    libtrace_packet_t *get() {
+        libtrace_packet_t *p;
+        if (free_cnt_ > 0) {
+            p = free_[--free_cnt_];
+        } else {
+            p = trace_create_packet();
+            ++overflows_;
+        }
+        if (++in_use_ > high_water_)
+            high_water_ = in_use_;
+        return p;
+    }
+    void put(libtrace_packet_t *p) {
+        --in_use_;
+        if (free_cnt_ < size_) {
+            free_[free_cnt_++] = p;
+        } else {
+            destroy(p);
+        }
+    }
+
+    size_t   size() const { return size_; }
+    size_t   in_use() const { return in_use_; }
+    size_t   high_water() const { return high_water_; }
+    uint64_t overflows() const { return overflows_; }
+    bool     hugepages() const { return arena_ != 0; }
+    /* touches what a read of up to snaplen bytes writes into every
+     * pooled buffer, giving buffers to packets that have none; memory
+     * then sits on the calling thread's node. Copying formats only. */
+    void     prefault(size_t snaplen);
+
+protected:
+    void alloc_arena();
+    void destroy(libtrace_packet_t *p);
+
+protected:
+    const MTC_Log
+    &mtclog_;
+    size_t              size_;
+    libtrace_packet_t **free_;
+    size_t              free_cnt_;
+    size_t              in_use_;
+    size_t              high_water_;
+    uint64_t            overflows_;
+    char               *arena_;
+    size_t              arena_len_;
+};
+
+#endif /* MTC_POOL_HH */
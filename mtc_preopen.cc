@@ -0,0 +1,150 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libtrace.h>
+#include <cstring>
+
+#include "mtc_log.hh"
+#include "mtc_time.hh"
+#include "mtc_output.hh"
+#include "mtc_preopen.hh"
+#include "mtc_affinity.hh"
+
+MTC_Preopener::MTC_Preopener(MTC_Output &out, const MTC_Log &log) :
+    out_(out),
+    mtclog_(log),
+    pending_(false),
+    seqnum_(0),
+    ready_(0),
+    stopping_(false),
+    started_(false),
+    prepared_(0),
+    prepare_ns_max_(0),
+    stalls_(0),
+    stall_ns_total_(0)
+{
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&request_, NULL);
+    pthread_cond_init(&ready_cond_, NULL);
+}
+
+MTC_Preopener::~MTC_Preopener() {
+    shutdown();
+    pthread_cond_destroy(&ready_cond_);
+    pthread_cond_destroy(&request_);
+    pthread_mutex_destroy(&lock_);
+}
+
+void
+MTC_Preopener::start() {
+    if (pthread_create(&thread_, NULL, run, this) != 0) {
+        mtclog_.panic("pthread_create for preopener: %s\n", strerror(errno));
+    }
+    started_ = true;
+}
+
+void
+MTC_Preopener::prepare(uint64_t seqnum) {
+    pthread_mutex_lock(&lock_);
+    pending_   = true;
+    seqnum_    = seqnum;
+    pthread_cond_signal(&request_);
+    pthread_mutex_unlock(&lock_);
+}
+
+MTC_Segment *
+MTC_Preopener::take() {
+    pthread_mutex_lock(&lock_);
+    if (!ready_) {
+        //rotating faster than segments can be opened
+        uint64_t t0 = monotonic_ns();
+        while (!ready_)
+            pthread_cond_wait(&ready_cond_, &lock_);
+        ++stalls_;
+        stall_ns_total_ += monotonic_ns() - t0;
+    }
+    MTC_Segment *seg = ready_;
+    ready_ = 0;
+    pthread_mutex_unlock(&lock_);
+    return seg;
+}
+
+void
+MTC_Preopener::shutdown() {
+    if (!started_)
+        return;
+    pthread_mutex_lock(&lock_);
+    stopping_ = true;
+    pthread_cond_signal(&request_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(thread_, NULL);
+    started_ = false;
+    if (ready_) {
+        out_.discard_segment(ready_);
+        ready_ = 0;
+    }
+}
+
+void *
+MTC_Preopener::run(void *pre) {
+    static_cast<MTC_Preopener*>(pre)->loop();
+    return NULL;
+}
+
+void
+MTC_Preopener::loop() {
+    MTC_Affinity::place(MTC_Affinity::ROLE_WRITER, 0, mtclog_);
+    pthread_mutex_lock(&lock_);
+    for (;;) {
+        while (!pending_ && !stopping_)
+            pthread_cond_wait(&request_, &lock_);
+        if (stopping_)
+            break; //a pending request is dropped, nobody will take it
+        uint64_t seqnum = seqnum_;
+        pending_ = false;
+        pthread_mutex_unlock(&lock_);
+
+        uint64_t t0 = monotonic_ns();
+        MTC_Segment *seg = out_.prepare_segment(seqnum);
+        uint64_t ns = monotonic_ns() - t0;
+
+        pthread_mutex_lock(&lock_);
+        ready_ = seg;
+        ++prepared_;
+        if (ns > prepare_ns_max_)
+            prepare_ns_max_ = ns;
+        pthread_cond_signal(&ready_cond_);
+    }
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+MTC_Preopener::dump_stats() const {
+    pthread_mutex_t *lock = const_cast<pthread_mutex_t*>(&lock_);
+    pthread_mutex_lock(lock);
+    mtclog_.warn("    preopen: prepared=%lu, open max=%.3fs, stalls=%lu (%.3fs)\n",
+                 prepared_, prepare_ns_max_/1e9, stalls_, stall_ns_total_/1e9);
+    pthread_mutex_unlock(lock);
+}
@@ -0,0 +1,73 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_PREOPEN_HH
+#define MTC_PREOPEN_HH
+
+#include <pthread.h>
+#include <stdint.h>
+
+class MTC_Output;
+struct MTC_Segment;
+
+/*
+ * Opens the next segment while the current one is being written: the
+ * file is created under a hidden name, the pipe or compressor is set up
+ * and libtrace output is started, so a rotation only has to take() it
+ * and rename it.
+ */
+class MTC_Preopener {
+public:
+    MTC_Preopener(MTC_Output &out, const MTC_Log &log);
+    ~MTC_Preopener();
+
+    void start();
+    void prepare(uint64_t seqnum);                  //open segment seqnum next
+    MTC_Segment *take();                            //waits if not ready yet
+    void shutdown();                                //discards an unused segment
+
+    void dump_stats() const;
+
+protected:
+    static void *run(void *pre);
+    void loop();
+
+protected:
+    MTC_Output     &out_;
+    const MTC_Log
+    &mtclog_;
+    bool            pending_;
+    uint64_t        seqnum_;
+    MTC_Segment    *ready_;
+    bool            stopping_;
+    bool            started_;
+    pthread_t       thread_;
+    pthread_mutex_t lock_;
+    pthread_cond_t  request_;
+    pthread_cond_t  ready_cond_;
+
+    /* protected by lock_ */
+    uint64_t        prepared_;
+    uint64_t        prepare_ns_max_;
+    uint64_t        stalls_;
+    uint64_t        stall_ns_total_;
+};
+
+#endif /* MTC_PREOPEN_HH */
@@ -0,0 +1,140 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <time.h>
+#include <libtrace.h>
+#include <cassert>
+
+#include "mtc_reorder.hh"
+#include "mtc_time.hh"
+
+/* microseconds to 32.32 fixed point erf time */
+static inline uint64_t
+us_to_erf(uint64_t us) {
+    return ((us / 1000000) << 32) + (((us % 1000000) << 32) / 1000000);
+}
+
+MTC_Reorder::MTC_Reorder(uint64_t window_us, size_t max_packets) :
+    window_us_(window_us),
+    window_erf_(us_to_erf(window_us)),
+    max_(max_packets),
+    heap_(new entry_t[max_packets]),
+    size_(0),
+    high_water_(0),
+    seq_(0),
+    newest_(0),
+    newest_arrival_ns_(0),
+    last_released_(0),
+    released_(false),
+    forced_(0)
+{
+}
+
+MTC_Reorder::~MTC_Reorder() {
+    assert(size_ == 0);
+    delete [] heap_;
+}
+
+void
+MTC_Reorder::push(libtrace_packet_t *p, int idx, uint64_t ts) {
+    assert(size_ < max_);
+    entry_t e = { ts, seq_++, p, idx };
+    size_t n = size_++;
+    while (n > 0) {
+        size_t parent = (n - 1) / 2;
+        if (!less(e, heap_[parent]))
+            break;
+        heap_[n] = heap_[parent];
+        n = parent;
+    }
+    heap_[n] = e;
+    if (size_ > high_water_)
+        high_water_ = size_;
+    if (ts > newest_)
+        newest_ = ts;
+    newest_arrival_ns_ = monotonic_ns();
+}
+
+void
+MTC_Reorder::pop(entry_t &e) {
+    e = heap_[0];
+    entry_t last = heap_[--size_];
+    size_t n = 0;
+    for (;;) {
+        size_t child = 2*n + 1;
+        if (child >= size_)
+            break;
+        if (child + 1 < size_ && less(heap_[child + 1], heap_[child]))
+            ++child;
+        if (!less(heap_[child], last))
+            break;
+        heap_[n] = heap_[child];
+        n = child;
+    }
+    if (size_ > 0)
+        heap_[n] = last;
+    if (!released_ || e.ts_ > last_released_)
+        last_released_ = e.ts_;
+    released_ = true;
+}
+
+bool
+MTC_Reorder::pop_ready(uint64_t inputs_low, entry_t &e) {
+    if (size_ == 0)
+        return false;
+    uint64_t watermark = (newest_ > window_erf_) ? newest_ - window_erf_ : 0;
+    if (inputs_low > watermark)
+        watermark = inputs_low;
+    if (heap_[0].ts_ > watermark)
+        return false;
+    pop(e);
+    return true;
+}
+
+bool
+MTC_Reorder::pop_idle(entry_t &e) {
+    if (size_ == 0)
+        return false;
+    //let the newest timestamp advance with the time spent waiting
+    uint64_t idle_us = (monotonic_ns() - newest_arrival_ns_)/1000;
+    if (idle_us < window_us_ &&
+        heap_[0].ts_ + window_erf_ - us_to_erf(idle_us) > newest_)
+        return false;
+    pop(e);
+    return true;
+}
+
+bool
+MTC_Reorder::pop_flush(entry_t &e) {
+    if (size_ == 0)
+        return false;
+    pop(e);
+    return true;
+}
+
+bool
+MTC_Reorder::pop_forced(entry_t &e) {
+    if (size_ == 0)
+        return false;
+    ++forced_;
+    pop(e);
+    return true;
+}
@@ -0,0 +1,91 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_REORDER_HH
+#define MTC_REORDER_HH
+
+#include <stdint.h>
+#include <cstddef>
+
+#define REORDER_MAX_DEFAULT 65536
+
+/*
+ * Bounded reorder buffer between the merge and the output. Packets are
+ * held for up to the configured window and released in timestamp order
+ * once they are older than the watermark: the newest timestamp seen
+ * minus the window, or the oldest timestamp any active input may still
+ * deliver, whichever is later. While no packets arrive the watermark
+ * advances with wall-clock time, so held packets never wait longer than
+ * the window. Packets older than the last one released are late; the
+ * caller drops them so that the output stays strictly ordered.
+ */
+class MTC_Reorder {
+public:
+    struct entry_t {
+        uint64_t           ts_;  //erf timestamp
+        uint64_t           seq_; //insertion order, breaks ties
+        libtrace_packet_t *packet_;
+        int                idx_; //input the packet came from
+    };
+
+    MTC_Reorder(uint64_t window_us, size_t max_packets);
+    ~MTC_Reorder();
+
+    bool   empty() const { return size_ == 0; }
+    bool   full() const { return size_ == max_; }
+    size_t size() const { return size_; }
+    bool   late(uint64_t ts) const { return released_ && ts < last_released_; }
+    uint64_t window_ms() const { return (window_us_ + 999)/1000; }
+    uint64_t forced() const { return forced_; }
+    size_t   high_water() const { return high_water_; }
+
+    void push(libtrace_packet_t *p, int idx, uint64_t ts);
+
+    /* inputs_low: lowest timestamp an active input may still deliver */
+    bool pop_ready(uint64_t inputs_low, entry_t &e);
+    /* no packet has arrived for a while, release by wall-clock time */
+    bool pop_idle(entry_t &e);
+    /* buffer is full */
+    bool pop_forced(entry_t &e);
+    /* shutting down */
+    bool pop_flush(entry_t &e);
+
+protected:
+    void pop(entry_t &e);
+    static bool less(const entry_t &a, const entry_t &b) {
+        return (a.ts_ < b.ts_) || (a.ts_ == b.ts_ && a.seq_ < b.seq_);
+    }
+
+protected:
+    uint64_t  window_us_;
+    uint64_t  window_erf_;
+    size_t    max_;
+    entry_t  *heap_;
+    size_t    size_;
+    size_t    high_water_;
+    uint64_t  seq_;
+    uint64_t  newest_;
+    uint64_t  newest_arrival_ns_;
+    uint64_t  last_released_;
+    bool      released_;
+    uint64_t  forced_;
+};
+
+#endif /* MTC_REORDER_HH */
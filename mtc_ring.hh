@@ -0,0 +1,109 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_RING_HH
+#define MTC_RING_HH
+
+#include <atomic>
+#include <cstddef>
+
+#define MTC_CACHELINE 64
+
+/* ring capacity for a requested size: the next power of two */
+inline size_t
+mtc_ring_capacity(size_t size) {
+    size_t cap = 1;
+    while (cap < size)
+        cap <<= 1;
+    return cap;
+}
+
+/*
+ * Bounded lock-free single-producer/single-consumer ring.
+ * push() must only be called from one thread and pop() from another.
+ * Capacity is rounded up to a power of two.
+ */
+template <typename T>
+class MTC_Ring {
+public:
+    explicit MTC_Ring(size_t size) :
+        slots_(0),
+        mask_(0),
+        head_(0),
+        tail_cache_(0),
+        tail_(0),
+        head_cache_(0) {
+        size_t cap = mtc_ring_capacity(size);
+        slots_ = new T[cap];
+        mask_  = cap - 1;
+    }
+    ~MTC_Ring() { delete [] slots_; }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    /* producer side */
+    bool push(const T &v) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ > mask_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ > mask_)
+                return false; //full
+        }
+        slots_[tail & mask_] = v;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* consumer side */
+    bool pop(T &v) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_)
+                return false; //empty
+        }
+        v = slots_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) ==
+            tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    MTC_Ring(const MTC_Ring&);
+    MTC_Ring& operator=(const MTC_Ring&);
+
+    T      *slots_;
+    size_t  mask_;
+    char    pad0_[MTC_CACHELINE];
+    /* consumer-owned */
+    std::atomic<size_t> head_;
+    size_t  tail_cache_;
+    char    pad1_[MTC_CACHELINE];
+    /* producer-owned */
+    std::atomic<size_t> tail_;
+    size_t  head_cache_;
+    char    pad2_[MTC_CACHELINE];
+};
+
+#endif /* MTC_RING_HH */
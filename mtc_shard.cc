@@ -0,0 +1,356 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libtrace.h>
+#include <cstdio>
+#include <cstring>
+
+#include "mtc_log.hh"
+#include "mtc_output.hh"
+#include "mtc_shard.hh"
+#include "mtc_affinity.hh"
+
+#define SHARD_IDLE_US 50
+
+static inline uint64_t
+mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* whether an IPv6 packet is a fragment, looking past the extension
+ * headers that may come before the fragment header; proto is then
+ * what the fragment header says follows, the same in every fragment */
+static bool
+ip6_fragment(const struct ip6_hdr *ip6, uint32_t remaining, uint8_t &proto) {
+    const uint8_t *h = reinterpret_cast<const uint8_t*>(ip6 + 1);
+    uint32_t left = remaining - sizeof(*ip6);
+    uint8_t  nxt  = ip6->ip6_nxt;
+    for (;;) {
+        if (nxt == IPPROTO_FRAGMENT) {
+            proto = (left >= 8) ? h[0] : 0;
+            return true;
+        }
+        if (nxt != IPPROTO_HOPOPTS && nxt != IPPROTO_ROUTING &&
+            nxt != IPPROTO_DSTOPTS && nxt != IPPROTO_AH)
+            return false;
+        if (left < 8)
+            return false;
+        size_t len = (nxt == IPPROTO_AH) ? ((size_t)h[1] + 2)*4 : ((size_t)h[1] + 1)*8;
+        if (len > left)
+            return false;
+        nxt   = h[0];
+        h    += len;
+        left -= len;
+    }
+}
+
+uint32_t
+mtc_flow_hash(const libtrace_packet_t *p) {
+    uint16_t ethertype;
+    uint32_t remaining;
+    void *l3 = trace_get_layer3(p, &ethertype, &remaining);
+    if (!l3)
+        return 0;
+
+    uint64_t a, b; //the two endpoint addresses, folded to 64 bits
+    uint8_t  proto;
+    bool     frag; //only the first fragment has ports, so none do
+    if (ethertype == 0x0800 && remaining >= sizeof(struct ip)) {
+        const struct ip *ip = static_cast<const struct ip*>(l3);
+        a = ip->ip_src.s_addr;
+        b = ip->ip_dst.s_addr;
+        proto = ip->ip_p;
+        frag  = (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) != 0;
+    } else if (ethertype == 0x86DD && remaining >= sizeof(struct ip6_hdr)) {
+        const struct ip6_hdr *ip6 = static_cast<const struct ip6_hdr*>(l3);
+        uint64_t w[4];
+        memcpy(w, &ip6->ip6_src, sizeof(w)/2);
+        memcpy(w + 2, &ip6->ip6_dst, sizeof(w)/2);
+        a = w[0] ^ mix64(w[1]);
+        b = w[2] ^ mix64(w[3]);
+        proto = 0; //the transport lookup below skips extension headers
+        frag  = ip6_fragment(ip6, remaining, proto);
+    } else {
+        return mix64(ethertype);
+    }
+
+    uint16_t sport = 0, dport = 0;
+    uint32_t tremaining = 0;
+    void *l4 = frag ? 0 : trace_get_transport(p, &proto, &tremaining);
+    if (l4 && tremaining >= 4 &&
+        (proto == IPPROTO_TCP || proto == IPPROTO_UDP || proto == IPPROTO_SCTP)) {
+        const uint16_t *ports = static_cast<const uint16_t*>(l4);
+        sport = ports[0];
+        dport = ports[1];
+    }
+    //order the endpoints so that both directions look the same
+    uint64_t e1 = (a << 16) ^ sport;
+    uint64_t e2 = (b << 16) ^ dport;
+    if (e1 > e2) {
+        uint64_t t = e1;
+        e1 = e2;
+        e2 = t;
+    }
+    return (uint32_t)mix64(mix64(e1) ^ e2 ^ ((uint64_t)proto << 56));
+}
+
+MTC_Shard::MTC_Shard(MTC_Output *out, size_t ringsize, const MTC_Log &log) :
+    out_(out),
+    mtclog_(log),
+    todo_(ringsize),
+    done_(ringsize + SHARD_BATCH),
+    stop_(false),
+    finished_(false),
+    started_(false),
+    filter_(0),
+    snaplen_(0),
+    copy_(false)
+{
+    memset(scratch_, 0, sizeof(scratch_));
+}
+
+MTC_Shard::~MTC_Shard() {
+    join();
+    for (size_t k = 0; k < SHARD_BATCH; ++k) {
+        if (scratch_[k])
+            trace_destroy_packet(scratch_[k]);
+    }
+}
+
+void
+MTC_Shard::set_snaplen(size_t snaplen, bool copy) {
+    snaplen_ = snaplen;
+    copy_    = copy;
+}
+
+void
+MTC_Shard::start() {
+    if (pthread_create(&thread_, NULL, run, this) != 0) {
+        mtclog_.panic("pthread_create for output shard: %s\n", strerror(errno));
+    }
+    started_ = true;
+}
+
+void
+MTC_Shard::join() {
+    if (!started_)
+        return;
+    stop();
+    pthread_join(thread_, NULL);
+    started_ = false;
+}
+
+void *
+MTC_Shard::run(void *shard) {
+    static_cast<MTC_Shard*>(shard)->loop();
+    return NULL;
+}
+
+/* p cut to snaplen_, in the k-th scratch packet; p itself if short
+ * enough, unless copy_ */
+libtrace_packet_t *
+MTC_Shard::snap(libtrace_packet_t *p, size_t k) {
+    size_t caplen = trace_get_capture_length(p);
+    bool   cut    = snaplen_ && caplen > snaplen_;
+    if (!cut && !copy_)
+        return p;
+    //the copy in this slot was written or rejected with the last batch
+    if (scratch_[k])
+        trace_destroy_packet(scratch_[k]);
+    libtrace_packet_t *c = trace_copy_packet(p);
+    if (!c)
+        mtclog_.panic("cannot copy a packet for %s\n", out_->current_filename());
+    scratch_[k] = c;
+    if (cut)
+        trace_set_capture_length(c, snaplen_); //keeps the wire length
+    return c;
+}
+
+void
+MTC_Shard::flush(slot_t *batch, size_t &cnt, libtrace_packet_t **pkts, uint64_t *ts,
+                 size_t &written) {
+    if (cnt == 0)
+        return;
+    if (written > 0)
+        out_->write_packets(pkts, ts, written);
+    for (size_t k = 0; k < cnt; ++k) {
+        //the merger drains done_ while it waits on todo_, so this ends
+        while (!done_.push(batch[k]))
+            usleep(SHARD_IDLE_US);
+    }
+    cnt = 0;
+    written = 0;
+}
+
+void
+MTC_Shard::loop() {
+    slot_t             batch[SHARD_BATCH];
+    libtrace_packet_t *pkts[SHARD_BATCH];
+    uint64_t           ts[SHARD_BATCH];
+    size_t             cnt = 0;
+    size_t             written = 0; //of cnt, passed the filter
+    MTC_Affinity::place(MTC_Affinity::ROLE_WRITER, 0, mtclog_);
+    for (;;) {
+        slot_t s;
+        if (!todo_.pop(s)) {
+            flush(batch, cnt, pkts, ts, written);
+            if (stop_.load(std::memory_order_acquire) && todo_.empty()) {
+                finished_.store(true, std::memory_order_release);
+                break;
+            }
+            usleep(SHARD_IDLE_US);
+            continue;
+        }
+        if (!s.packet_) {
+            flush(batch, cnt, pkts, ts, written);
+            timeval tv;
+            tv.tv_sec  = s.ts_ >> 32;
+            tv.tv_usec = ((s.ts_ & 0xffffffffULL)*1000000) >> 32;
+            //name it after the marker, not the shard's next packet, so
+            //that all shards agree on the segment's timestamp
+            out_->open_trace(tv);
+            continue;
+        }
+        //rejected packets stay in the batch, they go back in order
+        batch[cnt] = s;
+        libtrace_packet_t *p = copy_ ? snap(s.packet_, written) : s.packet_;
+        int match = filter_ ? trace_apply_filter(filter_, p) : 1;
+        if (match < 0)
+            mtclog_.panic("cannot apply the filter of %s\n", out_->current_filename());
+        if (match > 0) {
+            pkts[written] = copy_ ? p : snap(s.packet_, written);
+            ts[written]   = s.ts_;
+            ++written;
+        }
+        if (++cnt == SHARD_BATCH)
+            flush(batch, cnt, pkts, ts, written);
+    }
+}
+
+MTC_ShardSet::MTC_ShardSet(MTC_Output **outs, size_t cnt, size_t ringsize,
+                           ulong rotatesec, release_t release, void *arg,
+                           const MTC_Log &log) :
+    mtclog_(log),
+    shards_(new MTC_Shard*[cnt]),
+    cnt_(cnt),
+    rotatesec_(rotatesec),
+    release_(release),
+    arg_(arg),
+    boundary_(0),
+    dispatched_(0)
+{
+    for (size_t i = 0; i < cnt_; ++i)
+        shards_[i] = new MTC_Shard(outs[i], ringsize, log);
+    ::gettimeofday(&last_rotated_, 0);
+    boundary_ = (uint64_t)(last_rotated_.tv_sec + rotatesec_) << 32;
+}
+
+MTC_ShardSet::~MTC_ShardSet() {
+    stop();
+    for (size_t i = 0; i < cnt_; ++i)
+        delete shards_[i];
+    delete [] shards_;
+}
+
+void
+MTC_ShardSet::start() {
+    for (size_t i = 0; i < cnt_; ++i)
+        shards_[i]->start();
+    timeval now;
+    ::gettimeofday(&now, 0);
+    rotate_trace(now); //first segments start together, too
+}
+
+void
+MTC_ShardSet::stop() {
+    for (size_t i = 0; i < cnt_; ++i)
+        shards_[i]->stop();
+    for (size_t i = 0; i < cnt_; ++i) {
+        //keep reclaiming so that a shard blocked on done_ can finish
+        while (!shards_[i]->finished()) {
+            reclaim_all();
+            usleep(SHARD_IDLE_US);
+        }
+        shards_[i]->join();
+    }
+    reclaim_all();
+}
+
+void
+MTC_ShardSet::reclaim_all() {
+    MTC_Shard::slot_t s;
+    for (size_t i = 0; i < cnt_; ++i) {
+        while (shards_[i]->reclaim(s))
+            release_(arg_, s.idx_, s.packet_);
+    }
+    dispatched_ = 0;
+}
+
+void
+MTC_ShardSet::push_wait(MTC_Shard *shard, const MTC_Shard::slot_t &s) {
+    while (!shard->push(s)) {
+        //the shard is behind; what it wrote meanwhile can be reused
+        reclaim_all();
+        usleep(SHARD_IDLE_US);
+    }
+}
+
+void
+MTC_ShardSet::rotate_trace(const timeval &ts) {
+    MTC_Shard::slot_t s;
+    s.packet_ = 0;
+    s.ts_     = ((uint64_t)ts.tv_sec << 32) + (((uint64_t)ts.tv_usec << 32)/1000000);
+    s.idx_    = -1;
+    for (size_t i = 0; i < cnt_; ++i)
+        push_wait(shards_[i], s);
+    ::gettimeofday(&last_rotated_, 0);
+    boundary_ = (uint64_t)(last_rotated_.tv_sec + rotatesec_) << 32;
+}
+
+void
+MTC_ShardSet::dispatch(libtrace_packet_t *p, uint64_t ts, int idx) {
+    if (rotatesec_ && ts >= boundary_) {
+        timeval tv;
+        tv.tv_sec  = ts >> 32;
+        tv.tv_usec = ((ts & 0xffffffffULL)*1000000) >> 32;
+        rotate_trace(tv); //time-driven rotation, same packet for all shards
+    }
+    MTC_Shard::slot_t s;
+    s.packet_ = p;
+    s.ts_     = ts;
+    s.idx_    = idx;
+    push_wait(shards_[mtc_flow_hash(p) % cnt_], s);
+    if (++dispatched_ >= SHARD_BATCH)
+        reclaim_all();
+}
@@ -0,0 +1,148 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_SHARD_HH
+#define MTC_SHARD_HH
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "mtc_ring.hh"
+
+#define SHARD_RING_DEFAULT 4096
+#define SHARD_BATCH        32
+
+class MTC_Output;
+
+/* symmetric 5-tuple hash: both directions of a flow hash the same;
+ * IP fragments hash on addresses and protocol, so that a datagram's
+ * fragments stay together */
+uint32_t mtc_flow_hash(const libtrace_packet_t *p);
+
+/*
+ * One output writer on its own thread. The merger pushes packets in
+ * timestamp order through an SPSC ring; the shard writes them in
+ * batches and hands them back through a second ring, since only the
+ * merger may recycle packets. A slot without a packet is a rotation
+ * marker: everything before it goes into the current segment, the new
+ * one is named after the marker's timestamp.
+ *
+ * As a --sink, a shard may have a filter of its own and a snaplen: packets
+ * the filter rejects are handed back unwritten, longer ones are written
+ * from a copy cut to the snaplen, since other sinks share the packet.
+ * With copy set, every packet is filtered and written from a copy:
+ * libtrace fills in a packet's cached lengths and headers on first use
+ * and trace_write_packet() may strip headers the output format cannot
+ * hold, so a shared packet may only be read, and only once the merger
+ * filled in its capture length.
+ */
+class MTC_Shard {
+public:
+    struct slot_t {
+        libtrace_packet_t *packet_; //0: start a new segment named after ts_
+        uint64_t           ts_;     //erf timestamp
+        int                idx_;    //input the packet came from
+    };
+
+    MTC_Shard(MTC_Output *out, size_t ringsize, const MTC_Log &log);
+    ~MTC_Shard();
+
+    void start();
+    void stop() { stop_.store(true, std::memory_order_release); }
+    void join();
+    bool finished() const { return finished_.load(std::memory_order_acquire); }
+    void set_filter(libtrace_filter_t *filter) { filter_ = filter; }
+    void set_snaplen(size_t snaplen, bool copy = false);
+
+    /* merger side */
+    bool push(const slot_t &s) { return todo_.push(s); }
+    bool reclaim(slot_t &s) { return done_.pop(s); }
+
+    MTC_Output *output() { return out_; }
+
+protected:
+    static void *run(void *shard);
+    void loop();
+    void flush(slot_t *batch, size_t &cnt, libtrace_packet_t **pkts, uint64_t *ts,
+               size_t &written);
+    libtrace_packet_t *snap(libtrace_packet_t *p, size_t k);
+
+protected:
+    MTC_Output *out_;
+    const MTC_Log
+    &mtclog_;
+    MTC_Ring<slot_t>  todo_;
+    MTC_Ring<slot_t>  done_;
+    std::atomic<bool> stop_;
+    std::atomic<bool> finished_; //drained after stop()
+    pthread_t         thread_;
+    bool              started_;
+    libtrace_filter_t *filter_;
+    size_t             snaplen_;                //0: as captured
+    bool               copy_;                   //never touch the packet itself
+    libtrace_packet_t *scratch_[SHARD_BATCH];   //trace_copy_packet()s, with snaplen_ or copy_
+};
+
+/*
+ * Spreads merged packets over several shards by flow hash. Time-driven
+ * rotation is decided here, once for all shards, so that every shard
+ * starts a new segment at the same packet; size-driven rotation stays
+ * with each shard's output.
+ */
+class MTC_ShardSet {
+public:
+    /* gives a written packet back to its input, called on the merger */
+    typedef void (*release_t)(void *arg, int idx, libtrace_packet_t *p);
+
+    MTC_ShardSet(MTC_Output **outs, size_t cnt, size_t ringsize,
+                 ulong rotatesec, release_t release, void *arg,
+                 const MTC_Log &log);
+    ~MTC_ShardSet();
+
+    void start();
+    void stop();  //once everything was dispatched, joins the threads
+
+    void dispatch(libtrace_packet_t *p, uint64_t ts, int idx); //waits if the shard is full
+    void rotate_trace(const timeval &ts);
+    void reclaim_all();
+
+    const timeval &last_rotated() const { return last_rotated_; }
+    size_t size() const { return cnt_; }
+    MTC_Shard *shard(size_t i) { return shards_[i]; }
+
+protected:
+    void push_wait(MTC_Shard *shard, const MTC_Shard::slot_t &s);
+
+protected:
+    const MTC_Log
+    &mtclog_;
+    MTC_Shard  **shards_;
+    size_t       cnt_;
+    ulong        rotatesec_;
+    release_t    release_;
+    void        *arg_;
+    uint64_t     boundary_;   //erf time of the next time-driven rotation
+    timeval      last_rotated_;
+    size_t       dispatched_; //since the last reclaim_all()
+};
+
+#endif /* MTC_SHARD_HH */
@@ -0,0 +1,235 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <libtrace.h>
+
+#include "mtc_slice.hh"
+
+#define ETH_P_IP      0x0800
+#define ETH_P_IPV6    0x86dd
+#define ETH_P_8021Q   0x8100
+#define ETH_P_8021AD  0x88a8
+#define ETH_P_QINQ    0x9100
+#define ETH_P_MPLS_UC 0x8847
+#define ETH_P_MPLS_MC 0x8848
+#define ETH_P_TEB     0x6558 //transparent Ethernet bridging over GRE
+#define ETH_P_ERSPAN  0x88be
+
+#define VXLAN_PORT    4789
+
+static size_t slice_l3(const uint8_t *h, uint16_t type, size_t rem, int depth);
+
+static inline uint16_t
+get16(const uint8_t *h) {
+    return (h[0] << 8) | h[1];
+}
+
+static size_t
+slice_eth(const uint8_t *h, size_t rem, int depth) {
+    size_t len = 14;
+    if (rem < len)
+        return rem;
+    uint16_t type = get16(h + 12);
+    while (type == ETH_P_8021Q || type == ETH_P_8021AD || type == ETH_P_QINQ) {
+        if (rem < len + 4)
+            return rem;
+        type = get16(h + len + 2);
+        len += 4;
+    }
+    return len + slice_l3(h + len, type, rem - len, depth);
+}
+
+static size_t
+slice_mpls(const uint8_t *h, size_t rem, int depth) {
+    size_t len = 0;
+    for (;;) {
+        if (rem < len + 4)
+            return rem;
+        len += 4;
+        if (h[len - 2] & 0x01)
+            break; //bottom of stack
+    }
+    if (rem == len)
+        return len;
+    switch (h[len] >> 4) {
+    case 4:
+        return len + slice_l3(h + len, ETH_P_IP, rem - len, depth);
+    case 6:
+        return len + slice_l3(h + len, ETH_P_IPV6, rem - len, depth);
+    case 0:
+        //pseudowire control word, then Ethernet
+        if (rem < len + 4)
+            return rem;
+        return len + 4 + slice_eth(h + len + 4, rem - len - 4, depth);
+    }
+    return len;
+}
+
+static size_t
+slice_gre(const uint8_t *h, size_t rem, int depth) {
+    size_t len = 4;
+    if (rem < len)
+        return rem;
+    if ((h[1] & 0x07) != 0)
+        return len; //enhanced GRE (PPTP) carries PPP
+    if (h[0] & 0x80)
+        len += 4; //checksum
+    if (h[0] & 0x20)
+        len += 4; //key
+    if (h[0] & 0x10)
+        len += 4; //sequence number
+    if (rem < len)
+        return rem;
+    uint16_t type = get16(h + 2);
+    if (type == ETH_P_TEB)
+        return len + slice_eth(h + len, rem - len, depth);
+    if (type == ETH_P_ERSPAN) {
+        if (rem < len + 8)
+            return rem;
+        return len + 8 + slice_eth(h + len + 8, rem - len - 8, depth);
+    }
+    return len + slice_l3(h + len, type, rem - len, depth);
+}
+
+/* headers from the transport header on */
+static size_t
+slice_l4(const uint8_t *h, uint8_t proto, size_t rem, int depth) {
+    size_t len;
+    switch (proto) {
+    case TRACE_IPPROTO_TCP:
+        if (rem < 20)
+            return rem;
+        len = (h[12] >> 4)*4;
+        break;
+    case TRACE_IPPROTO_UDP:
+        len = 8;
+        if (rem >= 16 && get16(h + 2) == VXLAN_PORT)
+            return len + 8 + slice_eth(h + 16, rem - 16, depth);
+        break;
+    case 1:   //ICMP
+    case 58:  //ICMPv6
+        len = 8;
+        break;
+    case 132: //SCTP, common header only
+        len = 12;
+        break;
+    case 47:  //GRE
+        return slice_gre(h, rem, depth);
+    case 4:   //IPv4 in IP
+        return slice_l3(h, ETH_P_IP, rem, depth);
+    case 41:  //IPv6 in IP
+        return slice_l3(h, ETH_P_IPV6, rem, depth);
+    default:
+        return 0;
+    }
+    return len < rem ? len : rem;
+}
+
+static size_t
+slice_ipv6(const uint8_t *h, size_t rem, int depth) {
+    size_t len = 40;
+    if (rem < len)
+        return rem;
+    uint8_t nh = h[6];
+    for (;;) {
+        size_t ext;
+        switch (nh) {
+        case 0:   //hop-by-hop
+        case 43:  //routing
+        case 60:  //destination options
+        case 135: //mobility
+            if (rem < len + 8)
+                return rem;
+            ext = (h[len + 1] + 1)*8;
+            break;
+        case 44:  //fragment
+            if (rem < len + 8)
+                return rem;
+            if ((get16(h + len + 2) & 0xfff8) != 0)
+                return len + 8; //not the first fragment, no L4 header
+            ext = 8;
+            break;
+        case 51:  //authentication header
+            if (rem < len + 8)
+                return rem;
+            ext = (h[len + 1] + 2)*4;
+            break;
+        default:
+            return len + slice_l4(h + len, nh, rem - len, depth);
+        }
+        nh = h[len];
+        len += ext;
+        if (rem < len)
+            return rem;
+    }
+}
+
+static size_t
+slice_ipv4(const uint8_t *h, size_t rem, int depth) {
+    if (rem < 20)
+        return rem;
+    size_t len = (h[0] & 0x0f)*4;
+    if (len < 20)
+        return 20; //bogus header length
+    if (rem < len)
+        return rem;
+    if ((get16(h + 6) & 0x1fff) != 0)
+        return len; //not the first fragment, no L4 header
+    return len + slice_l4(h + len, h[9], rem - len, depth);
+}
+
+static size_t
+slice_l3(const uint8_t *h, uint16_t type, size_t rem, int depth) {
+    if (depth-- == 0)
+        return 0;
+    switch (type) {
+    case ETH_P_IP:
+        return slice_ipv4(h, rem, depth);
+    case ETH_P_IPV6:
+        return slice_ipv6(h, rem, depth);
+    case ETH_P_MPLS_UC:
+    case ETH_P_MPLS_MC:
+        return slice_mpls(h, rem, depth);
+    }
+    return 0;
+}
+
+size_t
+MTC_Slicer::headers(const void *l3, uint16_t ethertype, uint32_t remaining) {
+    size_t len = slice_l3(static_cast<const uint8_t*>(l3), ethertype, remaining,
+                          SLICE_DEPTH + 1);
+    return len < remaining ? len : remaining;
+}
+
+size_t
+MTC_Slicer::slice(libtrace_packet_t *p, void *l3, uint16_t ethertype,
+                  uint32_t remaining) const {
+    size_t keep = headers(l3, ethertype, remaining) + payload_;
+    if (keep >= remaining)
+        return 0;
+    libtrace_linktype_t linktype;
+    uint32_t caprem;
+    const char *start = static_cast<const char*>(trace_get_packet_buffer(p, &linktype, &caprem));
+    if (!start || static_cast<const char*>(l3) < start)
+        return 0;
+    size_t off = static_cast<const char*>(l3) - start;
+    trace_set_capture_length(p, off + keep);
+    return remaining - keep;
+}
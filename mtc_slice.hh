@@ -0,0 +1,57 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_SLICE_HH
+#define MTC_SLICE_HH
+
+#include <cstddef>
+#include <stdint.h>
+
+#define SLICE_DEPTH    4   //tunnels followed inside each other
+#define SLICE_HEADROOM 256 //default snaplen on top of the payload kept
+
+/*
+ * Cuts packets right after their headers instead of at a fixed snap
+ * length. Starting from what trace_get_layer3() found (libtrace already
+ * steps over VLAN and MPLS), IPv4/IPv6 with extension headers and the
+ * TCP, UDP, SCTP and ICMP headers are kept, and so are the headers of
+ * packets tunnelled in IP-in-IP, GRE (including transparent Ethernet
+ * and ERSPAN II), VXLAN and MPLS. payload bytes after the innermost
+ * header are kept as well. Only the capture length shrinks, the wire
+ * length is left as it was. Headers that are cut short by the snaplen
+ * are kept as far as they go.
+ */
+class MTC_Slicer {
+public:
+    explicit MTC_Slicer(size_t payload) : payload_(payload) {}
+
+    size_t payload() const { return payload_; }
+
+    /* trims p, whose layer 3 is at l3, returns the bytes cut */
+    size_t slice(libtrace_packet_t *p, void *l3, uint16_t ethertype,
+                 uint32_t remaining) const;
+    /* bytes of headers at l3, at most remaining */
+    static size_t headers(const void *l3, uint16_t ethertype, uint32_t remaining);
+
+protected:
+    size_t payload_;
+};
+
+#endif /* MTC_SLICE_HH */
@@ -0,0 +1,182 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <libtrace.h>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+
+#include "mtc_log.hh"
+#include "mtc_stats.hh"
+#include "mtc_spool.hh"
+
+#define SPOOL_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+MTC_Spool::MTC_Spool(const char *path, size_t size_mb, const MTC_Log &log) :
+    path_(strdup(path)),
+    mtclog_(log),
+    base_(0),
+    size_(size_mb*1024*1024),
+    head_(0),
+    tail_(0),
+    wrap_(0),
+    wrapped_(false),
+    count_(0),
+    used_(0),
+    high_water_(0),
+    spilled_(0),
+    drained_(0),
+    full_(0),
+    stats_(0)
+{
+    int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        mtclog_.panic("Error opening spool '%s': %s\n", path, strerror(errno));
+    //all blocks up front, spilling must not find the disk full
+    int err = ::posix_fallocate(fd, 0, size_);
+    if (err != 0)
+        mtclog_.panic("cannot allocate %luMB for spool '%s': %s\n",
+                      (ulong)size_mb, path, strerror(err));
+    void *m = ::mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED)
+        mtclog_.panic("mmap of spool '%s': %s\n", path, strerror(errno));
+    ::close(fd);
+    base_ = static_cast<char*>(m);
+    ::madvise(base_, size_, MADV_SEQUENTIAL);
+
+    for (size_t k = 0; k < SPOOL_BATCH; ++k) {
+        out_[k] = trace_create_packet();
+        if (!out_[k])
+            mtclog_.panic("cannot allocate spool packets\n");
+    }
+}
+
+MTC_Spool::~MTC_Spool() {
+    for (size_t k = 0; k < SPOOL_BATCH; ++k)
+        trace_destroy_packet(out_[k]); //never owned the ring below
+    ::munmap(base_, size_);
+    if (::unlink(path_) != 0)
+        mtclog_.warn("cannot remove spool %s: %s\n", path_, strerror(errno));
+    free(path_);
+}
+
+bool
+MTC_Spool::spill(const libtrace_packet_t *p, uint64_t ts) {
+    size_t framing = trace_get_framing_length(p);
+    size_t caplen  = trace_get_capture_length(p);
+    size_t need    = SPOOL_ALIGN(sizeof(rec_t) + framing + caplen);
+    if (count_ == 0) {
+        head_ = tail_ = 0;
+        wrapped_ = false;
+    }
+    size_t at;
+    if (!wrapped_ && head_ + need <= size_) {
+        at = head_;
+    } else if (!wrapped_ && need <= tail_) {
+        wrap_    = head_; //the rest of the file is skipped
+        wrapped_ = true;
+        at = 0;
+    } else if (wrapped_ && head_ + need <= tail_) {
+        at = head_;
+    } else {
+        ++full_;
+        return false;
+    }
+
+    rec_t *r    = rec_at(at);
+    r->len_     = need;
+    r->type_    = p->type;
+    r->caplen_  = caplen;
+    r->ts_      = ts;
+    r->trace_   = p->trace;
+    char *data  = reinterpret_cast<char*>(r + 1);
+    memcpy(data, p->header, framing);
+    memcpy(data + framing, p->payload, caplen);
+
+    head_  = at + need;
+    used_ += need;
+    ++count_;
+    ++spilled_;
+    if (used_ > high_water_)
+        high_water_ = used_;
+    if (stats_) {
+        mtc_stat_add(stats_->spilled_, 1);
+        mtc_stat_set(stats_->spool_used_, used_);
+    }
+    return true;
+}
+
+size_t
+MTC_Spool::peek(libtrace_packet_t **pkts, uint64_t *ts, size_t max) {
+    if (max > SPOOL_BATCH)
+        max = SPOOL_BATCH;
+    size_t off = tail_;
+    size_t n   = 0;
+    bool   jumped = false;
+    for (; n < max && n < count_; ++n) {
+        if (wrapped_ && !jumped && off == wrap_) {
+            off = 0;
+            jumped = true;
+        }
+        rec_t *r = rec_at(off);
+        libtrace_packet_t *c = out_[n];
+        //the format parses the record as if it had just read it
+        if (trace_prepare_packet(r->trace_, c, r + 1, (libtrace_rt_types_t)r->type_,
+                                 TRACE_PREP_DO_NOT_OWN_BUFFER) == -1) {
+            trace_perror(r->trace_, "trace_prepare_packet");
+            mtclog_.panic("cannot read back spooled packet from %s\n", path_);
+        }
+        pkts[n] = c;
+        ts[n]   = r->ts_;
+        off += r->len_;
+    }
+    return n;
+}
+
+void
+MTC_Spool::release(size_t cnt) {
+    size_t n = 0;
+    for (; n < cnt && count_ > 0; ++n) {
+        if (wrapped_ && tail_ == wrap_) {
+            tail_ = 0;
+            wrapped_ = false;
+        }
+        size_t len = rec_at(tail_)->len_;
+        tail_ += len;
+        used_ -= len;
+        --count_;
+    }
+    if (wrapped_ && tail_ == wrap_) {
+        tail_ = 0;
+        wrapped_ = false;
+    }
+    drained_ += n;
+    if (stats_) {
+        mtc_stat_add(stats_->drained_, n);
+        mtc_stat_set(stats_->spool_used_, used_);
+    }
+}
@@ -0,0 +1,95 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_SPOOL_HH
+#define MTC_SPOOL_HH
+
+#include <stdint.h>
+#include <cstddef>
+
+#define SPOOL_SIZE_DEFAULT 1024 //MB
+#define SPOOL_BATCH        32   //packets handed back at once
+
+struct mtc_stats_output_t;
+
+/*
+ * Overflow for the output path. When the pipe to the compressor,
+ * --direct-io writer or --pipeout command is backlogged, merged packets
+ * are copied into a preallocated file mapped as a ring, rather than the
+ * merger blocking on the pipe and the inputs overflowing. Once the
+ * output keeps up again, peek() hands the oldest ones back in order,
+ * without copying: trace_prepare_packet() points them into the ring,
+ * with the input and rt type they were read with, until release().
+ * Records are 8-byte aligned and never wrap; the space left at the end
+ * of the file when the next record does not fit is skipped. Owned by
+ * the merging thread.
+ */
+class MTC_Spool {
+public:
+    MTC_Spool(const char *path, size_t size_mb, const MTC_Log &log);
+    ~MTC_Spool();
+
+    /* copies p in, false if the spool is full */
+    bool   spill(const libtrace_packet_t *p, uint64_t ts);
+    /* up to max of the oldest packets, they stay valid until release() */
+    size_t peek(libtrace_packet_t **pkts, uint64_t *ts, size_t max);
+    void   release(size_t cnt);
+
+    bool     empty() const { return count_ == 0; }
+    size_t   size() const { return size_; }
+    size_t   used() const { return used_; }
+    size_t   high_water() const { return high_water_; }
+    uint64_t spilled() const { return spilled_; }
+    uint64_t drained() const { return drained_; }
+    uint64_t full() const { return full_; }
+    void     set_stats(mtc_stats_output_t *stats) { stats_ = stats; }
+
+protected:
+    struct rec_t {
+        uint32_t    len_;     //whole record, aligned
+        uint32_t    type_;    //libtrace's rt type of the framing
+        uint32_t    caplen_;
+        uint64_t    ts_;      //erf
+        libtrace_t *trace_;   //read from, for the format
+    };
+
+    rec_t *rec_at(size_t off) const { return reinterpret_cast<rec_t*>(base_ + off); }
+
+protected:
+    char       *path_;
+    const MTC_Log
+    &mtclog_;
+    char       *base_;
+    size_t      size_;
+    size_t      head_;     //next record goes here
+    size_t      tail_;     //oldest record
+    size_t      wrap_;     //end of the records before head_ wrapped
+    bool        wrapped_;  //head_ is behind tail_
+    size_t      count_;
+    size_t      used_;
+    size_t      high_water_;
+    uint64_t    spilled_;
+    uint64_t    drained_;
+    uint64_t    full_;
+    mtc_stats_output_t *stats_;
+    libtrace_packet_t  *out_[SPOOL_BATCH]; //peek()ed, over the records
+};
+
+#endif /* MTC_SPOOL_HH */
@@ -0,0 +1,114 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include "mtc_log.hh"
+#include "mtc_stats.hh"
+
+static inline uint64_t
+realtime_ns() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+size_t
+MTC_Stats::file_size(size_t inputs, size_t outputs) {
+    return sizeof(mtc_stats_hdr_t) + inputs*sizeof(mtc_stats_input_t) +
+        outputs*sizeof(mtc_stats_output_t);
+}
+
+MTC_Stats::MTC_Stats(const char *path, size_t inputs, size_t outputs,
+                     const MTC_Log &log) :
+    mtclog_(log),
+    map_(0),
+    size_(file_size(inputs, outputs)),
+    hdr_(0)
+{
+    //a new file every time: a reader still mapping the old one keeps it
+    ::unlink(path);
+    int fd = ::open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        mtclog_.panic("cannot create stats file %s: %s\n", path, strerror(errno));
+    }
+    if (::ftruncate(fd, size_) != 0) {
+        mtclog_.panic("cannot size stats file %s: %s\n", path, strerror(errno));
+    }
+    map_ = ::mmap(0, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map_ == MAP_FAILED) {
+        mtclog_.panic("cannot map stats file %s: %s\n", path, strerror(errno));
+    }
+    ::close(fd);
+
+    //the file is zero-filled, which is a valid initial state for every counter
+    hdr_ = new (map_) mtc_stats_hdr_t;
+    hdr_->version_     = STATS_VERSION;
+    hdr_->hdr_size_    = sizeof(mtc_stats_hdr_t);
+    hdr_->inputs_      = inputs;
+    hdr_->input_size_  = sizeof(mtc_stats_input_t);
+    hdr_->outputs_     = outputs;
+    hdr_->output_size_ = sizeof(mtc_stats_output_t);
+    hdr_->pid_         = ::getpid();
+    hdr_->started_ns_  = realtime_ns();
+    for (size_t i = 0; i < inputs; ++i)
+        new (input(i)) mtc_stats_input_t;
+    for (size_t i = 0; i < outputs; ++i)
+        new (output(i)) mtc_stats_output_t;
+    touch();
+    //magic goes last, readers ignore the file until it is set
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(hdr_->magic_, STATS_MAGIC, sizeof(hdr_->magic_));
+}
+
+MTC_Stats::~MTC_Stats() {
+    //the file stays behind so the last values can still be read
+    touch();
+    ::munmap(map_, size_);
+}
+
+mtc_stats_input_t *
+MTC_Stats::input(size_t i) {
+    return (mtc_stats_input_t *)((char *)map_ + sizeof(mtc_stats_hdr_t) +
+                                 i*sizeof(mtc_stats_input_t));
+}
+
+mtc_stats_output_t *
+MTC_Stats::output(size_t i) {
+    return (mtc_stats_output_t *)((char *)map_ + sizeof(mtc_stats_hdr_t) +
+                                  hdr_->inputs_*sizeof(mtc_stats_input_t) +
+                                  i*sizeof(mtc_stats_output_t));
+}
+
+void
+MTC_Stats::touch() {
+    mtc_stat_set(hdr_->updated_ns_, realtime_ns());
+}
@@ -0,0 +1,118 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_STATS_HH
+#define MTC_STATS_HH
+
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+
+#define STATS_MAGIC   "MTCSTAT"
+#define STATS_VERSION 1
+#define STATS_NAME_LEN 128
+
+class MTC_Log;
+
+/*
+ * Live counters in a file that external monitors mmap read-only.
+ * Every counter has exactly one writing thread, so updates are plain
+ * relaxed load/store pairs without locked instructions; readers load
+ * them relaxed and compute rates from two snapshots. The layout is
+ * versioned: a reader must check magic_ and version_, and use the
+ * counts and sizes in the header to find the slots.
+ */
+typedef std::atomic<uint64_t> mtc_counter_t;
+
+inline void
+mtc_stat_add(mtc_counter_t &c, uint64_t n) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void
+mtc_stat_set(mtc_counter_t &c, uint64_t v) {
+    c.store(v, std::memory_order_relaxed);
+}
+
+struct mtc_stats_input_t {
+    char          uri_[STATS_NAME_LEN];
+    mtc_counter_t packets_;
+    mtc_counter_t bytes_;        //captured
+    mtc_counter_t drops_;        //reported by the capture format
+    mtc_counter_t ring_drops_;   //--capture-threads ring overflows
+    mtc_counter_t late_drops_;   //behind the reorder window
+    mtc_counter_t disorders_;
+    mtc_counter_t dup_drops_;    //copies of packets seen on another input
+    char          pad_[56];
+};
+
+struct mtc_stats_output_t {
+    char          name_[STATS_NAME_LEN]; //file name of the current segment
+    mtc_counter_t packets_;
+    mtc_counter_t bytes_;
+    mtc_counter_t disorders_;
+    mtc_counter_t segments_;
+    mtc_counter_t rotate_ns_last_;       //closing one segment and opening the next
+    mtc_counter_t rotate_ns_max_;
+    mtc_counter_t backlog_;              //bytes waiting in the segment's pipe
+    mtc_counter_t gated_ns_;             //-W, no segment open for the watchfile
+    mtc_counter_t gated_packets_;        //dropped meanwhile
+    mtc_counter_t spool_used_;           //--spool bytes waiting for the output
+    mtc_counter_t spilled_;              //packets that went through the spool
+    mtc_counter_t drained_;
+    mtc_counter_t level_;                //compression level of the current segment plus one, 0 if none
+    char          pad_[16];
+};
+
+struct mtc_stats_hdr_t {
+    char          magic_[8];
+    uint32_t      version_;
+    uint32_t      hdr_size_;
+    uint32_t      inputs_;
+    uint32_t      input_size_;
+    uint32_t      outputs_;
+    uint32_t      output_size_;
+    uint64_t      pid_;
+    uint64_t      started_ns_;           //CLOCK_REALTIME
+    mtc_counter_t updated_ns_;           //CLOCK_REALTIME of the last refresh
+    char          pad_[64];
+};
+
+/* creates the file and maps it, owned by the capturing process */
+class MTC_Stats {
+public:
+    MTC_Stats(const char *path, size_t inputs, size_t outputs, const MTC_Log &log);
+    ~MTC_Stats();
+
+    mtc_stats_input_t  *input(size_t i);
+    mtc_stats_output_t *output(size_t i);
+    void touch(); //stamps updated_ns_
+
+    static size_t file_size(size_t inputs, size_t outputs);
+
+protected:
+    const MTC_Log
+    &mtclog_;
+    void            *map_;
+    size_t           size_;
+    mtc_stats_hdr_t *hdr_;
+};
+
+#endif /* MTC_STATS_HH */
@@ -0,0 +1,178 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <libtrace.h>
+#include <cstdio>
+
+#include "mtc_log.hh"
+#include "mtc_output.hh"
+#include "mtc_tee.hh"
+
+#define TEE_IDLE_US 50
+
+static inline uint64_t
+timeval_to_erf(const timeval &tv) {
+    return ((uint64_t)tv.tv_sec << 32) + (((uint64_t)tv.tv_usec << 32)/1000000);
+}
+
+MTC_Tee::MTC_Tee(const sink_t *sinks, size_t cnt, size_t ringsize,
+                 MTC_ShardSet::release_t release, void *arg, const MTC_Log &log) :
+    mtclog_(log),
+    shards_(new MTC_Shard*[cnt]),
+    rotatesec_(new ulong[cnt]),
+    boundary_(new uint64_t[cnt]),
+    returned_(new uint64_t[cnt]),
+    cnt_(cnt),
+    held_(held_max(ringsize)),
+    released_(0),
+    release_(release),
+    arg_(arg),
+    dispatched_(0)
+{
+    timeval now;
+    ::gettimeofday(&now, 0);
+    for (size_t i = 0; i < cnt_; ++i) {
+        shards_[i] = new MTC_Shard(sinks[i].out_, ringsize, log);
+        shards_[i]->set_filter(sinks[i].filter_);
+        //every sink writes its own copy, see MTC_Shard
+        shards_[i]->set_snaplen(sinks[i].snaplen_, cnt_ > 1);
+        rotatesec_[i] = sinks[i].rotatesec_;
+        boundary_[i]  = (uint64_t)(now.tv_sec + rotatesec_[i]) << 32;
+        returned_[i]  = 0;
+    }
+}
+
+MTC_Tee::~MTC_Tee() {
+    stop();
+    for (size_t i = 0; i < cnt_; ++i)
+        delete shards_[i];
+    delete [] shards_;
+    delete [] rotatesec_;
+    delete [] boundary_;
+    delete [] returned_;
+}
+
+void
+MTC_Tee::start() {
+    timeval now;
+    ::gettimeofday(&now, 0);
+    for (size_t i = 0; i < cnt_; ++i) {
+        shards_[i]->start();
+        rotate_sink(i, timeval_to_erf(now));
+    }
+}
+
+void
+MTC_Tee::stop() {
+    for (size_t i = 0; i < cnt_; ++i)
+        shards_[i]->stop();
+    for (size_t i = 0; i < cnt_; ++i) {
+        //keep reclaiming so that a sink blocked on its done ring can finish
+        while (!shards_[i]->finished()) {
+            reclaim_all();
+            usleep(TEE_IDLE_US);
+        }
+        shards_[i]->join();
+    }
+    reclaim_all();
+}
+
+void
+MTC_Tee::reclaim_all() {
+    MTC_Shard::slot_t s;
+    uint64_t done = (uint64_t)-1;
+    for (size_t i = 0; i < cnt_; ++i) {
+        while (shards_[i]->reclaim(s))
+            ++returned_[i];
+        if (returned_[i] < done)
+            done = returned_[i];
+    }
+    //the first done packets went through every sink
+    while (released_ < done && held_.pop(s)) {
+        release_(arg_, s.idx_, s.packet_);
+        ++released_;
+    }
+    dispatched_ = 0;
+}
+
+void
+MTC_Tee::push_wait(size_t i, const MTC_Shard::slot_t &s) {
+    while (!shards_[i]->push(s)) {
+        //the sink is behind; what all sinks wrote meanwhile can be reused
+        reclaim_all();
+        usleep(TEE_IDLE_US);
+    }
+}
+
+void
+MTC_Tee::rotate_sink(size_t i, uint64_t ts) {
+    MTC_Shard::slot_t s;
+    s.packet_ = 0;
+    s.ts_     = ts;
+    s.idx_    = -1;
+    push_wait(i, s);
+    if (rotatesec_[i]) {
+        timeval now;
+        ::gettimeofday(&now, 0);
+        boundary_[i] = (uint64_t)(now.tv_sec + rotatesec_[i]) << 32;
+    }
+}
+
+long
+MTC_Tee::rotate_idle(const timeval &now) {
+    long     next = -1;
+    uint64_t erf  = timeval_to_erf(now);
+    for (size_t i = 0; i < cnt_; ++i) {
+        if (!rotatesec_[i])
+            continue;
+        if (erf >= boundary_[i])
+            rotate_sink(i, erf);
+        long ms = (long)(((boundary_[i] - erf) >> 32)*1000 +
+                         (((boundary_[i] - erf) & 0xffffffffULL)*1000 >> 32));
+        if (next < 0 || ms < next)
+            next = ms;
+    }
+    return next;
+}
+
+void
+MTC_Tee::dispatch(libtrace_packet_t *p, uint64_t ts, int idx) {
+    MTC_Shard::slot_t s;
+    s.packet_ = p;
+    s.ts_     = ts;
+    s.idx_    = idx;
+    //cached before the sinks read the packet, all at once
+    trace_get_capture_length(p);
+    while (!held_.push(s)) {
+        reclaim_all();
+        usleep(TEE_IDLE_US);
+    }
+    for (size_t i = 0; i < cnt_; ++i) {
+        if (rotatesec_[i] && ts >= boundary_[i])
+            rotate_sink(i, ts); //time-driven rotation by packet time
+        push_wait(i, s);
+    }
+    if (++dispatched_ >= SHARD_BATCH)
+        reclaim_all();
+}
@@ -0,0 +1,89 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_TEE_HH
+#define MTC_TEE_HH
+
+#include <sys/time.h>
+#include <stdint.h>
+
+#include "mtc_ring.hh"
+#include "mtc_shard.hh"
+
+#define TEE_SINKS_MAX 16
+
+/*
+ * Feeds every merged packet to several outputs, each a --sink with its
+ * own filter, snaplen, rotation and compression, written on its own
+ * MTC_Shard thread; filters are applied there, off the merger, each to
+ * the sink's own copy of the packet. A
+ * packet goes back to its input once the slowest sink is done with it:
+ * sinks hand packets back in the order they got them, so counting what
+ * each sink returned is enough. Time-driven rotation is decided here
+ * per sink, like MTC_ShardSet does for all shards.
+ */
+class MTC_Tee {
+public:
+    struct sink_t {
+        MTC_Output        *out_;
+        libtrace_filter_t *filter_;    //0: everything
+        size_t             snaplen_;   //0: as captured
+        ulong              rotatesec_; //0: no time-driven rotation
+    };
+
+    MTC_Tee(const sink_t *sinks, size_t cnt, size_t ringsize,
+            MTC_ShardSet::release_t release, void *arg, const MTC_Log &log);
+    ~MTC_Tee();
+
+    void start();
+    void stop();  //once everything was dispatched, joins the threads
+
+    void dispatch(libtrace_packet_t *p, uint64_t ts, int idx); //waits if a sink is full
+    /* rotates idle sinks by wall-clock time, returns ms until the next
+     * rotation is due or -1 */
+    long rotate_idle(const timeval &now);
+    void reclaim_all();
+
+    size_t size() const { return cnt_; }
+    /* packets that may be held at once, for sizing the pool */
+    static size_t held_max(size_t ringsize) {
+        return 2*(mtc_ring_capacity(ringsize) + SHARD_BATCH);
+    }
+
+protected:
+    void push_wait(size_t i, const MTC_Shard::slot_t &s);
+    void rotate_sink(size_t i, uint64_t ts);
+
+protected:
+    const MTC_Log
+    &mtclog_;
+    MTC_Shard  **shards_;
+    ulong       *rotatesec_;
+    uint64_t    *boundary_;   //erf time of each sink's next rotation
+    uint64_t    *returned_;   //packets each sink handed back so far
+    size_t       cnt_;
+    MTC_Ring<MTC_Shard::slot_t> held_; //dispatched, in order, not released yet
+    uint64_t     released_;
+    MTC_ShardSet::release_t release_;
+    void        *arg_;
+    size_t       dispatched_; //since the last reclaim_all()
+};
+
+#endif /* MTC_TEE_HH */
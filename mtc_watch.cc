@@ -0,0 +1,168 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "mtc_log.hh"
+#include "mtc_time.hh"
+#include "mtc_watch.hh"
+
+MTC_Watchfile::MTC_Watchfile(const char *path, const MTC_Log &log) :
+    path_(path),
+    mtclog_(log),
+    fd_(-1),
+    present_(false),
+    checked_ns_(0),
+    appeared_ns_(0),
+    rewatch_(false) {
+    watch(true);
+    check();
+}
+
+MTC_Watchfile::~MTC_Watchfile() {
+    if (fd_ >= 0)
+        ::close(fd_);
+}
+
+bool
+MTC_Watchfile::watch(bool loud) {
+    std::string dir(path_);
+    size_t slash = dir.rfind('/');
+    if (slash == std::string::npos)
+        dir = ".";
+    else if (slash == 0)
+        dir = "/";
+    else
+        dir.resize(slash);
+
+    fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0) {
+        if (loud)
+            mtclog_.warn("inotify_init1: %s, checking %s every %dms\n",
+                         strerror(errno), path_, WATCH_RETRY_MS);
+        return false;
+    }
+    //the *_SELF events tell when the directory itself goes away
+    if (::inotify_add_watch(fd_, dir.c_str(),
+                            IN_CREATE | IN_MOVED_TO | IN_DELETE |
+                            IN_MOVED_FROM | IN_ATTRIB | IN_ONLYDIR |
+                            IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        if (loud)
+            mtclog_.warn("cannot watch %s: %s, checking %s every %dms\n",
+                         dir.c_str(), strerror(errno), path_, WATCH_RETRY_MS);
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    return true;
+}
+
+void
+MTC_Watchfile::unwatch() {
+    mtclog_.warn("directory of %s is gone, checking it every %dms\n",
+                 path_, WATCH_RETRY_MS);
+    ::close(fd_);
+    fd_ = -1;
+    rewatch_ = true;
+}
+
+void
+MTC_Watchfile::check() {
+    bool was = present_;
+    present_ = (::access(path_, F_OK) == 0);
+    checked_ns_ = monotonic_ns();
+    if (present_ && !was)
+        appeared_ns_ = checked_ns_;
+}
+
+bool
+MTC_Watchfile::drain(bool &lost) {
+    /* events are only a hint to look again, their names do not matter;
+     * a watch that was removed, or a directory that moved away, does */
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool any = false;
+    lost = false;
+    for (;;) {
+        ssize_t len = ::read(fd_, buf, sizeof(buf));
+        if (len > 0) {
+            any = true;
+            for (char *e = buf; e < buf + len; ) {
+                const struct inotify_event *ev = reinterpret_cast<struct inotify_event*>(e);
+                if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+                    lost = true;
+                e += sizeof(struct inotify_event) + ev->len;
+            }
+            continue;
+        }
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && errno != EAGAIN)
+            mtclog_.warn("reading inotify events for %s: %s\n", path_, strerror(errno));
+        return any;
+    }
+}
+
+bool
+MTC_Watchfile::present() {
+    if (fd_ >= 0) {
+        bool lost;
+        if (drain(lost))
+            check();
+        if (lost)
+            unwatch();
+    } else if (monotonic_ns() - checked_ns_ >= WATCH_RETRY_MS*1000000ULL) {
+        //a directory that came back is watched again
+        if (rewatch_ && watch(false)) {
+            rewatch_ = false;
+            mtclog_.warn("watching the directory of %s again\n", path_);
+        }
+        check();
+    }
+    return present_;
+}
+
+bool
+MTC_Watchfile::wait(int timeout_ms) {
+    if (present())
+        return true;
+    if (fd_ < 0) {
+        if (timeout_ms < 0 || timeout_ms > WATCH_RETRY_MS)
+            timeout_ms = WATCH_RETRY_MS;
+        ::usleep(1000*timeout_ms);
+        checked_ns_ = 0; //look now
+        return present();
+    }
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+        mtclog_.warn("poll on inotify for %s: %s\n", path_, strerror(errno));
+    return present();
+}
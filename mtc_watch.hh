@@ -0,0 +1,69 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTC_WATCH_HH
+#define MTC_WATCH_HH
+
+#include <stdint.h>
+
+#define WATCH_RETRY_MS 1000 //rechecking a watchfile without inotify
+
+/*
+ * Presence of a -W watchfile, without blocking. The file's directory is
+ * watched with inotify, so present() only touches the file system when
+ * something in there was created, moved or removed; fd() becomes
+ * readable then, for callers that want to sleep on it. Without a
+ * watchable directory, present() checks the file itself, at most every
+ * WATCH_RETRY_MS. So it does when the directory is removed or moved
+ * away, which ends the watch, until a directory is there to watch
+ * again; fd() may change then. Not thread safe, every thread keeps its
+ * own.
+ */
+class MTC_Watchfile {
+public:
+    MTC_Watchfile(const char *path, const MTC_Log &log);
+    ~MTC_Watchfile();
+
+    bool present();
+    /* sleeps until the file is there, or timeout_ms have passed */
+    bool wait(int timeout_ms);
+
+    int         fd() const { return fd_; }
+    const char *path() const { return path_; }
+    uint64_t    appeared_ns() const { return appeared_ns_; } //CLOCK_MONOTONIC
+
+protected:
+    bool watch(bool loud); //sets up fd_, false if it cannot
+    void unwatch();        //the watch is gone, poll instead
+    void check();
+    bool drain(bool &lost); //true if any event was pending
+
+protected:
+    const char *path_;
+    const MTC_Log
+    &mtclog_;
+    int         fd_;          //inotify instance, or -1
+    bool        present_;
+    uint64_t    checked_ns_;  //last look at the file without inotify
+    uint64_t    appeared_ns_; //when present_ last became true
+    bool        rewatch_;     //the watch was lost, try again while polling
+};
+
+#endif /* MTC_WATCH_HH */
@@ -0,0 +1,459 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+
+/*
+ * End-to-end benchmark: writes synthetic pcap traces, one per input,
+ * runs mtracecap on them and reports what came out of the other end,
+ * taken from its --stats-file. Inputs are replayed in real time, so the
+ * offered load is the configured rate; raise it until packets go missing.
+ */
+
+#include <sys/types.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <vector>
+#include <string>
+
+#include "mtc_stats.hh"
+#include "mtc_time.hh"
+
+#define BENCH_PACKETS_DEFAULT 1000000
+#define BENCH_RATE_DEFAULT    100000
+#define BENCH_FLOWS_DEFAULT   1024
+#define BENCH_MIX_DEFAULT     "64:7,594:4,1518:1" //simple IMIX
+
+static void
+usage(const char *prog) {
+    fprintf(stderr,
+            "%s [flags] [-- mtracecap flags]\n"
+            "    Replays synthetic traces through mtracecap and reports its throughput\n"
+            "[-n | --inputs] count\n"
+            "    Number of inputs (default 2)\n"
+            "[-p | --packets] packets\n"
+            "    Packets per input (default %d)\n"
+            "[-r | --rate] pps\n"
+            "    Packets per second per input (default %d)\n"
+            "[-m | --mix] size:weight[,size:weight...]\n"
+            "    Frame sizes and their weights (default %s)\n"
+            "[-f | --flows] flows\n"
+            "    Distinct 5-tuples per input (default %d)\n"
+            "[-j | --jitter-us] usec\n"
+            "    Randomly delay timestamps within an input, producing disorders\n"
+            "[-o | --format] format\n"
+            "    Output format given to -B (default pcapfile)\n"
+            "[-d | --dir] dir\n"
+            "    Work directory (default: a new one under $TMPDIR)\n"
+            "[-k | --keep]\n"
+            "    Keep the generated traces and the output (always kept with -d)\n"
+            "[-x | --mtracecap] path\n"
+            "    mtracecap to run (default: next to this binary)\n"
+            , prog, BENCH_PACKETS_DEFAULT, BENCH_RATE_DEFAULT, BENCH_MIX_DEFAULT,
+            BENCH_FLOWS_DEFAULT);
+    exit(1);
+}
+
+/* xorshift64*, reproducible across runs */
+static inline uint64_t
+next_rand(uint64_t &s) {
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return s*2685821657736338717ULL;
+}
+
+struct mix_t {
+    std::vector<uint32_t> sizes_;
+    std::vector<uint32_t> cumulative_; //running sum of the weights
+};
+
+static bool
+parse_mix(const char *s, mix_t &mix) {
+    uint32_t total = 0;
+    while (*s) {
+        char *end = 0;
+        unsigned long size = strtoul(s, &end, 10);
+        unsigned long weight = 1;
+        if (*end == ':')
+            weight = strtoul(end+1, &end, 10);
+        if (size < 60 || size > 9000 || weight == 0 || (*end != ',' && *end != '\0'))
+            return false;
+        total += weight;
+        mix.sizes_.push_back(size);
+        mix.cumulative_.push_back(total);
+        s = (*end == ',') ? end+1 : end;
+    }
+    return !mix.sizes_.empty();
+}
+
+static uint32_t
+pick_size(const mix_t &mix, uint64_t r) {
+    uint32_t w = r % mix.cumulative_.back();
+    size_t i = 0;
+    while (mix.cumulative_[i] <= w)
+        ++i;
+    return mix.sizes_[i];
+}
+
+struct pcap_hdr_t {
+    uint32_t magic_;
+    uint16_t major_;
+    uint16_t minor_;
+    int32_t  zone_;
+    uint32_t sigfigs_;
+    uint32_t snaplen_;
+    uint32_t linktype_;
+};
+
+struct pcap_rec_t {
+    uint32_t sec_;
+    uint32_t usec_;
+    uint32_t caplen_;
+    uint32_t len_;
+};
+
+static void
+write_or_die(FILE *f, const void *buf, size_t len, const char *path) {
+    if (fwrite(buf, 1, len, f) != len) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+/* Ethernet/IPv4/UDP frames, flows spread over source addresses and ports */
+static uint64_t
+generate(const char *path, int input, int inputs, uint64_t packets, double rate,
+         const mix_t &mix, uint32_t flows, uint32_t jitter_us, uint64_t start_us) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    pcap_hdr_t hdr = { 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1 /* ethernet */ };
+    write_or_die(f, &hdr, sizeof(hdr), path);
+
+    unsigned char frame[9000];
+    memset(frame, 0, sizeof(frame));
+    memset(frame, 0x02, 12);             //locally administered MACs
+    frame[12] = 0x08;                    //IPv4
+    frame[14] = 0x45;
+    frame[22] = 64;                      //ttl
+    frame[23] = 17;                      //udp
+    frame[26] = 10; frame[27] = (unsigned char)input;
+    frame[30] = 192; frame[31] = 168;
+
+    uint64_t seed  = 0x9e3779b97f4a7c15ULL*(input + 1);
+    uint64_t bytes = 0;
+    double   gap_us = 1e6/rate;
+    //inputs interleave instead of all sharing each timestamp
+    double   offset_us = gap_us*input/inputs;
+    for (uint64_t n = 0; n < packets; ++n) {
+        uint64_t r    = next_rand(seed);
+        uint32_t size = pick_size(mix, r);
+        uint32_t flow = (r >> 32) % flows;
+        uint64_t ts   = start_us + (uint64_t)(offset_us + n*gap_us);
+        if (jitter_us)
+            ts += next_rand(seed) % jitter_us;
+
+        uint16_t iplen = size - 14;
+        frame[16] = iplen >> 8; frame[17] = iplen & 0xff;
+        frame[28] = flow >> 8;  frame[29] = flow & 0xff;
+        frame[32] = flow >> 16; frame[33] = (flow & 0x7f) + 1;
+        uint16_t sport = 1024 + flow % 60000;
+        uint16_t udplen = iplen - 20;
+        frame[34] = sport >> 8;  frame[35] = sport & 0xff;
+        frame[36] = 0x30;        frame[37] = 0x39; //12345
+        frame[38] = udplen >> 8; frame[39] = udplen & 0xff;
+
+        pcap_rec_t rec = { (uint32_t)(ts/1000000), (uint32_t)(ts%1000000), size, size };
+        write_or_die(f, &rec, sizeof(rec), path);
+        write_or_die(f, frame, size, path);
+        bytes += size;
+    }
+    if (fclose(f) != 0) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return bytes;
+}
+
+/* sum of every slot's counters */
+struct totals_t {
+    uint64_t in_packets_;
+    uint64_t in_bytes_;
+    uint64_t drops_;
+    uint64_t ring_drops_;
+    uint64_t late_drops_;
+    uint64_t disorders_;
+    uint64_t out_packets_;
+    uint64_t out_bytes_;
+    uint64_t out_disorders_;
+    uint64_t segments_;
+    uint64_t rotate_ns_max_;
+};
+
+static bool
+read_stats(const char *path, totals_t &t) {
+    memset(&t, 0, sizeof(t));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(mtc_stats_hdr_t)) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const mtc_stats_hdr_t *hdr = (const mtc_stats_hdr_t *)map;
+    if (memcmp(hdr->magic_, STATS_MAGIC, sizeof(hdr->magic_)) != 0 ||
+        hdr->version_ != STATS_VERSION) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    const char *p = (const char *)map + hdr->hdr_size_;
+    for (size_t i = 0; i < hdr->inputs_; ++i, p += hdr->input_size_) {
+        const mtc_stats_input_t *in = (const mtc_stats_input_t *)p;
+        t.in_packets_ += in->packets_.load(std::memory_order_relaxed);
+        t.in_bytes_   += in->bytes_.load(std::memory_order_relaxed);
+        t.drops_      += in->drops_.load(std::memory_order_relaxed);
+        t.ring_drops_ += in->ring_drops_.load(std::memory_order_relaxed);
+        t.late_drops_ += in->late_drops_.load(std::memory_order_relaxed);
+        t.disorders_  += in->disorders_.load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < hdr->outputs_; ++i, p += hdr->output_size_) {
+        const mtc_stats_output_t *out = (const mtc_stats_output_t *)p;
+        t.out_packets_   += out->packets_.load(std::memory_order_relaxed);
+        t.out_bytes_     += out->bytes_.load(std::memory_order_relaxed);
+        t.out_disorders_ += out->disorders_.load(std::memory_order_relaxed);
+        t.segments_      += out->segments_.load(std::memory_order_relaxed);
+        uint64_t rot = out->rotate_ns_max_.load(std::memory_order_relaxed);
+        if (rot > t.rotate_ns_max_)
+            t.rotate_ns_max_ = rot;
+    }
+    munmap(map, st.st_size);
+    return true;
+}
+
+static std::string
+default_mtracecap() {
+    char self[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self)-1);
+    if (n <= 0)
+        return "mtracecap";
+    self[n] = '\0';
+    char *slash = strrchr(self, '/');
+    if (!slash)
+        return "mtracecap";
+    slash[1] = '\0';
+    return std::string(self) + "mtracecap";
+}
+
+/* nftw() callback, children come before their directory */
+static int
+remove_entry(const char *path, const struct stat *, int, struct FTW *) {
+    return ::remove(path);
+}
+
+int
+main(int argc, char *argv[]) {
+    int         opt_inputs = 2;
+    uint64_t    opt_packets = BENCH_PACKETS_DEFAULT;
+    double      opt_rate = BENCH_RATE_DEFAULT;
+    const char *opt_mix = BENCH_MIX_DEFAULT;
+    uint32_t    opt_flows = BENCH_FLOWS_DEFAULT;
+    uint32_t    opt_jitter_us = 0;
+    const char *opt_format = "pcapfile";
+    const char *opt_dir = NULL;
+    bool        opt_keep = false;
+    std::string opt_mtracecap = default_mtracecap();
+
+    while (1) {
+        int option_index;
+        struct option long_options[] =
+            {
+             { "inputs",    1, 0, 'n' },
+             { "packets",   1, 0, 'p' },
+             { "rate",      1, 0, 'r' },
+             { "mix",       1, 0, 'm' },
+             { "flows",     1, 0, 'f' },
+             { "jitter-us", 1, 0, 'j' },
+             { "format",    1, 0, 'o' },
+             { "dir",       1, 0, 'd' },
+             { "keep",      0, 0, 'k' },
+             { "mtracecap", 1, 0, 'x' },
+             { "help",      0, 0, 'h' },
+             { NULL,        0, 0, 0   },
+            };
+        int c = getopt_long(argc, argv, "n:p:r:m:f:j:o:d:kx:h", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c) {
+        case 'n':
+            opt_inputs = atoi(optarg);
+            break;
+        case 'p':
+            opt_packets = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            opt_rate = strtod(optarg, NULL);
+            break;
+        case 'm':
+            opt_mix = optarg;
+            break;
+        case 'f':
+            opt_flows = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            opt_jitter_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            opt_format = optarg;
+            break;
+        case 'd':
+            opt_dir = optarg;
+            break;
+        case 'k':
+            opt_keep = true;
+            break;
+        case 'x':
+            opt_mtracecap = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    mix_t mix;
+    if (opt_inputs < 1 || opt_packets == 0 || opt_rate <= 0 || opt_flows == 0 ||
+        opt_flows > (1 << 23) || !parse_mix(opt_mix, mix))
+        usage(argv[0]);
+
+    char dir[PATH_MAX];
+    if (opt_dir) {
+        snprintf(dir, sizeof(dir), "%s", opt_dir);
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "cannot create %s: %s\n", dir, strerror(errno));
+            return 1;
+        }
+    } else {
+        const char *tmp = getenv("TMPDIR");
+        snprintf(dir, sizeof(dir), "%s/mtcbench.XXXXXX", tmp ? tmp : "/tmp");
+        if (!mkdtemp(dir)) {
+            fprintf(stderr, "cannot create %s: %s\n", dir, strerror(errno));
+            return 1;
+        }
+    }
+    std::string out_dir = std::string(dir) + "/out";
+    std::string stats   = std::string(dir) + "/stats";
+    if (mkdir(out_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "cannot create %s: %s\n", out_dir.c_str(), strerror(errno));
+        return 1;
+    }
+
+    //timestamps start now, as a live capture would see them
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t start_us = (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+    std::vector<std::string> traces;
+    uint64_t offered_bytes = 0;
+    for (int i = 0; i < opt_inputs; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "/in%02d.pcap", i);
+        std::string path = std::string(dir) + name;
+        offered_bytes += generate(path.c_str(), i, opt_inputs, opt_packets, opt_rate, mix,
+                                  opt_flows, opt_jitter_us, start_us);
+        traces.push_back(std::string("pcapfile:") + path);
+    }
+    uint64_t offered = opt_packets*opt_inputs;
+
+    //mtracecap [user flags] --stats-file=... -B format:dir/out inputs...
+    std::vector<std::string> args;
+    args.push_back(opt_mtracecap);
+    for (int i = optind; i < argc; ++i)
+        args.push_back(argv[i]);
+    args.push_back("--stats-file=" + stats);
+    args.push_back("-B");
+    args.push_back(std::string(opt_format) + ":" + out_dir);
+    args.insert(args.end(), traces.begin(), traces.end());
+    std::vector<char *> cargs;
+    for (size_t i = 0; i < args.size(); ++i)
+        cargs.push_back(const_cast<char *>(args[i].c_str()));
+    cargs.push_back(0);
+
+    uint64_t t0 = monotonic_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "fork: %s\n", strerror(errno));
+        return 1;
+    }
+    if (pid == 0) {
+        execv(cargs[0], &cargs[0]);
+        fprintf(stderr, "cannot run %s: %s\n", cargs[0], strerror(errno));
+        _exit(127);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    double secs = (monotonic_ns() - t0)/1e9;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed (status %d), work directory %s kept\n",
+                cargs[0], status, dir);
+        return 1;
+    }
+
+    totals_t t;
+    if (!read_stats(stats.c_str(), t)) {
+        fprintf(stderr, "cannot read %s\n", stats.c_str());
+        return 1;
+    }
+    uint64_t missing = (offered > t.out_packets_) ? offered - t.out_packets_ : 0;
+    printf("inputs=%d offered_pps=%.0f offered_packets=%lu offered_bytes=%lu seconds=%.3f "
+           "read_packets=%lu written_packets=%lu written_bytes=%lu pps=%.0f Bps=%.0f "
+           "disorders=%lu out_disorders=%lu drops=%lu ring_drops=%lu late_drops=%lu "
+           "missing=%lu segments=%lu rotate_max_ms=%.3f\n",
+           opt_inputs, opt_rate*opt_inputs, (ulong)offered, (ulong)offered_bytes, secs,
+           (ulong)t.in_packets_, (ulong)t.out_packets_, (ulong)t.out_bytes_,
+           t.out_packets_/secs, t.out_bytes_/secs,
+           (ulong)t.disorders_, (ulong)t.out_disorders_, (ulong)t.drops_,
+           (ulong)t.ring_drops_, (ulong)t.late_drops_, (ulong)missing,
+           (ulong)t.segments_, t.rotate_ns_max_/1e6);
+
+    if (!opt_keep && !opt_dir) {
+        //only what mkdtemp() made, a -d directory may hold anything
+        if (nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0)
+            fprintf(stderr, "cannot remove %s: %s\n", dir, strerror(errno));
+    }
+    return missing ? 2 : 0;
+}
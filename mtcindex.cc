@@ -0,0 +1,292 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+/*
+ * Reads the <segment>.idx sidecar written with --index-ms and pulls a
+ * time range out of a segment, decompressing only the frames it spans.
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <vector>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "mtc_index.hh"
+
+static void
+usage(const char *prog) {
+    fprintf(stderr,
+            "%s [-x outfile] segment [from [to]]\n"
+            "    Lists the index of segment, or the part of it between the unix\n"
+            "    times from and to (seconds, fractions allowed)\n"
+            "[-x | --extract] outfile\n"
+            "    Write that part as a trace of its own ('-' for stdout)\n"
+            , prog);
+    exit(1);
+}
+
+static uint64_t
+parse_time(const char *s) {
+    char *end = 0;
+    double t = strtod(s, &end);
+    if (*end != '\0' || t < 0) {
+        fprintf(stderr, "bad time: %s\n", s);
+        exit(1);
+    }
+    uint64_t sec = (uint64_t)t;
+    return (sec << 32) + (uint64_t)((t - sec)*4294967296.0);
+}
+
+static void
+write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void
+read_at(int fd, char *buf, size_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+        if (n <= 0) {
+            fprintf(stderr, "segment truncated at %lu\n", (ulong)off);
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+}
+
+/* decompresses one frame into out, which holds frame.in_len_ bytes */
+static void
+inflate_frame(uint32_t codec, const char *in, const mtc_index_frame_t &frame, char *out) {
+    size_t got = 0;
+    switch (codec) {
+    case INDEX_CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+        got = ZSTD_decompress(out, frame.in_len_, in, frame.out_len_);
+        if (ZSTD_isError(got)) {
+            fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(got));
+            exit(1);
+        }
+#else
+        fprintf(stderr, "built without zstd support\n");
+        exit(1);
+#endif
+        break;
+    case INDEX_CODEC_LZ4:
+#ifdef HAVE_LZ4
+        {
+            LZ4F_dctx *dctx = 0;
+            if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+                fprintf(stderr, "lz4: cannot create context\n");
+                exit(1);
+            }
+            size_t src = 0;
+            while (src < frame.out_len_ && got < frame.in_len_) {
+                size_t dst_len = frame.in_len_ - got;
+                size_t src_len = frame.out_len_ - src;
+                size_t r = LZ4F_decompress(dctx, out + got, &dst_len,
+                                           in + src, &src_len, NULL);
+                if (LZ4F_isError(r)) {
+                    fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(r));
+                    exit(1);
+                }
+                got += dst_len;
+                src += src_len;
+                if (r == 0)
+                    break; //end of frame
+            }
+            LZ4F_freeDecompressionContext(dctx);
+        }
+#else
+        fprintf(stderr, "built without lz4 support\n");
+        exit(1);
+#endif
+        break;
+    }
+    if (got != frame.in_len_) {
+        fprintf(stderr, "frame at %lu decompressed to %lu bytes, expected %u\n",
+                (ulong)frame.out_off_, (ulong)got, frame.in_len_);
+        exit(1);
+    }
+}
+
+/* writes uncompressed bytes [lo, hi) of the trace to out */
+static void
+copy_range(int seg, int out, const mtc_index_hdr_t &hdr,
+           const std::vector<mtc_index_frame_t> &frames, uint64_t lo, uint64_t hi) {
+    if (lo >= hi)
+        return;
+    if (hdr.codec_ == INDEX_CODEC_NONE) {
+        std::vector<char> buf(1024*1024);
+        while (lo < hi) {
+            size_t len = (hi - lo < buf.size()) ? hi - lo : buf.size();
+            read_at(seg, &buf[0], len, lo);
+            write_all(out, &buf[0], len);
+            lo += len;
+        }
+        return;
+    }
+    std::vector<char> in, plain;
+    for (size_t i = 0; i < frames.size(); ++i) {
+        const mtc_index_frame_t &f = frames[i];
+        if (f.in_off_ + f.in_len_ <= lo)
+            continue;
+        if (f.in_off_ >= hi)
+            break;
+        in.resize(f.out_len_);
+        plain.resize(f.in_len_);
+        read_at(seg, &in[0], f.out_len_, f.out_off_);
+        inflate_frame(hdr.codec_, &in[0], f, &plain[0]);
+        uint64_t from = (lo > f.in_off_) ? lo - f.in_off_ : 0;
+        uint64_t to   = (hi < f.in_off_ + f.in_len_) ? hi - f.in_off_ : f.in_len_;
+        write_all(out, &plain[from], to - from);
+    }
+}
+
+int
+main(int argc, char *argv[]) {
+    const char *opt_extract = 0;
+    while (1) {
+        int option_index;
+        struct option long_options[] =
+            {
+             { "extract",        1, 0, 'x' },
+             { "help",           0, 0, 'h' },
+             { NULL,             0, 0, 0   },
+            };
+        int c = getopt_long(argc, argv, "hx:", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c) {
+        case 'x':
+            opt_extract = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc || argc - optind > 3)
+        usage(argv[0]);
+    const char *segment = argv[optind];
+
+    char idxpath[4096];
+    snprintf(idxpath, sizeof(idxpath), "%s" INDEX_EXT, segment);
+    mtc_index_hdr_t hdr;
+    std::vector<mtc_index_point_t> points;
+    std::vector<mtc_index_frame_t> frames;
+    if (!MTC_Index::read(idxpath, hdr, points, frames)) {
+        fprintf(stderr, "cannot read index %s\n", idxpath);
+        return 1;
+    }
+
+    if (argc - optind == 1) {
+        static const char *codecs[] = { "none", "zstd", "lz4", "other" };
+        char level[16] = "";
+        if (hdr.level_ >= 0)
+            snprintf(level, sizeof(level), ":%d", hdr.level_);
+        printf("packets=%lu, bytes=%lu, codec=%s%s, points=%lu, frames=%lu\n",
+               (ulong)hdr.packets_, (ulong)hdr.bytes_,
+               codecs[hdr.codec_ & 3], level, (ulong)hdr.points_, (ulong)hdr.frames_);
+        for (size_t i = 0; i < points.size(); ++i) {
+            printf("%lu.%06lu packet=%lu offset=%lu\n",
+                   (ulong)(points[i].ts_ >> 32),
+                   (ulong)(((points[i].ts_ & 0xffffffffULL)*1000000) >> 32),
+                   (ulong)points[i].packet_, (ulong)points[i].offset_);
+        }
+        return 0;
+    }
+
+    uint64_t from = parse_time(argv[optind+1]);
+    uint64_t to   = (argc - optind == 3) ? parse_time(argv[optind+2]) : (uint64_t)-1;
+    //last point at or before from, first point after to
+    size_t first = 0;
+    while (first + 1 < points.size() && points[first + 1].ts_ <= from)
+        ++first;
+    size_t last = first;
+    while (last < points.size() && points[last].ts_ <= to)
+        ++last;
+    if (points.empty() || first >= last) {
+        fprintf(stderr, "nothing in that range\n");
+        return 1;
+    }
+    uint64_t lo = points[first].offset_;
+    uint64_t hi = (last < points.size()) ? points[last].offset_ : hdr.bytes_;
+    uint64_t packets = ((last < points.size()) ? points[last].packet_ : hdr.packets_)
+        - points[first].packet_;
+
+    if (!opt_extract) {
+        printf("packets=%lu..%lu, bytes=%lu..%lu\n",
+               (ulong)points[first].packet_, (ulong)(points[first].packet_ + packets),
+               (ulong)lo, (ulong)hi);
+        return 0;
+    }
+    if (hdr.codec_ == INDEX_CODEC_OTHER) {
+        fprintf(stderr, "%s was compressed outside of mtracecap, offsets refer to "
+                "the decompressed trace\n", segment);
+        return 1;
+    }
+    int seg = open(segment, O_RDONLY);
+    if (seg < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", segment, strerror(errno));
+        return 1;
+    }
+    int out = STDOUT_FILENO;
+    if (strcmp(opt_extract, "-") != 0) {
+        out = open(opt_extract, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            fprintf(stderr, "cannot create %s: %s\n", opt_extract, strerror(errno));
+            return 1;
+        }
+    }
+    //pcap needs its file header in front of the records
+    copy_range(seg, out, hdr, frames, 0, hdr.data_start_);
+    copy_range(seg, out, hdr, frames, lo, hi);
+    close(seg);
+    if (out != STDOUT_FILENO)
+        close(out);
+    fprintf(stderr, "%lu packets, %lu bytes\n", (ulong)packets,
+            (ulong)(hi - lo + hdr.data_start_));
+    return 0;
+}
@@ -0,0 +1,342 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+
+/*
+ * Microbenchmarks of the merge and output hot paths. Every result is
+ * one CSV line (benchmark,variant,param,ops,ns_per_op) on stdout, so
+ * runs of two builds can be compared with a diff or a spreadsheet.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <libtrace.h>
+#include <string>
+
+#include "mtc_log.hh"
+#include "mtc_time.hh"
+#include "mtc_output.hh"
+#include "mtc_merge.hh"
+
+#define MICRO_PACKETS_DEFAULT   200000
+#define MICRO_ROTATIONS_DEFAULT 100
+#define MICRO_BATCH             32 //as the merge loop hands them to the output
+
+static void
+usage(const char *prog) {
+    fprintf(stderr,
+            "%s [flags]\n"
+            "    Times the merge and output hot paths, one CSV line per result\n"
+            "[-b | --bench] name\n"
+            "    Run only merge, write, rotate or spawn\n"
+            "[-n | --packets] packets\n"
+            "    Packets per merge/write run (default %d)\n"
+            "[-r | --rotations] count\n"
+            "    Segments opened and closed per format, and commands spawned (default %d)\n"
+            "[-d | --dir] dir\n"
+            "    Directory for the segment files (default: a new one under $TMPDIR)\n"
+            , prog, MICRO_PACKETS_DEFAULT, MICRO_ROTATIONS_DEFAULT);
+    exit(1);
+}
+
+static inline uint64_t
+next_rand(uint64_t &s) {
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return s*2685821657736338717ULL;
+}
+
+static void
+result(const char *bench, const char *variant, uint64_t param, uint64_t ops, uint64_t ns) {
+    printf("%s,%s,%lu,%lu,%.1f\n", bench, variant, (ulong)param, (ulong)ops,
+           ops ? (double)ns/ops : 0.0);
+    fflush(stdout);
+}
+
+/* gives the benchmark access to the spawning of --pipeout commands */
+class MTC_MicroOutput : public MTC_Output {
+public:
+    MTC_MicroOutput(char *basename, const timeval &now, const MTC_Log &log) :
+        MTC_Output(0, basename, now, log) {}
+    int spawn(int fdw) { return insert_pipe(fdw); }
+};
+
+static MTC_MicroOutput *
+make_output(const std::string &uri, const MTC_Log &log) {
+    timeval now;
+    gettimeofday(&now, 0);
+    //the uri is split in place and kept by the output
+    return new MTC_MicroOutput(strdup(uri.c_str()), now, log);
+}
+
+/* selecting the next packet: pop the oldest head, push its successor */
+static void
+bench_merge(uint64_t packets) {
+    for (size_t inputs = 1; inputs <= 256; inputs *= 2) {
+        MTC_Merge merge(inputs);
+        uint64_t *ts = new uint64_t[inputs];
+        uint64_t seed = 88172645463325252ULL;
+        for (size_t i = 0; i < inputs; ++i) {
+            ts[i] = next_rand(seed) & 0xffff;
+            merge.push(i, ts[i]);
+        }
+        uint64_t sum = 0;
+        uint64_t t0 = monotonic_ns();
+        for (uint64_t n = 0; n < packets; ++n) {
+            int idx = merge.pop();
+            sum += idx;
+            ts[idx] += 1 + (next_rand(seed) & 0xffff);
+            merge.push(idx, ts[idx]);
+        }
+        uint64_t ns = monotonic_ns() - t0;
+        if (sum == (uint64_t)-1) //keeps the loop from being optimized out
+            fprintf(stderr, "\n");
+        result("merge", "pop_push", inputs, packets, ns);
+        delete [] ts;
+    }
+}
+
+/* write_packet() and write_packets() into pcap segments, minimum size frames */
+static void
+bench_write(const std::string &dir, uint64_t packets, const MTC_Log &log) {
+    unsigned char frame[64];
+    memset(frame, 0, sizeof(frame));
+    frame[12] = 0x08;
+    frame[14] = 0x45;
+    libtrace_packet_t *pkts[MICRO_BATCH];
+    for (size_t k = 0; k < MICRO_BATCH; ++k) {
+        pkts[k] = trace_create_packet();
+        trace_construct_packet(pkts[k], TRACE_TYPE_ETH, frame, sizeof(frame));
+    }
+
+    struct variant_t {
+        const char *name_;
+        ulong       segmentsize_;
+        ulong       rotatesec_;
+        bool        batch_;
+    } variants[] = {
+        { "single",       0,           0, false },
+        { "batch",        0,           0, true  },
+        { "single_size",  1024*1024,   0, false },
+        { "batch_size",   1024*1024,   0, true  },
+        { "single_time",  0,           1, false },
+        { "batch_time",   0,           1, true  },
+    };
+    for (size_t v = 0; v < sizeof(variants)/sizeof(variants[0]); ++v) {
+        MTC_MicroOutput *o = make_output("pcapfile:" + dir, log);
+        o->set_close_queue(0); //closing is part of the cost
+        o->set_segmentsize(variants[v].segmentsize_);
+        o->set_rotatesec(variants[v].rotatesec_);
+        timeval now;
+        gettimeofday(&now, 0);
+        //time rotation: a new second every 10000 packets
+        uint64_t erf = (uint64_t)now.tv_sec << 32;
+        uint64_t step = variants[v].rotatesec_ ? (1ULL << 32)/10000 : 0;
+        uint64_t ts[MICRO_BATCH];
+
+        uint64_t t0 = monotonic_ns();
+        for (uint64_t n = 0; n < packets; n += MICRO_BATCH) {
+            for (size_t k = 0; k < MICRO_BATCH; ++k) {
+                erf += step;
+                ts[k] = erf;
+            }
+            if (variants[v].batch_) {
+                o->write_packets(pkts, ts, MICRO_BATCH);
+            } else {
+                for (size_t k = 0; k < MICRO_BATCH; ++k)
+                    o->write_packets(&pkts[k], &ts[k], 1);
+            }
+        }
+        o->close_trace();
+        uint64_t ns = monotonic_ns() - t0;
+        result("write", variants[v].name_, MICRO_BATCH,
+               (packets + MICRO_BATCH - 1)/MICRO_BATCH*MICRO_BATCH, ns);
+        delete o;
+    }
+    for (size_t k = 0; k < MICRO_BATCH; ++k)
+        trace_destroy_packet(pkts[k]);
+}
+
+/* open_trace() and close_trace() of empty segments, closed inline */
+static void
+bench_rotate(const std::string &dir, uint64_t rotations, const MTC_Log &log) {
+    static char *cat_argv[] = { (char *)"cat", 0 };
+    struct variant_t {
+        const char *name_;
+        const char *format_;
+        trace_option_compresstype_t compress_;
+        bool        pipeout_;
+    } variants[] = {
+        { "pcapfile",      "pcapfile", TRACE_OPTION_COMPRESSTYPE_NONE, false },
+        { "erf",           "erf",      TRACE_OPTION_COMPRESSTYPE_NONE, false },
+        { "pcapfile_gzip", "pcapfile", TRACE_OPTION_COMPRESSTYPE_ZLIB, false },
+        { "erf_gzip",      "erf",      TRACE_OPTION_COMPRESSTYPE_ZLIB, false },
+        { "pcapfile_pipe", "pcapfile", TRACE_OPTION_COMPRESSTYPE_NONE, true  },
+    };
+    for (size_t v = 0; v < sizeof(variants)/sizeof(variants[0]); ++v) {
+        MTC_MicroOutput *o = make_output(std::string(variants[v].format_) + ":" + dir, log);
+        o->set_close_queue(0);
+        o->set_compression(variants[v].compress_, -1);
+        if (variants[v].pipeout_)
+            o->set_pipeout(cat_argv);
+        uint64_t open_ns = 0, close_ns = 0;
+        for (uint64_t r = 0; r < rotations; ++r) {
+            timeval tv = { (time_t)(1000000000 + r), 0 };
+            uint64_t t0 = monotonic_ns();
+            o->open_trace(tv);
+            uint64_t t1 = monotonic_ns();
+            o->close_trace();
+            uint64_t t2 = monotonic_ns();
+            open_ns  += t1 - t0;
+            close_ns += t2 - t1;
+            if (variants[v].pipeout_)
+                while (waitpid(-1, 0, WNOHANG) > 0)
+                    ;
+        }
+        std::string name(variants[v].name_);
+        result("rotate", (name + "_open").c_str(), 0, rotations, open_ns);
+        result("rotate", (name + "_close").c_str(), 0, rotations, close_ns);
+        delete o;
+    }
+    while (waitpid(-1, 0, 0) > 0)
+        ;
+}
+
+/* forking a --pipeout command, and until it has exited again */
+static void
+bench_spawn(const std::string &dir, uint64_t count, const MTC_Log &log) {
+    static char *true_argv[] = { (char *)"true", 0 };
+    MTC_MicroOutput *o = make_output("pcapfile:" + dir, log);
+    o->set_pipeout(true_argv);
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    uint64_t spawn_ns = 0, total_ns = 0;
+    for (uint64_t n = 0; n < count; ++n) {
+        uint64_t t0 = monotonic_ns();
+        int fd = o->spawn(devnull);
+        uint64_t t1 = monotonic_ns();
+        close(fd);
+        while (waitpid(-1, 0, 0) < 0 && errno == EINTR)
+            ;
+        uint64_t t2 = monotonic_ns();
+        spawn_ns += t1 - t0;
+        total_ns += t2 - t0;
+    }
+    result("spawn", "insert_pipe", 0, count, spawn_ns);
+    result("spawn", "insert_pipe_exit", 0, count, total_ns);
+    close(devnull);
+    delete o;
+}
+
+/* nftw() callback, children come before their directory */
+static int
+remove_entry(const char *path, const struct stat *, int, struct FTW *) {
+    return ::remove(path);
+}
+
+int
+main(int argc, char *argv[]) {
+    const char *opt_bench = NULL;
+    uint64_t    opt_packets = MICRO_PACKETS_DEFAULT;
+    uint64_t    opt_rotations = MICRO_ROTATIONS_DEFAULT;
+    const char *opt_dir = NULL;
+
+    while (1) {
+        int option_index;
+        struct option long_options[] =
+            {
+             { "bench",     1, 0, 'b' },
+             { "packets",   1, 0, 'n' },
+             { "rotations", 1, 0, 'r' },
+             { "dir",       1, 0, 'd' },
+             { "help",      0, 0, 'h' },
+             { NULL,        0, 0, 0   },
+            };
+        int c = getopt_long(argc, argv, "b:n:r:d:h", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c) {
+        case 'b':
+            opt_bench = optarg;
+            break;
+        case 'n':
+            opt_packets = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            opt_rotations = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            opt_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || opt_packets == 0 || opt_rotations == 0)
+        usage(argv[0]);
+
+    std::string dir;
+    if (opt_dir) {
+        dir = opt_dir;
+        if (mkdir(opt_dir, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "cannot create %s: %s\n", opt_dir, strerror(errno));
+            return 1;
+        }
+    } else {
+        const char *tmp = getenv("TMPDIR");
+        std::string tmpl = std::string(tmp ? tmp : "/tmp") + "/mtcmicro.XXXXXX";
+        if (!mkdtemp(&tmpl[0])) {
+            fprintf(stderr, "cannot create %s: %s\n", tmpl.c_str(), strerror(errno));
+            return 1;
+        }
+        dir = tmpl;
+    }
+
+    MTC_Log log;
+    printf("benchmark,variant,param,ops,ns_per_op\n");
+    if (!opt_bench || strcmp(opt_bench, "merge") == 0)
+        bench_merge(opt_packets);
+    if (!opt_bench || strcmp(opt_bench, "write") == 0)
+        bench_write(dir, opt_packets, log);
+    if (!opt_bench || strcmp(opt_bench, "rotate") == 0)
+        bench_rotate(dir, opt_rotations, log);
+    if (!opt_bench || strcmp(opt_bench, "spawn") == 0)
+        bench_spawn(dir, opt_rotations, log);
+
+    if (!opt_dir) {
+        if (nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0)
+            fprintf(stderr, "cannot remove %s: %s\n", dir.c_str(), strerror(errno));
+    }
+    return 0;
+}
@@ -0,0 +1,250 @@
+/* -*-  Mode:C++; c-basic-offset:4; tab-width:4; indent-tabs-mode:nil -*- */
+/*
+ * Copyright (C) 2016-2019 by the University of Southern California
+ * $Id$
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+
+
+/*
+ * Reads the shared memory file published with --stats-file and prints
+ * per-input and per-output rates, without touching the capture.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <vector>
+
+#include "mtc_stats.hh"
+
+static void
+usage(const char *prog) {
+    fprintf(stderr,
+            "%s [-i seconds] [-c count] statsfile\n"
+            "    Prints rates from the file mtracecap publishes with --stats-file\n"
+            "[-i | --interval] seconds\n"
+            "    Time between reports (default 1)\n"
+            "[-c | --count] count\n"
+            "    Stop after this many reports, 1 prints the totals only (default: forever)\n"
+            , prog);
+    exit(1);
+}
+
+struct stats_map_t {
+    void            *map_;
+    size_t           size_;
+    ino_t            ino_;
+    const mtc_stats_hdr_t *hdr_;
+};
+
+static bool
+map_stats(const char *path, stats_map_t &m) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(mtc_stats_hdr_t)) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const mtc_stats_hdr_t *hdr = (const mtc_stats_hdr_t *)map;
+    if (memcmp(hdr->magic_, STATS_MAGIC, sizeof(hdr->magic_)) != 0 ||
+        hdr->version_ != STATS_VERSION ||
+        hdr->hdr_size_ + (size_t)hdr->inputs_*hdr->input_size_ +
+        (size_t)hdr->outputs_*hdr->output_size_ > (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    m.map_  = map;
+    m.size_ = st.st_size;
+    m.ino_  = st.st_ino;
+    m.hdr_  = hdr;
+    return true;
+}
+
+static void
+unmap_stats(stats_map_t &m) {
+    munmap(m.map_, m.size_);
+    m.map_ = 0;
+    m.hdr_ = 0;
+}
+
+/* strides come from the file, newer writers may have grown the slots */
+static const mtc_stats_input_t *
+input_at(const stats_map_t &m, size_t i) {
+    return (const mtc_stats_input_t *)((const char *)m.map_ + m.hdr_->hdr_size_ +
+                                       i*m.hdr_->input_size_);
+}
+
+static const mtc_stats_output_t *
+output_at(const stats_map_t &m, size_t i) {
+    return (const mtc_stats_output_t *)((const char *)m.map_ + m.hdr_->hdr_size_ +
+                                        (size_t)m.hdr_->inputs_*m.hdr_->input_size_ +
+                                        i*m.hdr_->output_size_);
+}
+
+static inline uint64_t
+ld(const mtc_counter_t &c) {
+    return c.load(std::memory_order_relaxed);
+}
+
+/* the counters of one report */
+struct snapshot_t {
+    uint64_t              ns_;
+    std::vector<uint64_t> in_;  //packets, bytes per input
+    std::vector<uint64_t> out_; //packets, bytes, spilled, drained per output
+};
+
+static void
+take_snapshot(const stats_map_t &m, snapshot_t &s) {
+    s.ns_ = ld(m.hdr_->updated_ns_);
+    s.in_.resize(2*m.hdr_->inputs_);
+    s.out_.resize(4*m.hdr_->outputs_);
+    for (size_t i = 0; i < m.hdr_->inputs_; ++i) {
+        s.in_[2*i]   = ld(input_at(m, i)->packets_);
+        s.in_[2*i+1] = ld(input_at(m, i)->bytes_);
+    }
+    for (size_t i = 0; i < m.hdr_->outputs_; ++i) {
+        s.out_[4*i]   = ld(output_at(m, i)->packets_);
+        s.out_[4*i+1] = ld(output_at(m, i)->bytes_);
+        s.out_[4*i+2] = ld(output_at(m, i)->spilled_);
+        s.out_[4*i+3] = ld(output_at(m, i)->drained_);
+    }
+}
+
+static void
+report(const stats_map_t &m, const snapshot_t &prev, const snapshot_t &cur, bool totals) {
+    double secs = (cur.ns_ > prev.ns_) ? (cur.ns_ - prev.ns_)/1e9 : 0;
+    printf("pid %lu, updated %.3f\n", (ulong)m.hdr_->pid_, cur.ns_/1e9);
+    for (size_t i = 0; i < m.hdr_->inputs_; ++i) {
+        const mtc_stats_input_t *in = input_at(m, i);
+        printf("  input %lu %.*s: packets %lu, drops %lu, ring drops %lu, late %lu, dups %lu, "
+               "disorders %lu",
+               (ulong)i, (int)sizeof(in->uri_), in->uri_, (ulong)cur.in_[2*i],
+               (ulong)ld(in->drops_), (ulong)ld(in->ring_drops_),
+               (ulong)ld(in->late_drops_), (ulong)ld(in->dup_drops_),
+               (ulong)ld(in->disorders_));
+        if (!totals && secs > 0)
+            printf(", %.0f pps, %.1f Mbit/s",
+                   (cur.in_[2*i] - prev.in_[2*i])/secs,
+                   (cur.in_[2*i+1] - prev.in_[2*i+1])*8/secs/1e6);
+        printf("\n");
+    }
+    for (size_t i = 0; i < m.hdr_->outputs_; ++i) {
+        const mtc_stats_output_t *out = output_at(m, i);
+        printf("  output %lu %.*s: packets %lu, segments %lu, rotate %.3fms (max %.3fms), backlog %lu, "
+               "gated %.3fs (%lu packets)",
+               (ulong)i, (int)sizeof(out->name_), out->name_, (ulong)cur.out_[4*i],
+               (ulong)ld(out->segments_), ld(out->rotate_ns_last_)/1e6,
+               ld(out->rotate_ns_max_)/1e6, (ulong)ld(out->backlog_),
+               ld(out->gated_ns_)/1e9, (ulong)ld(out->gated_packets_));
+        if (ld(out->level_))
+            printf(", level %lu", (ulong)ld(out->level_) - 1);
+        if (cur.out_[4*i+2])
+            printf(", spool %.1fMB, spilled %lu, drained %lu",
+                   ld(out->spool_used_)/1048576.0, (ulong)cur.out_[4*i+2],
+                   (ulong)cur.out_[4*i+3]);
+        if (!totals && secs > 0)
+            printf(", %.0f pps, %.1f Mbit/s",
+                   (cur.out_[4*i] - prev.out_[4*i])/secs,
+                   (cur.out_[4*i+1] - prev.out_[4*i+1])*8/secs/1e6);
+        if (!totals && secs > 0 && cur.out_[4*i+2])
+            printf(", spill %.0f pps, drain %.0f pps",
+                   (cur.out_[4*i+2] - prev.out_[4*i+2])/secs,
+                   (cur.out_[4*i+3] - prev.out_[4*i+3])/secs);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+int
+main(int argc, char *argv[]) {
+    double opt_interval = 1;
+    long   opt_count = 0;
+
+    while (1) {
+        struct option long_options[] =
+            {
+             { "interval", 1, 0, 'i' },
+             { "count",    1, 0, 'c' },
+             { "help",     0, 0, 'h' },
+             { NULL,       0, 0, 0   },
+            };
+        int c = getopt_long(argc, argv, "i:c:h", long_options, NULL);
+        if (c == -1)
+            break;
+        switch (c) {
+        case 'i':
+            opt_interval = strtod(optarg, NULL);
+            if (opt_interval <= 0)
+                usage(argv[0]);
+            break;
+        case 'c':
+            opt_count = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc)
+        usage(argv[0]);
+    const char *path = argv[optind];
+
+    stats_map_t m;
+    if (!map_stats(path, m)) {
+        fprintf(stderr, "%s: not a stats file (version %d)\n", path, STATS_VERSION);
+        return 1;
+    }
+    snapshot_t prev, cur;
+    take_snapshot(m, cur);
+    if (opt_count == 1) {
+        report(m, cur, cur, true);
+        unmap_stats(m);
+        return 0;
+    }
+    for (long n = 0; opt_count <= 0 || n < opt_count; ++n) {
+        prev = cur;
+        usleep((useconds_t)(opt_interval*1e6));
+        //a restarted mtracecap creates a new file under the same name
+        struct stat st;
+        if (stat(path, &st) == 0 && st.st_ino != m.ino_) {
+            stats_map_t next;
+            if (map_stats(path, next)) {
+                unmap_stats(m);
+                m = next;
+                take_snapshot(m, prev);
+            }
+        }
+        take_snapshot(m, cur);
+        report(m, prev, cur, false);
+    }
+    unmap_stats(m);
+    return 0;
+}
@@ -20,6 +20,7 @@
 
 #include <cassert>
 #include <libtrace.h>
+#include <libtrace_parallel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
@@ -30,17 +31,42 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
 #include <grp.h>
 #include <pwd.h>
+#include <vector>
 
 #include "mtc_log.hh"
 #include "mtc_output.hh"
+#include "mtc_capture.hh"
+#include "mtc_merge.hh"
+#include "mtc_poller.hh"
+#include "mtc_pool.hh"
+#include "mtc_reorder.hh"
+#include "mtc_finalizer.hh"
+#include "mtc_compress.hh"
+#include "mtc_shard.hh"
+#include "mtc_stats.hh"
+#include "mtc_latency.hh"
+#include "mtc_parallel.hh"
+#include "mtc_affinity.hh"
+#include "mtc_slice.hh"
+#include "mtc_dedup.hh"
+#include "mtc_tee.hh"
+#include "mtc_watch.hh"
+#include "mtc_spool.hh"
 
-#define MAXWAIT_MS 1 
+#define MAXWAIT_MS 1000
+#define RING_IDLE_US 50
+#define GATE_DRAIN_MS 10 //-W: emptying capture rings while the inputs pause
+#define SPOOL_DRAIN_MS 10 //--spool: idle wait while packets are spooled
+#define POLL_PACKETS 16 //packets written between non-blocking polls of parked inputs
+#define WRITE_BATCH  32 //merged packets handed to the output at once
+#define INPUT_QUEUES_MAX 64
 
 static void usage(char *prog) {
     fprintf(stderr,"Usage:\n"
@@ -57,30 +83,92 @@ static void usage(char *prog) {
             "    Rotate output every so often, even if there are no packets\n"
             "[-S | --rotate-sizemb] sizeMB\n"
             "    Rotate output when it exceeds sizeMB\n"
+            "[-N | --seqfile] filename\n"
+            "    Keep the segment journal, and with it the sequence number, in filename\n"
             "[-H | --libtrace-help]\n"
             "    Print libtrace runtime documentation\n"
             "[-h | --help]\n"
             "    Print this help\n"
             "[-s | --snaplen] bytes\n"
-            "    Capture this much of a packet\n"
+            "    Capture this much of a packet (default 64, or %d more than --slice-payload)\n"
             "[-U | --use-utc]\n"
             "    Use UTC in timestamping files\n"
             "[-v | --verbose]\n"
             "    Verbose output on stderr\n"
             "[-W | --watchfile] filename\n"
-            "    Wait until the watchfile is created before proceeding with next segment\n"
+            "    Pause capture before the next segment until the watchfile exists\n"
             "[-w | --maxwait_ms] wait_ms\n"
+            "    Longest time to sleep while all inputs are idle (default %d)\n"
             "[-z | --compress-level] level\n"
             "    Sets compression level of output\n"
             "[-Z | --compress-type] type\n"
-            "    Sets compression type\n"
+            "    Sets compression type (zstd and lz4 run in-process on worker threads)\n"
+            "[--adapt-level=<min>:<max>]\n"
+            "    Choose the -Z level of every segment within <min>:<max> from drops, backlog and CPU\n"
             "[--file-ext=<extension>]\n"
             "    Sets output file extension (used with -B)\n"
             "[--relinquish-privileges=<username>]\n"
             "    Run capture as <username>\n"
             "[--pipeout=<command>]\n"
             "    Pipe output through <command> first\n"
-            , prog, prog);
+            "[--capture-threads]\n"
+            "    Capture every input on its own thread\n"
+            "[--ring-size=<packets>]\n"
+            "    Per-input ring size used with --capture-threads (default %d)\n"
+            "[--packet-pool=<packets>]\n"
+            "    Number of preallocated packets (default %d, or enough for all rings)\n"
+            "[--pool-hugepages]\n"
+            "    Back pooled packet buffers with hugepages (copying input formats only)\n"
+            "[--reorder-us=<usec>]\n"
+            "    Hold packets up to <usec> to write them strictly in timestamp order\n"
+            "[--reorder-max=<packets>]\n"
+            "    Most packets held for reordering (default %d)\n"
+            "[--close-queue=<segments>]\n"
+            "    Segments waiting to be closed in the background (default %d, 0 closes inline)\n"
+            "[--compress-threads=<threads>]\n"
+            "    Worker threads for zstd/lz4 compression (default: online CPUs)\n"
+            "[--compress-block=<KB>]\n"
+            "    Size of independently compressed zstd/lz4 blocks (default %d)\n"
+            "[--preopen]\n"
+            "    Open the next segment in the background ahead of rotation (used with -B)\n"
+            "[--direct-io]\n"
+            "    Write segment files with O_DIRECT, bypassing the page cache\n"
+            "[--shards=<count>]\n"
+            "    Spread flows over <count> outputs written in parallel (used with -B)\n"
+            "[--index-ms=<msec>]\n"
+            "    Write a <segment>.idx time index with a point every <msec> (read with mtcindex)\n"
+            "[--stats-file=<path>]\n"
+            "    Publish live counters in a shared memory file (read with mtcstats)\n"
+            "[--latency-sample=<packets>]\n"
+            "    Time one in <packets> packets from capture through the pipeline (-v reports)\n"
+            "[--input-queues=<queues>]\n"
+            "    Read every input's receive queues on <queues> threads (libtrace parallel API)\n"
+            "[--cpu-capture=<cpus>]\n"
+            "    Pin capture of input <n> to the <n>-th CPU of a list like 0-3,8\n"
+            "[--cpu-merge=<cpus>]\n"
+            "    Pin the merging thread to <cpus>\n"
+            "[--cpu-compress=<cpus>]\n"
+            "    Pin compressor workers and --pipeout commands to <cpus>\n"
+            "[--cpu-writer=<cpus>]\n"
+            "    Pin threads that write, open and close segments to <cpus>\n"
+            "[--numa-local]\n"
+            "    Capture on, and allocate packet buffers on, the NUMA node of each input's NIC\n"
+            "[--slice-payload=<bytes>]\n"
+            "    Cut packets after their headers, tunnels included, plus <bytes> of payload\n"
+            "[--dedup-us=<usec>]\n"
+            "    Drop packets already seen on another input within <usec>\n"
+            "[--dedup-mem=<MB>]\n"
+            "    Memory for remembering packets with --dedup-us (default %d)\n"
+            "[--sink=base=<baseuri>[,snaplen=<bytes>][,rotate=<sec>][,size=<MB>]\n"
+            "        [,compress=<type>[:<level>]][,filter=<bpf>]]\n"
+            "    Also write the capture to <baseuri>, with its own settings; filter goes last\n"
+            "[--spool=<file>]\n"
+            "    Spill packets to a ring in <file> while the output pipe is backlogged\n"
+            "[--spool-size=<MB>]\n"
+            "    Size of the --spool file (default %d)\n"
+            , prog, prog, SLICE_HEADROOM, MAXWAIT_MS, CAPTURE_RING_DEFAULT, PACKET_POOL_DEFAULT,
+            REORDER_MAX_DEFAULT, CLOSE_QUEUE_DEFAULT, COMPRESS_BLOCK_DEFAULT/1024,
+            DEDUP_MEM_DEFAULT, SPOOL_SIZE_DEFAULT);
     exit(1);
 }
 
@@ -97,13 +185,284 @@ static void cleanup_signal(int sig) {
 }
 
 
-//struct time_order {
-//    bool operator() (const libtrace_packet_t * lhs,
-//                     const libtrace_packet_t * rhs) const {
-//        return (trace_get_erf_timestamp(lhs) > trace_get_erf_timestamp(rhs));
-//    };
-//};
+/* per-input accounting of a packet that became the input's head */
+static inline void
+account_packet(MTC_Input &in, int idx, libtrace_packet_t *p, uint64_t ts,
+               const MTC_Log &log) {
+    ++in.total_packets_;
+    ++in.segment_packets_;
+    if (in.lat_dequeue_ && in.lat_dequeue_->due())
+        in.lat_dequeue_->record_age(ts);
+    if (in.stats_) {
+        mtc_stat_add(in.stats_->packets_, 1);
+        mtc_stat_add(in.stats_->bytes_, trace_get_capture_length(p));
+    }
+    if (in.prev_ts_ > ts) {
+        if (in.stats_)
+            mtc_stat_add(in.stats_->disorders_, 1);
+        log.warn("disorder on input %d: %.6f, packet: %llu\n",
+                 idx,
+                 (double)(in.prev_ts_-ts)/(1ULL<<32),
+                 in.total_packets_);
+    }
+    in.prev_ts_ = ts;
+}
+
+/* counters that are kept elsewhere, copied about once a second */
+static void
+refresh_stats(MTC_Stats *stats, MTC_Input *in, int inputs) {
+    for (int i = 0; i < inputs; ++i) {
+        if (!in[i].active_)
+            continue;
+        mtc_stat_set(in[i].stats_->drops_, in[i].dropped());
+        mtc_stat_set(in[i].stats_->ring_drops_, in[i].ring_drops_.load());
+        mtc_stat_set(in[i].stats_->late_drops_, in[i].late_drops_);
+    }
+    stats->touch();
+}
+
+/* --adapt-level with shards or sinks: their threads cannot ask the
+ * inputs, so the merger sums up the drops for them */
+static void
+publish_drops(MTC_Input *in, int inputs, std::atomic<uint64_t> &drops) {
+    uint64_t sum = 0;
+    for (int i = 0; i < inputs; ++i)
+        sum += in[i].dropped() + in[i].ring_drops_.load(std::memory_order_relaxed);
+    drops.store(sum, std::memory_order_relaxed);
+}
+
+/* inputs the merger reads itself; capture threads and receive queues
+ * sample their own */
+static void
+sample_drops(MTC_Input *in, int inputs) {
+    for (int i = 0; i < inputs; ++i) {
+        if (!in[i].capture_ && in[i].queue_ < 0)
+            in[i].update_drops();
+    }
+}
+
+/* gives a packet back to where the input got it from */
+static inline void
+release_packet(MTC_Input &in, libtrace_packet_t *p, MTC_PacketPool *pool) {
+    if (in.capture_) {
+        in.capture_->recycle(p);
+    } else {
+        pool->put(p);
+    }
+}
+
+/* merged packets on their way to the output, in write order */
+struct emit_batch_t {
+    libtrace_packet_t *pkts_[WRITE_BATCH];
+    uint64_t           ts_[WRITE_BATCH];
+    int                idx_[WRITE_BATCH];
+    size_t             cnt_;
+    MTC_ShardSet      *shards_; //set with --shards, packets go there instead
+    MTC_Tee           *tee_;    //set with --sink, likewise
+    MTC_Spool         *spool_;  //set with --spool
+};
+
+struct release_ctx_t {
+    MTC_Input      *in_;
+    MTC_PacketPool *pool_;
+};
+
+/* MTC_ShardSet::release_t */
+static void
+release_written(void *arg, int idx, libtrace_packet_t *p) {
+    release_ctx_t *ctx = static_cast<release_ctx_t*>(arg);
+    release_packet(ctx->in_[idx], p, ctx->pool_);
+}
+
+/* spooled packets go to the output while it keeps up, a batch
+ * regardless with force */
+static void
+drain_spool(MTC_Output *tco, MTC_Spool &spool, bool force) {
+    libtrace_packet_t *pkts[SPOOL_BATCH];
+    uint64_t           ts[SPOOL_BATCH];
+    while (!spool.empty() && (force || !tco->backlogged())) {
+        size_t cnt = spool.peek(pkts, ts, SPOOL_BATCH);
+        tco->write_packets(pkts, ts, cnt);
+        spool.release(cnt);
+        if (force)
+            break;
+    }
+}
+
+static void
+flush_batch(MTC_Output *tco, emit_batch_t &b, MTC_Input *in, MTC_PacketPool *pool) {
+    if (b.shards_) {
+        b.shards_->reclaim_all();
+        return;
+    }
+    if (b.tee_) {
+        b.tee_->reclaim_all();
+        return;
+    }
+    if (b.spool_ && !b.spool_->empty())
+        drain_spool(tco, *b.spool_, false);
+    if (b.cnt_ == 0)
+        return;
+    if (b.spool_ && (!b.spool_->empty() || tco->backlogged())) {
+        //behind what is spooled already, or the output would block
+        for (size_t k = 0; k < b.cnt_; ++k) {
+            while (!b.spool_->spill(b.pkts_[k], b.ts_[k]))
+                drain_spool(tco, *b.spool_, true); //full, wait for the output after all
+        }
+    } else {
+        //rotation, by time or size, is up to the output
+        tco->write_packets(b.pkts_, b.ts_, b.cnt_);
+    }
+    for (size_t k = 0; k < b.cnt_; ++k)
+        release_packet(in[b.idx_[k]], b.pkts_[k], pool);
+    b.cnt_ = 0;
+}
+
+static inline void
+emit_packet(MTC_Output *tco, emit_batch_t &b, MTC_Input *in, int idx,
+            libtrace_packet_t *p, uint64_t ts, MTC_PacketPool *pool) {
+    if (b.shards_) {
+        b.shards_->dispatch(p, ts, idx);
+        return;
+    }
+    if (b.tee_) {
+        b.tee_->dispatch(p, ts, idx);
+        return;
+    }
+    b.pkts_[b.cnt_] = p;
+    b.ts_[b.cnt_]   = ts;
+    b.idx_[b.cnt_]  = idx;
+    if (++b.cnt_ == WRITE_BATCH)
+        flush_batch(tco, b, in, pool);
+}
+
+/* --pool-hugepages: formats that read into the buffer of the packet
+ * they are given. Everything else, dag:, xdp:, pfring, dpdk, ring:
+ * among them, may point packets into its own memory and is left alone.
+ * URIs without a format are files, which libtrace reads by copying. */
+static bool
+copies_packets(const char *uri) {
+    static const char *copying[] = { "erf:", "pcapfile:", "pcap:", "pcapint:",
+                                     "int:", "tsh:" };
+    if (!strchr(uri, ':'))
+        return true;
+    for (size_t k = 0; k < sizeof(copying)/sizeof(copying[0]); ++k) {
+        if (strncmp(uri, copying[k], strlen(copying[k])) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* -W: no output has a segment to write to */
+static bool
+outputs_gated(MTC_Output * const *outs, size_t cnt) {
+    for (size_t s = 0; s < cnt; ++s) {
+        if (!outs[s]->gated())
+            return false;
+    }
+    return true;
+}
+
+/* stops or restarts every active input while -W holds the outputs */
+static void
+pause_inputs(MTC_Input *in, int inputs, MTC_ParallelInput **parallel, int uris,
+             MTC_Poller &poller, bool pause) {
+    if (parallel) {
+        for (int u = 0; u < uris; ++u) {
+            if (pause)
+                parallel[u]->pause();
+            else
+                parallel[u]->resume();
+        }
+        return;
+    }
+    for (int i = 0; i < inputs; ++i) {
+        if (!in[i].active_)
+            continue;
+        if (in[i].capture_) {
+            in[i].capture_->pause(pause); //the thread does the rest
+        } else if (pause) {
+            poller.forget(i); //its fd goes away with the pause
+            if (trace_pause(in[i].in_) == -1)
+                trace_perror(in[i].in_, "trace_pause");
+        } else if (trace_start(in[i].in_) == -1) {
+            trace_perror(in[i].in_, "trace_start");
+            exit(1);
+        }
+    }
+}
 
+/* one --sink */
+struct sink_opt_t {
+    char       *basename_;
+    const char *filter_;
+    ulong       snaplen_;
+    ulong       rotatesec_;
+    ulong       segmentsize_; //MB
+    const char *compress_type_;
+    int         compress_level_;
+};
+
+/* libtrace's own compression, by -Z name */
+static bool
+parse_compress_type(const char *name, trace_option_compresstype_t &type) {
+    if (strncmp(name, "gz", 2) == 0 ||
+        strncmp(name, "zlib", 4) == 0) {
+        type = TRACE_OPTION_COMPRESSTYPE_ZLIB;
+    } else if (strncmp(name, "bz", 2) == 0) {
+        type = TRACE_OPTION_COMPRESSTYPE_BZ2;
+    } else if (strncmp(name, "lzo", 3) == 0) {
+        type = TRACE_OPTION_COMPRESSTYPE_LZO;
+    } else if (strncmp(name, "xz", 2) == 0) {
+        type = TRACE_OPTION_COMPRESSTYPE_LZMA;
+    } else if (strncmp(name, "no", 2) == 0) {
+        type = TRACE_OPTION_COMPRESSTYPE_NONE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* key=value,... in place; filter= takes the rest, commas included */
+static bool
+parse_sink(char *spec, sink_opt_t &sink) {
+    memset(&sink, 0, sizeof(sink));
+    sink.compress_level_ = -1;
+    char *s = spec;
+    while (s && *s) {
+        char *val = strchr(s, '=');
+        if (!val)
+            return false;
+        *val++ = '\0';
+        if (strcmp(s, "filter") == 0) {
+            sink.filter_ = val;
+            break;
+        }
+        char *next = strchr(val, ',');
+        if (next)
+            *next++ = '\0';
+        if (strcmp(s, "base") == 0) {
+            sink.basename_ = val;
+        } else if (strcmp(s, "snaplen") == 0) {
+            sink.snaplen_ = strtoul(val, NULL, 10);
+        } else if (strcmp(s, "rotate") == 0) {
+            sink.rotatesec_ = strtoul(val, NULL, 10);
+        } else if (strcmp(s, "size") == 0) {
+            sink.segmentsize_ = strtoul(val, NULL, 10);
+        } else if (strcmp(s, "compress") == 0) {
+            char *level = strchr(val, ':');
+            if (level) {
+                *level++ = '\0';
+                sink.compress_level_ = atoi(level);
+            }
+            sink.compress_type_ = val;
+        } else {
+            return false;
+        }
+        s = next;
+    }
+    return sink.basename_ != 0 && *sink.basename_ != '\0';
+}
 
 static const char * opt_seqnumfile = 0;
 static const char * opt_pipe_arg[1024];
@@ -116,7 +475,9 @@ main(int argc, char *argv[]) {
     trace_option_compresstype_t compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
     int         opt_compress_level = -1;
     const char *opt_compress_type = NULL;
-    int         opt_snaplen = 64;
+    int         opt_adapt_min = -1;
+    int         opt_adapt_max = -1;
+    int         opt_snaplen = -1;
     const char *opt_watchfile = NULL;
     const char *opt_relinquish = NULL;
     const char *opt_extension = NULL;
@@ -128,14 +489,62 @@ main(int argc, char *argv[]) {
     ulong       opt_maxwait = MAXWAIT_MS;
     int         opt_verbose = MTC_Log::LOG_LEVEL_PANIC;
     bool        opt_useutc = false;
+    bool        opt_capture_threads = false;
+    ulong       opt_ringsize = CAPTURE_RING_DEFAULT;
+    ulong       opt_poolsize = 0;
+    bool        opt_pool_hugepages = false;
+    ulong       opt_reorder_us = 0;
+    ulong       opt_reorder_max = REORDER_MAX_DEFAULT;
+    ulong       opt_close_queue = CLOSE_QUEUE_DEFAULT;
+    ulong       opt_compress_threads = 0;
+    ulong       opt_compress_block = COMPRESS_BLOCK_DEFAULT/1024;
+    bool        opt_preopen = false;
+    bool        opt_direct_io = false;
+    ulong       opt_shards = 0;
+    ulong       opt_index_ms = 0;
+    const char *opt_stats_file = NULL;
+    ulong       opt_latency_sample = 0;
+    ulong       opt_input_queues = 0;
+    bool        opt_numa_local = false;
+    long        opt_slice_payload = -1;
+    ulong       opt_dedup_us = 0;
+    ulong       opt_dedup_mem = DEDUP_MEM_DEFAULT;
+    const char *opt_spool = NULL;
+    ulong       opt_spool_size = SPOOL_SIZE_DEFAULT;
+    sink_opt_t  opt_sinks[TEE_SINKS_MAX];
+    size_t      opt_sinks_cnt = 0;
 
-    //    uint64_t total_packets = 0;
-    //std::priority_queue<struct libtrace_packet_t *,
-    //                    std::vector<struct libtrace_packet_t *>,
-    //                    time_order > pqueue;
 #define OPT_RELINQUISH_PRIVS    0x01f0
 #define OPT_PIPEOUT             0x01f1
 #define OPT_FILE_EXT            0x01f2
+#define OPT_CAPTURE_THREADS     0x01f3
+#define OPT_RING_SIZE           0x01f4
+#define OPT_PACKET_POOL         0x01f5
+#define OPT_POOL_HUGEPAGES      0x01f6
+#define OPT_REORDER_US          0x01f7
+#define OPT_REORDER_MAX         0x01f8
+#define OPT_CLOSE_QUEUE         0x01f9
+#define OPT_COMPRESS_THREADS    0x01fa
+#define OPT_COMPRESS_BLOCK      0x01fb
+#define OPT_PREOPEN             0x01fc
+#define OPT_DIRECT_IO           0x01fd
+#define OPT_SHARDS              0x01fe
+#define OPT_INDEX_MS            0x01ff
+#define OPT_STATS_FILE          0x0200
+#define OPT_LATENCY_SAMPLE      0x0201
+#define OPT_INPUT_QUEUES        0x0202
+#define OPT_CPU_CAPTURE         0x0203
+#define OPT_CPU_MERGE           0x0204
+#define OPT_CPU_COMPRESS        0x0205
+#define OPT_CPU_WRITER          0x0206
+#define OPT_NUMA_LOCAL          0x0207
+#define OPT_SLICE_PAYLOAD       0x0208
+#define OPT_DEDUP_US            0x0209
+#define OPT_DEDUP_MEM           0x020a
+#define OPT_SINK                0x020b
+#define OPT_SPOOL               0x020c
+#define OPT_SPOOL_SIZE          0x020d
+#define OPT_ADAPT_LEVEL         0x020e
     while (1) {
         int option_index;
         struct option long_options[] =
@@ -158,6 +567,34 @@ main(int argc, char *argv[]) {
                1, 0, OPT_RELINQUISH_PRIVS },
              { "pipeout",        1, 0, OPT_PIPEOUT },
              { "file-ext",       1, 0, OPT_FILE_EXT },
+             { "capture-threads",0, 0, OPT_CAPTURE_THREADS },
+             { "ring-size",      1, 0, OPT_RING_SIZE },
+             { "packet-pool",    1, 0, OPT_PACKET_POOL },
+             { "pool-hugepages", 0, 0, OPT_POOL_HUGEPAGES },
+             { "reorder-us",     1, 0, OPT_REORDER_US },
+             { "reorder-max",    1, 0, OPT_REORDER_MAX },
+             { "close-queue",    1, 0, OPT_CLOSE_QUEUE },
+             { "compress-threads",1, 0, OPT_COMPRESS_THREADS },
+             { "compress-block", 1, 0, OPT_COMPRESS_BLOCK },
+             { "preopen",        0, 0, OPT_PREOPEN },
+             { "direct-io",      0, 0, OPT_DIRECT_IO },
+             { "shards",         1, 0, OPT_SHARDS },
+             { "index-ms",       1, 0, OPT_INDEX_MS },
+             { "stats-file",     1, 0, OPT_STATS_FILE },
+             { "latency-sample", 1, 0, OPT_LATENCY_SAMPLE },
+             { "input-queues",   1, 0, OPT_INPUT_QUEUES },
+             { "cpu-capture",    1, 0, OPT_CPU_CAPTURE },
+             { "cpu-merge",      1, 0, OPT_CPU_MERGE },
+             { "cpu-compress",   1, 0, OPT_CPU_COMPRESS },
+             { "cpu-writer",     1, 0, OPT_CPU_WRITER },
+             { "numa-local",     0, 0, OPT_NUMA_LOCAL },
+             { "slice-payload",  1, 0, OPT_SLICE_PAYLOAD },
+             { "dedup-us",       1, 0, OPT_DEDUP_US },
+             { "dedup-mem",      1, 0, OPT_DEDUP_MEM },
+             { "sink",           1, 0, OPT_SINK },
+             { "spool",          1, 0, OPT_SPOOL },
+             { "spool-size",     1, 0, OPT_SPOOL_SIZE },
+             { "adapt-level",    1, 0, OPT_ADAPT_LEVEL },
              { NULL,             0, 0, 0   },
             };
 
@@ -235,6 +672,134 @@ main(int argc, char *argv[]) {
         case OPT_FILE_EXT:
             opt_extension = optarg;
             break;
+        case OPT_CAPTURE_THREADS:
+            opt_capture_threads = true;
+            break;
+        case OPT_RING_SIZE:
+            opt_ringsize = strtoul(optarg, NULL, 10);
+            if (opt_ringsize == 0) {
+                fprintf(stderr,"Ring size must be positive\n");
+                usage(argv[0]);
+            }
+            break;
+        case OPT_PACKET_POOL:
+            opt_poolsize = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_POOL_HUGEPAGES:
+            opt_pool_hugepages = true;
+            break;
+        case OPT_REORDER_US:
+            opt_reorder_us = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_REORDER_MAX:
+            opt_reorder_max = strtoul(optarg, NULL, 10);
+            if (opt_reorder_max == 0) {
+                fprintf(stderr,"Reorder buffer must hold at least one packet\n");
+                usage(argv[0]);
+            }
+            break;
+        case OPT_CLOSE_QUEUE:
+            opt_close_queue = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_COMPRESS_THREADS:
+            opt_compress_threads = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_COMPRESS_BLOCK:
+            opt_compress_block = strtoul(optarg, NULL, 10);
+            if (opt_compress_block == 0) {
+                fprintf(stderr,"Compression block must be at least 1KB\n");
+                usage(argv[0]);
+            }
+            break;
+        case OPT_PREOPEN:
+            opt_preopen = true;
+            break;
+        case OPT_DIRECT_IO:
+            opt_direct_io = true;
+            break;
+        case OPT_INDEX_MS:
+            opt_index_ms = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_STATS_FILE:
+            opt_stats_file = optarg;
+            break;
+        case OPT_LATENCY_SAMPLE:
+            opt_latency_sample = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_INPUT_QUEUES:
+            opt_input_queues = strtoul(optarg, NULL, 10);
+            if (opt_input_queues > INPUT_QUEUES_MAX) {
+                fprintf(stderr,"At most %d input queues are supported\n", INPUT_QUEUES_MAX);
+                usage(argv[0]);
+            }
+            break;
+        case OPT_CPU_CAPTURE:
+        case OPT_CPU_MERGE:
+        case OPT_CPU_COMPRESS:
+        case OPT_CPU_WRITER: {
+            MTC_Affinity::role_t role = (MTC_Affinity::role_t)
+                (MTC_Affinity::ROLE_CAPTURE + (c - OPT_CPU_CAPTURE));
+            if (!MTC_Affinity::set_cpus(role, optarg)) {
+                fprintf(stderr,"Bad CPU list for %s: %s\n",
+                        MTC_Affinity::role_name(role), optarg);
+                usage(argv[0]);
+            }
+            break;
+        }
+        case OPT_NUMA_LOCAL:
+            opt_numa_local = true;
+            break;
+        case OPT_SLICE_PAYLOAD:
+            opt_slice_payload = atol(optarg);
+            if (opt_slice_payload < 0 || opt_slice_payload > LIBTRACE_PACKET_BUFSIZE) {
+                fprintf(stderr,"Bad --slice-payload: %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case OPT_DEDUP_US:
+            opt_dedup_us = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_DEDUP_MEM:
+            opt_dedup_mem = strtoul(optarg, NULL, 10);
+            if (opt_dedup_mem == 0) {
+                fprintf(stderr,"--dedup-mem must be at least 1\n");
+                usage(argv[0]);
+            }
+            break;
+        case OPT_SINK:
+            if (opt_sinks_cnt == TEE_SINKS_MAX) {
+                fprintf(stderr,"At most %d sinks are supported\n", TEE_SINKS_MAX);
+                usage(argv[0]);
+            }
+            if (!parse_sink(optarg, opt_sinks[opt_sinks_cnt++])) {
+                fprintf(stderr,"Bad --sink, base= is required\n");
+                usage(argv[0]);
+            }
+            break;
+        case OPT_SPOOL:
+            opt_spool = optarg;
+            break;
+        case OPT_SPOOL_SIZE:
+            opt_spool_size = strtoul(optarg, NULL, 10);
+            if (opt_spool_size == 0) {
+                fprintf(stderr,"--spool-size must be at least 1\n");
+                usage(argv[0]);
+            }
+            break;
+        case OPT_ADAPT_LEVEL:
+            if (sscanf(optarg, "%d:%d", &opt_adapt_min, &opt_adapt_max) != 2 ||
+                opt_adapt_min < 0 || opt_adapt_min > opt_adapt_max) {
+                fprintf(stderr,"Bad --adapt-level, expected <min>:<max>: %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case OPT_SHARDS:
+            opt_shards = strtoul(optarg, NULL, 10);
+            if (opt_shards > 99) {
+                fprintf(stderr,"At most 99 shards are supported\n");
+                usage(argv[0]);
+            }
+            break;
         default:
             fprintf(stderr,"unknown option: %c\n",c);
             usage(argv[0]);
@@ -252,40 +817,68 @@ main(int argc, char *argv[]) {
     MTC_Log tclog;
     tclog.set_log_level(opt_verbose);
 
-    if (opt_compress_type == NULL && opt_compress_level >= 0) {
+    MTC_Compressor::codec_t codec = MTC_Compressor::CODEC_ZSTD;
+    bool use_compressor = false;
+    if (opt_compress_type &&
+        MTC_Compressor::parse_codec(opt_compress_type, codec)) {
+        //compressed on our own threads, libtrace writes plain data
+        if (!MTC_Compressor::available(codec))
+            tclog.panic("mtracecap was built without %s support\n", opt_compress_type);
+        if (opt_pipeout)
+            tclog.panic("-Z %s cannot be combined with --pipeout\n", opt_compress_type);
+        use_compressor = true;
+        compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
+    } else if (opt_compress_type == NULL && opt_compress_level >= 0) {
         fprintf(stderr, "Compression level set, but no compression type was defined, setting to gzip\n");
         compress_type = TRACE_OPTION_COMPRESSTYPE_ZLIB;
     } else if (opt_compress_type == NULL) {
         /* If a level or type is not specified, use the "none"
          * compression module */
         compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
-    } else if (strncmp(opt_compress_type, "gz", 2) == 0 ||
-               strncmp(opt_compress_type, "zlib", 4) == 0) {
-        compress_type = TRACE_OPTION_COMPRESSTYPE_ZLIB;
-    } else if (strncmp(opt_compress_type, "bz", 2) == 0) {
-        compress_type = TRACE_OPTION_COMPRESSTYPE_BZ2;
-    } else if (strncmp(opt_compress_type, "lzo", 3) == 0) {
-        compress_type = TRACE_OPTION_COMPRESSTYPE_LZO;
-    } else if (strncmp(opt_compress_type, "xz", 2) == 0) {
-        compress_type = TRACE_OPTION_COMPRESSTYPE_LZMA;
-    } else if (strncmp(opt_compress_type, "no", 2) == 0) {
-        compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
-    } else {
+    } else if (!parse_compress_type(opt_compress_type, compress_type)) {
         tclog.panic("Unknown compression type: %s\n", opt_compress_type);
     }
+    int adapt_start = -1;
+    if (opt_adapt_max >= 0) {
+        const char *type = opt_compress_type ? opt_compress_type : "gzip";
+        if (!use_compressor && (compress_type == TRACE_OPTION_COMPRESSTYPE_NONE ||
+                                compress_type == TRACE_OPTION_COMPRESSTYPE_LZO))
+            tclog.panic("--adapt-level needs a -Z type that has levels\n");
+        //zstd's level 0 is its default, 3
+        int bottom = (use_compressor && codec == MTC_Compressor::CODEC_ZSTD) ? 1 : 0;
+        int top    = use_compressor ? MTC_Compressor::max_level(codec) : 9;
+        if (opt_adapt_min < bottom || opt_adapt_max > top)
+            tclog.panic("--adapt-level for %s must be within %d:%d\n", type, bottom, top);
+        //-z is where it starts, the controller keeps it within range
+        adapt_start = (opt_compress_level >= 0) ? opt_compress_level : opt_adapt_min;
+    }
     
     timeval now;
     ::gettimeofday(&now, NULL);
 
-    MTC_Output *tco = 0;
+    if (opt_shards > 1 && !opt_basename)
+        tclog.panic("--shards needs -B: every shard writes its own files\n");
+    if (opt_shards > 1 && opt_sinks_cnt)
+        tclog.panic("--sink cannot be combined with --shards\n");
+    size_t shards_cnt = (opt_shards > 1) ? opt_shards : 1;
+    //with --sink the main output is the first of the sinks
+    size_t outs_cnt = shards_cnt + opt_sinks_cnt;
+    MTC_Output **outs = new MTC_Output*[outs_cnt];
     if (opt_basename) {
         // if basename is given, this is a uri
         // to a rotatable file and all our arguments are input uri's
-        tco = new MTC_Output(0, opt_basename, now, tclog);
+        for (size_t s = 0; s < shards_cnt; ++s) {
+            //the uri is split in place, every shard needs its own copy
+            char *base = (s + 1 < shards_cnt) ? strdup(opt_basename) : opt_basename;
+            outs[s] = new MTC_Output(0, base, now, tclog);
+        }
     } else {
         // if no basename, first argument is output uri
-        tco = new MTC_Output(argv[optind++], 0, now, tclog);
+        outs[0] = new MTC_Output(argv[optind++], 0, now, tclog);
     }
+    for (size_t k = 0; k < opt_sinks_cnt; ++k)
+        outs[1 + k] = new MTC_Output(0, opt_sinks[k].basename_, now, tclog);
+    MTC_Output *tco = outs[0];
     //the rest are input uris
 
 
@@ -297,41 +890,93 @@ main(int argc, char *argv[]) {
     sigaction(SIGTERM,&sigact, NULL);
     sigaction(SIGCHLD, &sigact, NULL);
 
-    int inputs = argc - optind;
+    //with --input-queues every uri is read as several inputs, one per queue
+    int uris   = argc - optind;
+    int queues = (opt_input_queues > 1) ? opt_input_queues : 1;
+    int inputs = uris*queues;
+
+    //before the first input queue or output thread starts
+    MTC_Affinity::init();
+    if (opt_numa_local) {
+        MTC_Affinity::set_numa_local();
+        for (int u = 0; u < uris; ++u) {
+            int node = MTC_Affinity::nic_node(argv[u+optind]);
+            if (node < 0)
+                tclog.warn("no NUMA node known for %s\n", argv[u+optind]);
+            for (int n = 0; n < queues; ++n)
+                MTC_Affinity::set_input_node(u*queues + n, node);
+        }
+    }
+    MTC_Affinity::dump(inputs, tclog);
     
     input = new MTC_Input[inputs];
+    MTC_ParallelInput **parallel = 0;
+    if (queues > 1)
+        parallel = new MTC_ParallelInput*[uris];
+
+    //slicing needs the headers captured, whatever their depth
+    MTC_Slicer *slicer = 0;
+    if (opt_slice_payload >= 0)
+        slicer = new MTC_Slicer(opt_slice_payload);
+    if (opt_snaplen < 0)
+        opt_snaplen = slicer ? SLICE_HEADROOM + opt_slice_payload : 64;
+    //-s is for the main output, sinks may keep more
+    int capture_snaplen = opt_snaplen;
+    for (size_t k = 0; k < opt_sinks_cnt; ++k) {
+        if (opt_sinks[k].snaplen_ == 0)
+            opt_sinks[k].snaplen_ = opt_snaplen;
+        if (opt_sinks[k].snaplen_ > (ulong)capture_snaplen)
+            capture_snaplen = opt_sinks[k].snaplen_;
+    }
 
     struct libtrace_filter_t *filter = NULL;
     if (opt_filter) {
         filter = trace_create_filter(opt_filter);
     }
-    for (i = 0; i < inputs; ++i) {
+    for (int u = 0; u < uris; ++u) {
         //libtrace_packet_t *p = trace_create_packet();
-        const char *uri = argv[i+optind];
+        const char *uri = argv[u+optind];
         libtrace_t *f = ::trace_create(uri);
         if (::trace_is_err(f)) {
             trace_perror(f, "trace_create");
             exit(1);
         }
-        if (trace_set_event_realtime(f, true) < 0) {
+        if (parallel) {
+            trace_set_tracetime(f, true);
+        } else if (trace_set_event_realtime(f, true) < 0) {
             trace_get_err(f);
         }
-        trace_set_snaplen(f, opt_snaplen);
+        trace_set_snaplen(f, capture_snaplen);
         if (filter) {
             if (trace_config(f, TRACE_OPTION_FILTER, filter) != 0) {
                 trace_perror(f, "Failed to setup filter for %s\n", uri);
                 exit(1);
             }
         }
-        input[i].in_ = f;
-        input[i].uri_= uri;
-        input[i].active_ = true;
+        if (parallel) {
+            MTC_Input *q = &input[u*queues];
+            for (int n = 0; n < queues; ++n) {
+                q[n].in_     = f;
+                q[n].uri_    = uri;
+                q[n].queue_  = n;
+                q[n].active_ = true;
+                q[n].slicer_ = slicer;
+                q[n].capture_ = new MTC_Capture(&q[n], u*queues + n, opt_ringsize, tclog);
+            }
+            parallel[u] = new MTC_ParallelInput(f, q, queues, tclog);
+            parallel[u]->start();
+            continue;
+        }
+        input[u].in_ = f;
+        input[u].uri_= uri;
+        input[u].active_ = true;
+        input[u].slicer_ = slicer;
         if (trace_start(f) == -1) {
             trace_perror(f, "trace_start");
             exit(1);
         }
-        libtrace_stat_t *stat = trace_get_statistics(input[i].in_, NULL);
-        input[i].segment_drops_ = stat->dropped;
+        input[u].update_drops();
+        input[u].segment_drops_ = input[u].dropped();
     }
 
     if (opt_relinquish) {
@@ -345,205 +990,575 @@ main(int argc, char *argv[]) {
             tclog.panic("Failed to drop root privileges: %s", strerror(errno));
         }
     }
-    if (opt_seqnumfile) {
-        tco->set_seqnumfile(opt_seqnumfile);
+    MTC_Compressor *compressor = 0;
+    if (use_compressor) {
+        //one worker pool for all shards
+        compressor = new MTC_Compressor(codec,
+                                        (opt_compress_level >= 0) ? opt_compress_level : 0,
+                                        opt_compress_threads,
+                                        1024*opt_compress_block, tclog);
     }
-    if (opt_compress_level >= 0 &&
-        compress_type != TRACE_OPTION_COMPRESSTYPE_NONE) {
-        tco->set_compression(compress_type, opt_compress_level);
+    std::vector<MTC_Compressor*> sink_compressors;
+    std::atomic<uint64_t> input_drops(0);
+    bool shared_drops = adapt_start >= 0 && outs_cnt > 1;
+    if (opt_preopen && !opt_basename)
+        tclog.warn("--preopen only applies to -B, ignored\n");
+    for (size_t s = 0; s < outs_cnt; ++s) {
+        MTC_Output *o = outs[s];
+        const sink_opt_t *sink = (s > 0 && opt_sinks_cnt) ? &opt_sinks[s - 1] : 0;
+        if (shards_cnt > 1)
+            o->set_shard(s);
+        if (opt_seqnumfile) {
+            if (shards_cnt > 1 || sink) {
+                //every shard or sink counts its own segments, the main
+                //output next to sinks keeps the file it had without them
+                char *fn = new char[strlen(opt_seqnumfile) + 8];
+                sprintf(fn, sink ? "%s.k%02lu" : "%s.s%02lu", opt_seqnumfile, (ulong)s);
+                o->set_seqnumfile(fn);
+            } else {
+                o->set_seqnumfile(opt_seqnumfile);
+            }
+        }
+        MTC_Compressor *comp = compressor;
+        if (sink && sink->compress_type_) {
+            //instead of -Z/-z
+            MTC_Compressor::codec_t sink_codec;
+            trace_option_compresstype_t sink_type = TRACE_OPTION_COMPRESSTYPE_NONE;
+            int level = sink->compress_level_;
+            if (MTC_Compressor::parse_codec(sink->compress_type_, sink_codec)) {
+                if (!MTC_Compressor::available(sink_codec))
+                    tclog.panic("mtracecap was built without %s support\n", sink->compress_type_);
+                if (opt_pipeout)
+                    tclog.panic("compress=%s cannot be combined with --pipeout\n",
+                                sink->compress_type_);
+                comp = new MTC_Compressor(sink_codec, (level >= 0) ? level : 0,
+                                          opt_compress_threads,
+                                          1024*opt_compress_block, tclog);
+                sink_compressors.push_back(comp);
+            } else if (parse_compress_type(sink->compress_type_, sink_type)) {
+                comp = 0;
+            } else {
+                tclog.panic("Unknown compression type: %s\n", sink->compress_type_);
+            }
+            o->set_compression(sink_type, (level >= 0) ? level : 6);
+        } else if (adapt_start >= 0) {
+            if (!comp)
+                o->set_compression(compress_type, adapt_start);
+            o->set_adapt_level(opt_adapt_min, opt_adapt_max, adapt_start);
+            if (outs_cnt > 1)
+                o->set_input_drops(&input_drops);
+        } else if (opt_compress_level >= 0 &&
+                   compress_type != TRACE_OPTION_COMPRESSTYPE_NONE) {
+            o->set_compression(compress_type, opt_compress_level);
+        }
+
+        if (opt_watchfile) {
+            o->set_watchfile(opt_watchfile);
+        }
+        if (sink && sink->segmentsize_) {
+            o->set_segmentsize(1024*1024*sink->segmentsize_);
+        } else if (opt_segmentsize) {
+            o->set_segmentsize(1024*1024*opt_segmentsize); //Mbytes to bytes
+        }
+        if (opt_rotatesec && outs_cnt == 1) {
+            //shards are rotated together by MTC_ShardSet, sinks by MTC_Tee
+            o->set_rotatesec(opt_rotatesec);
+        }
+        if (opt_extension) {
+            o->set_extension(opt_extension);
+        }
+
+        o->set_useutc(opt_useutc);
+        o->set_close_queue(opt_close_queue);
+        if (opt_pipeout) {
+            o->set_pipeout((char* const*)opt_pipe_arg);
+        }
+        o->set_direct_io(opt_direct_io);
+        o->set_index(opt_index_ms);
+        if (comp)
+            o->set_compressor(comp);
+        if (opt_preopen)
+            o->set_preopen();
     }
+    if (outs_cnt == 1)
+        tco->set_inputs(input, inputs); //per-input segment stats
 
-    if (opt_watchfile) {
-        tco->set_watchfile(opt_watchfile);
+    if (opt_poolsize == 0) {
+        //capture threads keep their whole ring plus a scratch packet
+        opt_poolsize = PACKET_POOL_DEFAULT;
+        if (opt_capture_threads && !parallel)
+            opt_poolsize += inputs*(mtc_ring_capacity(opt_ringsize) + 1);
+        else if (opt_reorder_us)
+            opt_poolsize += opt_reorder_max;
+        if (opt_sinks_cnt)
+            opt_poolsize += MTC_Tee::held_max(SHARD_RING_DEFAULT);
+        else if (outs_cnt > 1)
+            opt_poolsize += outs_cnt*(mtc_ring_capacity(SHARD_RING_DEFAULT) + SHARD_BATCH);
     }
-    if (opt_segmentsize) {
-        tco->set_segmentsize(1024*1024*opt_segmentsize); //Mbytes to bytes
+    if (opt_pool_hugepages) {
+        for (i = 0; i < inputs; ++i) {
+            if (!copies_packets(input[i].uri_)) {
+                tclog.warn("%s may be zero-copy, not using hugepage packet buffers\n",
+                           input[i].uri_);
+                opt_pool_hugepages = false;
+                break;
+            }
+        }
     }
-    if (opt_rotatesec) {
-        tco->set_rotatesec(opt_rotatesec);
+    /* memory goes to the node of the thread that first touches it, which
+     * for packet buffers would be whoever reads into them first. Fault
+     * the pool in right away, from the NICs' node. Zero-copy formats
+     * read into memory of their own, there is nothing to place. */
+    bool on_node = false;
+    if (opt_numa_local) {
+        on_node = MTC_Affinity::place_node(MTC_Affinity::common_node(), tclog);
+        if (!on_node)
+            tclog.warn("inputs share no NUMA node, packet pool is not placed\n");
     }
-    if (opt_extension) {
-        tco->set_extension(opt_extension);
+    MTC_PacketPool *pool = new MTC_PacketPool(opt_poolsize, opt_pool_hugepages, tclog);
+    if (on_node) {
+        bool copying = true;
+        for (i = 0; i < inputs; ++i)
+            copying = copying && copies_packets(input[i].uri_);
+        if (copying)
+            pool->prefault(capture_snaplen);
     }
+    tco->set_pool(pool);
+    MTC_Affinity::place(MTC_Affinity::ROLE_MERGE, 0, tclog);
 
-    tco->set_useutc(opt_useutc);
-    if (opt_pipeout) {
-        tco->set_pipeout((char* const*)opt_pipe_arg);
+    MTC_Stats *stats = 0;
+    time_t     stats_sec = 0;
+    if (opt_stats_file) {
+        stats = new MTC_Stats(opt_stats_file, inputs, outs_cnt, tclog);
+        for (i = 0; i < inputs; ++i) {
+            input[i].stats_ = stats->input(i);
+            if (input[i].queue_ >= 0)
+                snprintf(input[i].stats_->uri_, sizeof(input[i].stats_->uri_), "%s#%d",
+                         input[i].uri_, input[i].queue_);
+            else
+                snprintf(input[i].stats_->uri_, sizeof(input[i].stats_->uri_), "%s",
+                         input[i].uri_);
+        }
+        for (size_t s = 0; s < outs_cnt; ++s)
+            outs[s]->set_stats(stats->output(s));
+    }
+    if (opt_latency_sample) {
+        for (i = 0; i < inputs; ++i) {
+            input[i].lat_dequeue_ = new MTC_Latency("dequeue", opt_latency_sample);
+            input[i].lat_merge_   = new MTC_Latency("merge", opt_latency_sample);
+        }
+        for (size_t s = 0; s < outs_cnt; ++s)
+            outs[s]->set_latency(opt_latency_sample);
+    }
+
+    if (opt_capture_threads && !parallel) {
+        for (i = 0; i < inputs; ++i) {
+            input[i].capture_ = new MTC_Capture(&input[i], i, opt_ringsize, *pool, tclog);
+            input[i].capture_->start();
+        }
     }
-    tco->set_inputs(input, inputs);
 
    
-    fd_set rfds;
-    timeval maxwait_tv;
-    maxwait_tv.tv_sec = (opt_maxwait / 1000);
-    maxwait_tv.tv_usec= (opt_maxwait % 1000)*1000;
-        
-    //int maxfd = -1;
-    FD_ZERO(&rfds);
     int active_inputs = inputs;
     libtrace_packet_t *p = 0;
-    int ret=0;
+    MTC_Reorder *reorder = 0;
+    if (opt_reorder_us)
+        reorder = new MTC_Reorder(opt_reorder_us, opt_reorder_max);
+    MTC_Dedup *dedup = 0;
+    if (opt_dedup_us) {
+        if (inputs < 2)
+            tclog.warn("--dedup-us only drops copies seen on another input\n");
+        dedup = new MTC_Dedup(opt_dedup_us, opt_dedup_mem, capture_snaplen);
+    }
+    MTC_Merge  merge(inputs);
+    MTC_Poller poller(inputs, tclog);
+    int        since_poll = 0;
+    //active inputs that have no head packet in the merge yet
+    int *needy = new int[inputs];
+    int  needy_cnt = inputs;
+    for (i = 0; i < inputs; ++i)
+        needy[i] = i;
+    release_ctx_t release_ctx = { input, pool };
+    MTC_ShardSet *shards = 0;
+    MTC_Tee      *tee = 0;
+    MTC_Tee::sink_t *tee_sinks = 0;
+    if (opt_sinks_cnt) {
+        //the main output is sink 0, with -F applied to the inputs already
+        tee_sinks = new MTC_Tee::sink_t[outs_cnt];
+        for (size_t s = 0; s < outs_cnt; ++s) {
+            const sink_opt_t *sink = s ? &opt_sinks[s - 1] : 0;
+            size_t snaplen = sink ? sink->snaplen_ : opt_snaplen;
+            tee_sinks[s].out_       = outs[s];
+            tee_sinks[s].filter_    = (sink && sink->filter_) ?
+                trace_create_filter(sink->filter_) : 0;
+            tee_sinks[s].snaplen_   = (snaplen < (size_t)capture_snaplen) ? snaplen : 0;
+            tee_sinks[s].rotatesec_ = (sink && sink->rotatesec_) ? sink->rotatesec_ : opt_rotatesec;
+        }
+        tee = new MTC_Tee(tee_sinks, outs_cnt, SHARD_RING_DEFAULT,
+                          release_written, &release_ctx, tclog);
+        tee->start();
+    } else if (outs_cnt > 1) {
+        shards = new MTC_ShardSet(outs, outs_cnt, SHARD_RING_DEFAULT, opt_rotatesec,
+                                  release_written, &release_ctx, tclog);
+        shards->start();
+    }
+    const timeval &last_rotated = shards ? shards->last_rotated() : tco->last_rotated();
+    MTC_Watchfile *watch = opt_watchfile ? new MTC_Watchfile(opt_watchfile, tclog) : 0;
+    MTC_Spool     *spool = 0;
+    if (opt_spool && outs_cnt > 1) {
+        tclog.warn("--spool only applies to a single output, ignored\n");
+    } else if (opt_spool && !use_compressor && !opt_pipeout && !opt_direct_io) {
+        //a plain file has no pipe that could be seen filling up
+        tclog.warn("--spool needs -Z lz4/zstd, --pipeout or --direct-io, ignored\n");
+    } else if (opt_spool) {
+        spool = new MTC_Spool(opt_spool, opt_spool_size, tclog);
+        if (stats)
+            spool->set_stats(stats->output(0));
+    }
+    emit_batch_t batch;
+    batch.cnt_    = 0;
+    batch.shards_ = shards;
+    batch.tee_    = tee;
+    batch.spool_  = spool;
     while (active_inputs > 0 && !signalled) {
-        timeval wait_tv = maxwait_tv; //not waiting more than that for ALL fds
         gettimeofday(&now, NULL);
-        if (opt_rotatesec && (now.tv_sec >= tco->last_rotated().tv_sec + opt_rotatesec)) {
-            tco->rotate_trace(now); //force rotation by time
+        if (now.tv_sec != stats_sec) {
+            sample_drops(input, inputs);
+            if (stats)
+                refresh_stats(stats, input, inputs);
+            if (shared_drops)
+                publish_drops(input, inputs, input_drops);
+            stats_sec = now.tv_sec;
         }
-        uint64_t ts;
-        uint64_t mintime_erf = -1;
-        int      mintime_idx = -1;
-        int      sources = 0;
-        for (i = 0; i < inputs; ++i) {
-            if (!input[i].active_)
-                continue;
-            if (input[i].packet_) {
-                ts = trace_get_erf_timestamp(input[i].packet_);
-                ++sources;
-                if (ts < mintime_erf) {
-                    mintime_erf = ts;
-                    mintime_idx = i;
+        long rotate_ms = -1; //until a sink's next time-driven rotation
+        if (tee) {
+            rotate_ms = tee->rotate_idle(now); //every sink on its own schedule
+        } else if (opt_rotatesec && (!spool || spool->empty()) &&
+                   (now.tv_sec >= last_rotated.tv_sec + opt_rotatesec)) {
+            //while packets are spooled, their timestamps rotate the output
+            flush_batch(tco, batch, input, pool); //belongs to the old segment
+            if (shards)
+                shards->rotate_trace(now); //all shards at the same point
+            else
+                tco->rotate_trace(now); //force rotation by time
+        }
+        if (watch && outputs_gated(outs, outs_cnt) && !watch->present()) {
+            //-W: nothing can be written until the watchfile is back.
+            //What was read already goes to the outputs, which count and
+            //drop it, then the inputs stop rather than overflow the NIC
+            if (reorder) {
+                MTC_Reorder::entry_t e;
+                while (reorder->pop_flush(e))
+                    emit_packet(tco, batch, input, e.idx_, e.packet_, e.ts_, pool);
+            }
+            while (!merge.empty()) {
+                uint64_t head_ts = merge.top_ts();
+                i = merge.pop();
+                emit_packet(tco, batch, input, i, input[i].packet_, head_ts, pool);
+                input[i].packet_ = 0;
+                needy[needy_cnt++] = i;
+            }
+            flush_batch(tco, batch, input, pool);
+            tclog.warn("capture paused until %s exists\n", opt_watchfile);
+            pause_inputs(input, inputs, parallel, uris, poller, true);
+            int wait_ms = (opt_capture_threads || parallel) ? GATE_DRAIN_MS : opt_maxwait;
+            do {
+                //capture threads hold their input until the ring is empty
+                for (i = 0; i < inputs; ++i) {
+                    MTC_Capture::slot_t s;
+                    while (input[i].capture_ && input[i].capture_->pop(s)) {
+                        account_packet(input[i], i, s.packet_, s.ts_, tclog);
+                        emit_packet(tco, batch, input, i, s.packet_, s.ts_, pool);
+                    }
+                }
+                flush_batch(tco, batch, input, pool);
+                gettimeofday(&now, NULL);
+                if (now.tv_sec != stats_sec) {
+                    sample_drops(input, inputs);
+                    if (stats)
+                        refresh_stats(stats, input, inputs);
+                    if (shared_drops)
+                        publish_drops(input, inputs, input_drops);
+                    stats_sec = now.tv_sec;
                 }
-                continue; //already have a packet
-            }            
-            if (p == 0)
-                p = trace_create_packet();
-            libtrace_eventobj_t evt = trace_event(input[i].in_, p);
-            
-            //uint64_t ts = trace_get_erf_timestamp(p);
-            switch (evt.type) {
-            case TRACE_EVENT_SLEEP:
-                tclog.debug("sleep event on %s (%d, for %es)\n",
-                            input[i].uri_, i, evt.seconds);
-#if 0
-                FD_ZERO(&rfds);
-                FD_SET(evt.fd, &rfds);
-                {
-                    struct timeval tv;
-                    tv.tv_sec = int(evt.seconds);
-                    tv.tv_usec= (evt.seconds - tv.tv_sec)*1e6;
-                    select(0, &rfds, NULL, NULL, &tv);
+            } while (!watch->wait(wait_ms) && !signalled);
+            pause_inputs(input, inputs, parallel, uris, poller, false);
+            tclog.warn("capture resumed\n");
+            continue;
+        }
+        if (poller.parked_cnt() > 0) {
+            if (merge.empty() && poller.parked_cnt() == (size_t)needy_cnt) {
+                //every input is idle: sleep until one of them wakes up,
+                //but not past the next time-driven rotation
+                long wait_ms = opt_maxwait;
+                if (rotate_ms >= 0 && rotate_ms < wait_ms)
+                    wait_ms = rotate_ms;
+                if (opt_rotatesec && !tee) {
+                    long until = (last_rotated.tv_sec + opt_rotatesec - now.tv_sec)*1000
+                        - now.tv_usec/1000;
+                    if (until < wait_ms)
+                        wait_ms = (until > 0) ? until : 0;
                 }
-#else
-                //--i; //retry immediately
+                if (reorder && !reorder->empty() && (long)reorder->window_ms() < wait_ms)
+                    wait_ms = reorder->window_ms(); //held packets are due by then
+                if (spool && !spool->empty() && SPOOL_DRAIN_MS < wait_ms)
+                    wait_ms = SPOOL_DRAIN_MS; //the output may have room by then
+                poller.wait(wait_ms);
+                since_poll = 0;
+            } else if (merge.empty() || since_poll >= POLL_PACKETS) {
+                poller.wait(0);
+                since_poll = 0;
+            }
+        }
+        uint64_t ts;
+        for (int n = 0; n < needy_cnt; ) {
+            i = needy[n];
+            if (poller.parked(i)) {
+                ++n;
                 continue;
-#endif
-
-            case TRACE_EVENT_IOWAIT:
-                //fprintf(stderr, "iowait, %d\n", i); 
-                if ((wait_tv.tv_sec | wait_tv.tv_usec) == 0) {
-                    //no more waiting!
+            }
+            if (input[i].capture_) {
+                MTC_Capture::slot_t s;
+                if (!input[i].capture_->pop(s)) {
+                    if (input[i].capture_->finished()) {
+                        tclog.debug("capture thread done on %d (%s)\n", i, input[i].uri_);
+                        input[i].active_ = false;
+                        --active_inputs;
+                        needy[n] = needy[--needy_cnt];
+                    } else {
+                        ++n;
+                    }
                     continue;
                 }
-                FD_ZERO(&rfds);
-                FD_SET(evt.fd, &rfds);
-                ret = select(evt.fd + 1, &rfds, NULL, NULL, &wait_tv);
-                if (ret == 0) {
-                    continue; //timeout
-                } else if (ret < 0) {
-                    if (errno != EINTR)
-                        tclog.warn("select returned error for wating on fd %d (%s)\n",
-                                   evt.fd, input[i].uri_);
+                input[i].packet_ = s.packet_;
+                ts = s.ts_;
+            } else {
+                if (p == 0)
+                    p = pool->get();
+                libtrace_eventobj_t evt = trace_event(input[i].in_, p);
+
+                switch (evt.type) {
+                case TRACE_EVENT_SLEEP:
+                    tclog.debug("sleep event on %s (%d, for %es)\n",
+                                input[i].uri_, i, evt.seconds);
+                    poller.park_sleep(i, evt.seconds);
+                    ++n;
                     continue;
-                }
-                assert(ret == 1);
-                evt = trace_event(input[i].in_, p);
-                if (evt.type != TRACE_EVENT_PACKET) {
-                    tclog.warn("event type: %d\n", evt.type);
-                    //--i; //retry immediately
+
+                case TRACE_EVENT_IOWAIT:
+                    poller.park_fd(i, evt.fd);
+                    ++n;
                     continue;
-                }
-                //assert(evt.type == TRACE_EVENT_PACKET);
-
-                /* FALLTHROUGH */
-                
-            case TRACE_EVENT_PACKET:
-                {
-                    uint16_t ethertype;
-                    uint32_t remaining;
-                    void *vp = trace_get_layer3(p, &ethertype, &remaining);
-                    if (!vp || ethertype == 0xffff) {
-                        tclog.warn("skipping non L3 (ethernet) packet on %s\n", input[i].uri_);
-                        --i; /* xxx rerun the same input */
-                        continue;
+
+                case TRACE_EVENT_PACKET:
+                    {
+                        uint16_t ethertype;
+                        uint32_t remaining;
+                        void *vp = trace_get_layer3(p, &ethertype, &remaining);
+                        if (!vp || ethertype == 0xffff) {
+                            tclog.warn("skipping non L3 (ethernet) packet on %s\n", input[i].uri_);
+                            continue; /* rerun the same input */
+                        }
+                        if (input[i].slicer_)
+                            input[i].sliced_bytes_ +=
+                                input[i].slicer_->slice(p, vp, ethertype, remaining);
                     }
+                    input[i].packet_ = p;
+                    ts = trace_get_erf_timestamp(p);
+                    p = 0;
+                    break;
+                case TRACE_EVENT_TERMINATE:
+                    //end of trace
+                    tclog.debug("TERMINATE on %d (%s)\n", i, input[i].uri_);
+                    input[i].active_ = false;
+                    assert(input[i].packet_ == 0);
+                    poller.forget(i);
+                    --active_inputs;
+                    needy[n] = needy[--needy_cnt];
+                    continue;
+                default:
+                    fprintf(stderr, "Unknown event type occured\n");
+                    trace_perror(input[i].in_, "%s", argv[i+2]);
+                    exit(1);
                 }
-                //fprintf(stderr, "pushed: %p\n", p);
-                input[i].packet_ = p;
-                ts = trace_get_erf_timestamp(p);
-                ++sources;
-                if (ts < mintime_erf) {
-                    mintime_erf = ts;
-                    mintime_idx = i;
-                }
-                //                ++total_packets;
-                ++input[i].total_packets_;
-                ++input[i].segment_packets_;
-                if (input[i].prev_ts_ > ts) {
-                    tclog.warn("disorder on input %d: %.6f, packet: %llu\n",
-                               i,
-                               (double)(input[i].prev_ts_-ts)/(1ULL<<32),
-                               input[i].total_packets_);
-                }
-                input[i].prev_ts_ = ts;
-                p = 0;
-                continue;
-            case TRACE_EVENT_TERMINATE:
-                //end of trace
-                tclog.debug("TERMINATE on %d (%s)\n", i, input[i].uri_);
-                input[i].active_ = false;
-                assert(input[i].packet_ == 0);
-                --active_inputs;
-                continue;
-            default:
-                fprintf(stderr, "Unknown event type occured\n");
-                trace_perror(input[i].in_, "%s", argv[i+2]);
-                exit(1);
             }
-
-            //oldest_ts>trace_get_erf_timestamp(packet[i]))) {
+            //input i has a head packet now
+            merge.push(i, ts);
+            account_packet(input[i], i, input[i].packet_, ts, tclog);
+            needy[n] = needy[--needy_cnt];
         }
-        if (mintime_idx == -1) {
+        if (merge.empty()) {
             //fprintf(stderr, "no packets!\n");
+            if (reorder) {
+                MTC_Reorder::entry_t e;
+                while (reorder->pop_idle(e))
+                    emit_packet(tco, batch, input, e.idx_, e.packet_, e.ts_, pool);
+            }
+            //nothing else is coming right now, don't sit on packets
+            flush_batch(tco, batch, input, pool);
+            if (opt_capture_threads || parallel)
+                usleep(RING_IDLE_US); //rings are empty, let them fill
             continue;
         }
-        if (p) {
-            trace_destroy_packet(p);
-            p = 0;
-        }
-        //fprintf(stderr, "%d\n", sources);
-        p = input[mintime_idx].packet_;
-
-        //check if we need to rotate
-        timeval ptv = trace_get_timeval(p);
-        if (opt_rotatesec && (ptv.tv_sec >= tco->last_rotated().tv_sec + opt_rotatesec)) {
-            tco->rotate_trace(ptv); //force rotation by time
-        }
+        uint64_t mintime_erf = merge.top_ts();
+        int      mintime_idx = merge.pop();
+        libtrace_packet_t *mp = input[mintime_idx].packet_;
+        input[mintime_idx].packet_ = 0;
+        needy[needy_cnt++] = mintime_idx;
+        if (input[mintime_idx].lat_merge_ && input[mintime_idx].lat_merge_->due())
+            input[mintime_idx].lat_merge_->record_age(mintime_erf);
 
-        tco->write_packet(p);
+        if (dedup && dedup->duplicate(mp, mintime_idx, mintime_erf)) {
+            ++input[mintime_idx].dup_drops_;
+            if (input[mintime_idx].stats_)
+                mtc_stat_add(input[mintime_idx].stats_->dup_drops_, 1);
+            release_packet(input[mintime_idx], mp, pool);
+        } else if (!reorder) {
+            emit_packet(tco, batch, input, mintime_idx, mp, mintime_erf, pool);
+            ++since_poll;
+        } else if (reorder->late(mintime_erf)) {
+            //older than what has been written already
+            ++input[mintime_idx].late_drops_;
+            release_packet(input[mintime_idx], mp, pool);
+        } else {
+            MTC_Reorder::entry_t e;
+            if (reorder->full() && reorder->pop_forced(e))
+                emit_packet(tco, batch, input, e.idx_, e.packet_, e.ts_, pool);
+            reorder->push(mp, mintime_idx, mintime_erf);
 
-        input[mintime_idx].packet_ = 0;
+            //oldest timestamp any active input may still deliver: heads in
+            //the merge are newer than their input's last one
+            uint64_t low = merge.empty() ? (uint64_t)-1 : merge.top_ts();
+            for (int n = 0; n < needy_cnt; ++n) {
+                if (input[needy[n]].prev_ts_ < low)
+                    low = input[needy[n]].prev_ts_;
+            }
+            while (reorder->pop_ready(low, e)) {
+                emit_packet(tco, batch, input, e.idx_, e.packet_, e.ts_, pool);
+                ++since_poll;
+            }
+        }
     }
-    if (p) {
-        trace_destroy_packet(p);
-        p = 0;
+    delete [] needy;
+    delete watch;
+    if (reorder) {
+        MTC_Reorder::entry_t e;
+        while (reorder->pop_flush(e))
+            emit_packet(tco, batch, input, e.idx_, e.packet_, e.ts_, pool);
+    }
+    flush_batch(tco, batch, input, pool);
+    while (spool && !spool->empty())
+        drain_spool(tco, *spool, true); //all of it, however long the output takes
+    if (shards) {
+        shards->stop(); //writes out what was dispatched, returns the packets
+        delete shards;
+        shards = 0;
+    }
+    if (tee) {
+        tee->stop(); //likewise, once every sink is done
+        delete tee;
+        tee = 0;
+        for (size_t s = 0; s < outs_cnt; ++s) {
+            if (tee_sinks[s].filter_)
+                trace_destroy_filter(tee_sinks[s].filter_);
+        }
+        delete [] tee_sinks;
     }
 
     if (opt_verbose) {
-        tco->dump_seg_stats();
-        tco->dump_tot_stats();
+        for (size_t s = 0; s < outs_cnt; ++s) {
+            outs[s]->dump_seg_stats();
+            outs[s]->dump_tot_stats();
+        }
+        if (reorder) {
+            tclog.warn("    reorder: window=%luus, high-water=%lu, forced=%lu\n",
+                       opt_reorder_us, reorder->high_water(), reorder->forced());
+        }
+        if (dedup) {
+            tclog.warn("    dedup: window=%luus, slots=%lu, evictions=%lu\n",
+                       opt_dedup_us, dedup->slots(), dedup->evictions());
+        }
+        if (spool) {
+            tclog.warn("    spool: size=%luMB, high-water=%.1fMB, spilled=%lu, drained=%lu, full=%lu\n",
+                       opt_spool_size, spool->high_water()/1048576.0, spool->spilled(),
+                       spool->drained(), spool->full());
+        }
     }
+    delete reorder;
+    delete dedup;
+    delete spool;
     //xxx make sure all packets are done
     gettimeofday(&now, NULL);
-    tco->rotate_trace(now);
+    for (size_t s = 0; s < outs_cnt; ++s) {
+        outs[s]->rotate_trace(now);
+        outs[s]->wait_closed();
+        outs[s]->set_compressor(0);
+    }
+    delete compressor;
+    for (size_t k = 0; k < sink_compressors.size(); ++k)
+        delete sink_compressors[k];
     
+    if (parallel) {
+        //no queue delivers anything from here on
+        for (int u = 0; u < uris; ++u)
+            parallel[u]->stop();
+    }
+    //packets must go before the traces they were read from
     for (i = 0; i < inputs; ++i) {
-        libtrace_stat_t *stat = trace_get_statistics(input[i].in_, NULL);
-        tclog.warn("closing input %d, total packets: %llu, drops: %lu\n",
-                   i, input[i].total_packets_, stat->dropped);
-        trace_destroy(input[i].in_);
+        if (input[i].capture_) {
+            input[i].capture_->join();
+            if (input[i].packet_) {
+                input[i].capture_->recycle(input[i].packet_);
+                input[i].packet_ = 0;
+            }
+            delete input[i].capture_;
+            input[i].capture_ = 0;
+        } else if (input[i].packet_) {
+            assert(signalled);
+            pool->put(input[i].packet_);
+            input[i].packet_ = 0;
+        }
+    }
+    if (p) {
+        pool->put(p);
+        p = 0;
+    }
+    if (parallel) {
+        for (int u = 0; u < uris; ++u)
+            delete parallel[u];
+        delete [] parallel;
+    }
+    tco->set_pool(0);
+    delete pool;
+
+    sample_drops(input, inputs); //the capture threads are gone
+    if (stats) {
+        //final values stay in the file for whoever looks next
+        refresh_stats(stats, input, inputs);
+        for (size_t s = 0; s < outs_cnt; ++s)
+            outs[s]->set_stats(0);
+        delete stats;
+    }
+    for (i = 0; i < inputs; ++i) {
+        tclog.warn("closing input %d, total packets: %llu, drops: %lu, ring drops: %lu, late: %lu, "
+                   "dups: %lu\n",
+                   i, input[i].total_packets_, input[i].dropped(),
+                   input[i].ring_drops_.load(), input[i].late_drops_, input[i].dup_drops_);
+        if (input[i].lat_dequeue_) {
+            char who[32];
+            snprintf(who, sizeof(who), "input=%d", i);
+            input[i].lat_dequeue_->dump_total(tclog, who);
+            input[i].lat_merge_->dump_total(tclog, who);
+            delete input[i].lat_dequeue_;
+            delete input[i].lat_merge_;
+        }
+        if (slicer)
+            tclog.warn("input %d: %lu bytes sliced off\n", i, input[i].sliced_bytes_);
+        if (input[i].queue_ <= 0)
+            trace_destroy(input[i].in_); //once for all queues
         input[i].active_ = false;
-        assert(signalled || (input[i].packet_ == 0));
     }
     delete [] input;
+    delete slicer;
     return 0;
 }